@@ -1 +1,5 @@
-#define SD_CS_PIN GPIO_PB2
\ No newline at end of file
+#define SD_CS_PIN GPIO_PB2
+
+// #define SD_CRC           // check the CRC of commands and data blocks
+// #define SD_CRC_RETRIES 3 // transfers of a block after a CRC error
+// #define SD_TIMER_TICKS   // timeouts from TIMER_getTicks(), see sd.h
@@ -16,4 +16,9 @@
 //#define UART_INIT_STDOUT
 // #define UART_INIT_STDIN
 
+// instance API (UART_dev functions) for USARTs other than UART_N, buffers and
+// baud rate are set up at runtime
+// #define UART_INSTANCE_0
+// #define UART_INSTANCE_1
+
 #endif /* UART_CONF_H */
@@ -0,0 +1,199 @@
+/*
+ * Mounts a FAT16/FAT32 disk image on a PC and measures the file system:
+ * counting the free clusters, write throughput, the slowest fwrite() call
+ * (cluster allocation) and read throughput, along with the number of sector
+ * transfers. With FAT_JOURNAL it also checks that a file opened again after a
+ * checkpoint has the checkpointed size.
+ *
+ * Usage: fat_image_example card.img [kbytes]
+ */
+#include <sd/disk_image.h>
+#include <sd/fat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define CHUNK_SIZE 4096 // bytes per fwrite() and freadInto() call
+
+static uint8_t chunk[CHUNK_SIZE];
+
+static double now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+#if FAT_JOURNAL == 1
+/* Write a checkpoint of 1500 bytes, open the file again and append 100 bytes
+ * to it, then check the size before and after mounting the volume again */
+static int journal_check(void)
+{
+    FAT_DIR dir;
+    FAT_FILE file;
+    uint16_t bw;
+    FSIZE_t size;
+
+    if (FAT_journalCreate() != FR_OK)
+    {
+        printf("journalCreate failed\n");
+        return 1;
+    }
+    FAT_makeFile("/log.txt");
+    FAT_openDir(&dir, "/");
+    if (FAT_fopen(&dir, &file, "log.txt") != FR_OK)
+        return 1;
+    FAT_ftruncate(&file);
+    FAT_fwrite(&file, chunk, 1500, &bw);
+    if (FAT_fcheckpoint(&file) != FR_OK)
+    {
+        printf("fcheckpoint failed\n");
+        return 1;
+    }
+
+    // The checkpointed size is only in the journal until the file is opened
+    FAT_fopen(&dir, &file, "log.txt");
+    size = file.file_size;
+    FAT_fseekEnd(&file);
+    FAT_fwrite(&file, chunk, 100, &bw);
+    FAT_fsync(&file);
+
+    FAT_unmountVolume();
+    if (FAT_mountVolume() != MR_OK)
+        return 1;
+    FAT_openDir(&dir, "/");
+    FAT_fopen(&dir, &file, "log.txt");
+    printf("journal reopened %lu bytes, remounted %lu bytes\n",
+           (unsigned long)size, (unsigned long)file.file_size);
+
+    return (size != 1500) || (file.file_size != 1600);
+}
+#endif
+
+static void reset_stats(void)
+{
+    IMAGE_Stats.reads         = 0;
+    IMAGE_Stats.writes        = 0;
+    IMAGE_Stats.sectors_read  = 0;
+    IMAGE_Stats.sectors_write = 0;
+}
+
+static void print_stats(const char *name, double us, uint32_t bytes)
+{
+    printf("%-6s %8.1f KiB/s  %6lu reads (%lu sectors)  %6lu writes (%lu "
+           "sectors)\n",
+           name, bytes / 1024.0 / (us / 1e6), (unsigned long)IMAGE_Stats.reads,
+           (unsigned long)IMAGE_Stats.sectors_read,
+           (unsigned long)IMAGE_Stats.writes,
+           (unsigned long)IMAGE_Stats.sectors_write);
+    reset_stats();
+}
+
+int main(int argc, char **argv)
+{
+    FAT_DIR dir;
+    FAT_FILE file;
+    FAT_FRESULT res;
+    uint32_t kbytes = 1024;
+    uint32_t i, done;
+    uint16_t bw, br;
+    double start, t, slowest = 0;
+
+    if (argc < 2)
+    {
+        printf("usage: %s card.img [kbytes]\n", argv[0]);
+        return 1;
+    }
+    if (argc > 2)
+        kbytes = atol(argv[2]);
+
+    if (IMAGE_open(argv[1]))
+    {
+        printf("can't open %s\n", argv[1]);
+        return 1;
+    }
+
+    FAT_bindDisk(&IMAGE_Disk);
+    if (FAT_mountVolume() != MR_OK)
+    {
+        printf("mount failed\n");
+        return 1;
+    }
+    printf("capacity %.1f MiB, free %llu bytes\n", FAT_volumeCapacityMB(),
+           (unsigned long long)FAT_volumeFreeSpace());
+    reset_stats();
+
+    // Count the free clusters of the whole FAT table
+    start = now_us();
+    FAT_volumeCountFreeSpace();
+    t = now_us() - start;
+    printf("count  %8.1f us  %6lu reads (%lu sectors)\n", t,
+           (unsigned long)IMAGE_Stats.reads,
+           (unsigned long)IMAGE_Stats.sectors_read);
+
+    // Start from an empty file
+    res = FAT_makeFile("/bench.bin");
+    if (res != FR_OK && res != FR_EXIST)
+    {
+        printf("makeFile error %d\n", res);
+        return 1;
+    }
+    FAT_openDir(&dir, "/");
+    if (FAT_fopen(&dir, &file, "bench.bin") != FR_OK)
+        return 1;
+    FAT_ftruncate(&file);
+    reset_stats();
+
+    // Write
+    start = now_us();
+    for (i = 0; i < kbytes * 1024 / CHUNK_SIZE; i++)
+    {
+        for (uint16_t j = 0; j < CHUNK_SIZE; j++)
+            chunk[j] = i + j;
+
+        t   = now_us();
+        res = FAT_fwrite(&file, chunk, CHUNK_SIZE, &bw);
+        t   = now_us() - t;
+        if (res)
+        {
+            printf("fwrite error %d\n", res);
+            return 1;
+        }
+        if (t > slowest)
+            slowest = t;
+    }
+    FAT_fsync(&file);
+    print_stats("write", now_us() - start, i * CHUNK_SIZE);
+    printf("slowest fwrite() %.1f us\n", slowest);
+
+    // Read back and check
+    FAT_fopen(&dir, &file, "bench.bin");
+    start = now_us();
+    for (i = 0, done = 0; done < file.file_size; i++, done += br)
+    {
+        if (FAT_freadInto(&file, chunk, CHUNK_SIZE, &br) || br == 0)
+            break;
+
+        for (uint16_t j = 0; j < br; j++)
+        {
+            if (chunk[j] != (uint8_t)(i + j))
+            {
+                printf("data error at %lu\n", (unsigned long)(done + j));
+                return 1;
+            }
+        }
+    }
+    print_stats("read", now_us() - start, done);
+
+#if FAT_JOURNAL == 1
+    if (journal_check())
+    {
+        printf("journal error\n");
+        return 1;
+    }
+#endif
+
+    FAT_unmountVolume();
+    IMAGE_close();
+    return 0;
+}
@@ -0,0 +1,8 @@
+#ifndef __GLOBAL__
+#define __GLOBAL__
+
+// Global Defines (used by many avr-libc libaries)
+
+#define F_CPU 16000000UL
+
+#endif
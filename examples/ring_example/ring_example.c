@@ -0,0 +1,176 @@
+/*
+ * Measures the CPU cycles to move bytes through a buffer_t, which protects
+ * every call with a critical section, one byte and one block per call, and
+ * through the lock-free ring_t and two rings from RING_DECLARE, one small
+ * enough for 8-bit indexes and one large enough to need 16-bit indexes read
+ * and written in a critical section. Each run fills the buffer and then
+ * empties it, the same work the UART does from the main loop and its
+ * interrupt.
+ * Nothing needs to be connected.
+ */
+#include "global.h"
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <buffer.h>
+#include <stdio.h>
+#include <uart.h>
+
+#define BUFFER_SIZE 64
+#define RUNS        16
+
+RING_DECLARE(small, uint8_t, BUFFER_SIZE)
+RING_DECLARE(large, uint8_t, 256)
+
+static uint8_t values[BUFFER_SIZE];
+static small_t small;
+static large_t large;
+static uint8_t block[BUFFER_SIZE];
+static volatile uint8_t sink;
+
+/* Timer 1 counts CPU cycles, a run takes less than 65536 cycles */
+static void timer_start(void)
+{
+    TCCR1A = 0;
+    TCCR1B = 0;
+    TCNT1  = 0;
+    TCCR1B = _BV(CS10); // no prescaler
+}
+
+static uint16_t timer_stop(void)
+{
+    uint16_t cycles = TCNT1;
+    TCCR1B          = 0;
+    return cycles;
+}
+
+static void report(const char *name, uint32_t cycles)
+{
+    // cycles is the sum of RUNS runs of BUFFER_SIZE bytes
+    printf_P(PSTR("%-16S %6lu cycles/run %3lu cycles/byte\n"), name,
+             cycles / RUNS, cycles / RUNS / BUFFER_SIZE);
+}
+
+int main(void)
+{
+    buffer_t buffer = BUFFER_CREATE(BUFFER_SIZE, values);
+    ring_t ring     = RING_CREATE(BUFFER_SIZE, values);
+    uint32_t cycles;
+    uint8_t run, i, value;
+
+    UART_init();
+    sei();
+
+    printf_P(PSTR("%u byte buffers\n"), BUFFER_SIZE);
+
+    for (run = 0, cycles = 0; run < RUNS; run++)
+    {
+        timer_start();
+        for (i = 0; i < BUFFER_SIZE; i++)
+            BUFFER_enqueue(&buffer, i);
+        cycles += timer_stop();
+        while (!BUFFER_empty(&buffer))
+            sink = BUFFER_dequeue(&buffer);
+    }
+    report(PSTR("BUFFER_enqueue"), cycles);
+
+    for (run = 0, cycles = 0; run < RUNS; run++)
+    {
+        for (i = 0; i < BUFFER_SIZE; i++)
+            BUFFER_enqueue(&buffer, i);
+        timer_start();
+        while (!BUFFER_empty(&buffer))
+            sink = BUFFER_dequeue(&buffer);
+        cycles += timer_stop();
+    }
+    report(PSTR("BUFFER_dequeue"), cycles);
+
+    for (run = 0, cycles = 0; run < RUNS; run++)
+    {
+        timer_start();
+        BUFFER_write(&buffer, block, BUFFER_SIZE);
+        cycles += timer_stop();
+        BUFFER_read(&buffer, block, BUFFER_SIZE);
+    }
+    report(PSTR("BUFFER_write"), cycles);
+
+    for (run = 0, cycles = 0; run < RUNS; run++)
+    {
+        BUFFER_write(&buffer, block, BUFFER_SIZE);
+        timer_start();
+        BUFFER_read(&buffer, block, BUFFER_SIZE);
+        cycles += timer_stop();
+    }
+    report(PSTR("BUFFER_read"), cycles);
+
+    for (run = 0, cycles = 0; run < RUNS; run++)
+    {
+        timer_start();
+        for (i = 0; i < BUFFER_SIZE; i++)
+            RING_enqueue(&ring, i);
+        cycles += timer_stop();
+        while (!RING_empty(&ring))
+            sink = RING_dequeue(&ring);
+    }
+    report(PSTR("RING_enqueue"), cycles);
+
+    for (run = 0, cycles = 0; run < RUNS; run++)
+    {
+        for (i = 0; i < BUFFER_SIZE; i++)
+            RING_enqueue(&ring, i);
+        timer_start();
+        while (!RING_empty(&ring))
+            sink = RING_dequeue(&ring);
+        cycles += timer_stop();
+    }
+    report(PSTR("RING_dequeue"), cycles);
+
+    for (run = 0, cycles = 0; run < RUNS; run++)
+    {
+        timer_start();
+        for (i = 0; i < BUFFER_SIZE; i++)
+            small_enqueue(&small, i);
+        cycles += timer_stop();
+        while (small_dequeue(&small, &value))
+            sink = value;
+    }
+    report(PSTR("small_enqueue"), cycles);
+
+    for (run = 0, cycles = 0; run < RUNS; run++)
+    {
+        for (i = 0; i < BUFFER_SIZE; i++)
+            small_enqueue(&small, i);
+        timer_start();
+        while (small_dequeue(&small, &value))
+            sink = value;
+        cycles += timer_stop();
+    }
+    report(PSTR("small_dequeue"), cycles);
+
+    // only BUFFER_SIZE bytes per run, the 16-bit indexes still wrap the ring
+    for (run = 0, cycles = 0; run < RUNS; run++)
+    {
+        timer_start();
+        for (i = 0; i < BUFFER_SIZE; i++)
+            large_enqueue(&large, i);
+        cycles += timer_stop();
+        while (large_dequeue(&large, &value))
+            sink = value;
+    }
+    report(PSTR("large_enqueue"), cycles);
+
+    for (run = 0, cycles = 0; run < RUNS; run++)
+    {
+        for (i = 0; i < BUFFER_SIZE; i++)
+            large_enqueue(&large, i);
+        timer_start();
+        while (large_dequeue(&large, &value))
+            sink = value;
+        cycles += timer_stop();
+    }
+    report(PSTR("large_dequeue"), cycles);
+
+    for (;;)
+    {
+    }
+    return 0;
+}
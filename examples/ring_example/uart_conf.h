@@ -0,0 +1,9 @@
+#ifndef UART_CONF_H
+#define UART_CONF_H
+
+#define UART_N 0
+#define BAUD   9600
+
+#define UART_INIT_STDOUT
+
+#endif /* UART_CONF_H */
@@ -0,0 +1,126 @@
+/*
+ * Measures the SPI throughput of a 512 byte sector, the size used by the SD
+ * card driver, sent or received one byte per SPI_transferByte() call and
+ * with the block functions. The SPI runs at the fastest clock (fosc/2) like
+ * the SD card driver after initialization. The interrupt driven engine
+ * (SPI_ASYNC in spi_conf.h) is measured with the CPU waiting for it. At fosc/2
+ * it is slower than the block functions, since the interrupt costs more cycles
+ * than the byte it moves. Nothing needs to be connected.
+ */
+#include "global.h"
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <spi.h>
+#include <stdio.h>
+#include <uart.h>
+
+#define BLOCK_SIZE 512
+#define RUNS       16
+
+static uint8_t tx[BLOCK_SIZE];
+static uint8_t rx[BLOCK_SIZE];
+
+/* Timer 1 counts CPU cycles, a block takes less than 65536 cycles */
+static void timer_start(void)
+{
+    TCCR1A = 0;
+    TCCR1B = 0;
+    TCNT1  = 0;
+    TCCR1B = _BV(CS10); // no prescaler
+}
+
+static uint16_t timer_stop(void)
+{
+    uint16_t cycles = TCNT1;
+    TCCR1B          = 0;
+    return cycles;
+}
+
+static void report(const char *name, uint32_t cycles)
+{
+    // cycles is the sum of RUNS blocks
+    uint32_t rate = (uint64_t)BLOCK_SIZE * RUNS * F_CPU / cycles;
+
+    printf_P(PSTR("%-18S %6lu cycles/block %7lu bytes/s\n"), name,
+             cycles / RUNS, rate);
+}
+
+int main(void)
+{
+    uint32_t cycles;
+    uint8_t run;
+
+    UART_init();
+
+    SPI_init(&(SPI_Init_Typedef){.interuptEn       = false,
+                                 .dataOrderLsb     = false,
+                                 .masterSelect     = true,
+                                 .clkPolHigh       = false,
+                                 .clkPhaseTrailing = false,
+                                 .clkDoubleSpeed   = true,
+                                 .clkSelect        = SPI_SPCR_CLK_DIV4});
+
+    for (uint16_t i = 0; i < BLOCK_SIZE; i++)
+        tx[i] = i;
+
+    printf_P(PSTR("SPI fosc/2, %u byte blocks\n"), BLOCK_SIZE);
+
+    for (run = 0, cycles = 0; run < RUNS; run++)
+    {
+        timer_start();
+        for (uint16_t i = 0; i < BLOCK_SIZE; i++)
+            SPI_transferByte(tx[i]);
+        cycles += timer_stop();
+    }
+    report(PSTR("transferByte send"), cycles);
+
+    for (run = 0, cycles = 0; run < RUNS; run++)
+    {
+        timer_start();
+        for (uint16_t i = 0; i < BLOCK_SIZE; i++)
+            rx[i] = SPI_transferByte(0xff);
+        cycles += timer_stop();
+    }
+    report(PSTR("transferByte recv"), cycles);
+
+    for (run = 0, cycles = 0; run < RUNS; run++)
+    {
+        timer_start();
+        SPI_transmitBlock(tx, BLOCK_SIZE);
+        cycles += timer_stop();
+    }
+    report(PSTR("transmitBlock"), cycles);
+
+    for (run = 0, cycles = 0; run < RUNS; run++)
+    {
+        timer_start();
+        SPI_receiveBlock(rx, BLOCK_SIZE);
+        cycles += timer_stop();
+    }
+    report(PSTR("receiveBlock"), cycles);
+
+    for (run = 0, cycles = 0; run < RUNS; run++)
+    {
+        timer_start();
+        SPI_exchangeBlock(tx, rx, BLOCK_SIZE);
+        cycles += timer_stop();
+    }
+    report(PSTR("exchangeBlock"), cycles);
+
+    // the engine runs from the SPI interrupt
+    sei();
+    SPI_Transfer transfer = {.tx = tx, .rx = NULL, .len = BLOCK_SIZE};
+    for (run = 0, cycles = 0; run < RUNS; run++)
+    {
+        timer_start();
+        SPI_queueTransfer(&transfer);
+        SPI_waitIdle();
+        cycles += timer_stop();
+    }
+    report(PSTR("queueTransfer"), cycles);
+
+    for (;;)
+    {
+    }
+    return 0;
+}
@@ -0,0 +1,7 @@
+#ifndef SPI_CONF_H
+#define SPI_CONF_H
+
+// #define SPI_ASYNC           // enable the interupt driven transfer engine
+#define SPI_ASYNC_QUEUE_SIZE 4 // number of transfers that can be queued
+
+#endif /* SPI_CONF_H */
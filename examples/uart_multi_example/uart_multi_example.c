@@ -0,0 +1,56 @@
+/*
+ * Uses both USARTs of an ATmega1284 at once. USART0 is the host link with
+ * printf through the UART_ functions, USART1 is a UART instance at a baud
+ * rate chosen at runtime. Each line received on USART1 is printed to the
+ * host and echoed back. Connect a serial device to RXD1/TXD1.
+ */
+#include "global.h"
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <stdio.h>
+#include <uart.h>
+
+#define SENSOR_BAUD 38400
+#define LINE_SIZE   32
+
+static uint8_t sensor_rx[32];
+static uint8_t sensor_tx[16];
+static UART_TypeDef sensor = UART_CREATE(UART_PORT1, sensor_rx, sensor_tx);
+
+int main(void)
+{
+    uint8_t line[LINE_SIZE];
+    uint8_t len = 0;
+    uint8_t c;
+
+    UART_init();
+    UART_devInit(&sensor, SENSOR_BAUD);
+    sei();
+
+    printf_P(PSTR("USART1 at %lu baud\n"), (uint32_t)SENSOR_BAUD);
+
+    for (;;)
+    {
+        if (!UART_devReceiveByte(&sensor, &c, false))
+        {
+            continue;
+        }
+        if (c != '\n' && len < LINE_SIZE)
+        {
+            line[len++] = c;
+            continue;
+        }
+
+        printf_P(PSTR("%.*s\n"), len, line);
+        UART_devWrite(&sensor, line, len);
+        UART_devTransmitByte(&sensor, '\n', true);
+        len = 0;
+
+        // a full line was flushed, keep the byte that didn't fit
+        if (c != '\n')
+        {
+            line[len++] = c;
+        }
+    }
+    return 0;
+}
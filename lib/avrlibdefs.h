@@ -12,7 +12,9 @@
 #ifndef __AVRLIBDEFS__
 #define __AVRLIBDEFS__
 
+#ifdef __AVR__
 #include <avr/io.h>
+#endif
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
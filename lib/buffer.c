@@ -1,4 +1,5 @@
 #include "buffer.h"
+#include <string.h>
 #include <util/atomic.h>
 
 bool BUFFER_enqueue(buffer_t *b, uint8_t value)
@@ -40,3 +41,133 @@ uint8_t BUFFER_peek(buffer_t *b, uint8_t offset)
     uint8_t index = (b->head + offset) % b->size;
     return b->valuesptr[index];
 }
+
+uint8_t BUFFER_write(buffer_t *b, const uint8_t *data, uint8_t len)
+{
+    uint8_t *span;
+    uint8_t n, done = 0;
+
+    // the free space wraps at most once
+    for (uint8_t i = 0; i < 2 && done < len; i++)
+    {
+        n = BUFFER_writeSpan(b, &span);
+        if (n == 0)
+        {
+            break;
+        }
+        if (n > len - done)
+        {
+            n = len - done;
+        }
+        memcpy(span, data + done, n);
+        BUFFER_commitWrite(b, n);
+        done += n;
+    }
+    return done;
+}
+
+uint8_t BUFFER_read(buffer_t *b, uint8_t *data, uint8_t len)
+{
+    uint8_t *span;
+    uint8_t n, done = 0;
+
+    // the stored bytes wrap at most once
+    for (uint8_t i = 0; i < 2 && done < len; i++)
+    {
+        n = BUFFER_readSpan(b, &span);
+        if (n == 0)
+        {
+            break;
+        }
+        if (n > len - done)
+        {
+            n = len - done;
+        }
+        memcpy(data + done, span, n);
+        BUFFER_commitRead(b, n);
+        done += n;
+    }
+    return done;
+}
+
+uint8_t BUFFER_writeSpan(buffer_t *b, uint8_t **span)
+{
+    uint8_t n;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        *span = b->valuesptr + b->tail;
+        if (b->num_entries == b->size)
+        {
+            n = 0;
+        }
+        else if (b->tail >= b->head)
+        {
+            n = b->size - b->tail;
+        }
+        else
+        {
+            n = b->head - b->tail;
+        }
+    }
+    return n;
+}
+
+void BUFFER_commitWrite(buffer_t *b, uint8_t n)
+{
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        b->num_entries += n;
+        b->tail += n;
+        if (b->tail >= b->size)
+        {
+            b->tail -= b->size;
+        }
+    }
+}
+
+uint8_t BUFFER_readSpan(buffer_t *b, uint8_t **span)
+{
+    uint8_t n;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        *span = b->valuesptr + b->head;
+        if (b->num_entries == 0)
+        {
+            n = 0;
+        }
+        else if (b->head < b->tail)
+        {
+            n = b->tail - b->head;
+        }
+        else
+        {
+            n = b->size - b->head;
+        }
+    }
+    return n;
+}
+
+void BUFFER_commitRead(buffer_t *b, uint8_t n)
+{
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        b->num_entries -= n;
+        b->head += n;
+        if (b->head >= b->size)
+        {
+            b->head -= b->size;
+        }
+    }
+}
+
+uint8_t RING_peek(ring_t *r, uint8_t offset)
+{
+    uint8_t head = r->head;
+
+    if ((uint8_t)(r->tail - head) <= offset)
+    {
+        return BUFFER_EMPTY_VAL;
+    }
+    RING_BARRIER();
+    return r->valuesptr[(uint8_t)(head + offset) & r->mask];
+}
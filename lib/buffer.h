@@ -104,4 +104,287 @@ uint8_t BUFFER_dequeue(buffer_t *b);
  */
 uint8_t BUFFER_peek(buffer_t *b, uint8_t offset);
 
+/**
+ * @brief Add up to len bytes to the buffer
+ * The indexes are updated once per contiguous span, so twice when the copy
+ * wraps.
+ * The bytes are copied with interupts enabled, so only one producer may write
+ * at a time.
+ *
+ * @param b pointer to the buffer struct
+ * @param data bytes to add
+ * @param len number of bytes to add
+ * @return uint8_t number of bytes added, less than len if the buffer was full
+ */
+uint8_t BUFFER_write(buffer_t *b, const uint8_t *data, uint8_t len);
+
+/**
+ * @brief Remove up to len bytes from the buffer
+ * The indexes are updated once per contiguous span, so twice when the copy
+ * wraps.
+ * The bytes are copied with interupts enabled, so only one consumer may read
+ * at a time.
+ *
+ * @param b pointer to the buffer struct
+ * @param data array of len bytes to store the removed bytes
+ * @param len number of bytes to remove
+ * @return uint8_t number of bytes removed, less than len if the buffer was
+ * empty
+ */
+uint8_t BUFFER_read(buffer_t *b, uint8_t *data, uint8_t len);
+
+/**
+ * @brief Get the free space that follows the newest byte without wrapping
+ * Fill it and pass the number of bytes filled to BUFFER_commitWrite.
+ *
+ * @param b pointer to the buffer struct
+ * @param span set to the start of the free space
+ * @return uint8_t number of bytes that can be written at span
+ */
+uint8_t BUFFER_writeSpan(buffer_t *b, uint8_t **span);
+
+/**
+ * @brief Add n bytes written to the span from BUFFER_writeSpan
+ *
+ * @param b pointer to the buffer struct
+ * @param n number of bytes written, at most the length of the span
+ */
+void BUFFER_commitWrite(buffer_t *b, uint8_t n);
+
+/**
+ * @brief Get the bytes that follow the oldest byte without wrapping
+ * Use them and pass the number of bytes used to BUFFER_commitRead.
+ *
+ * @param b pointer to the buffer struct
+ * @param span set to the oldest byte
+ * @return uint8_t number of bytes that can be read at span
+ */
+uint8_t BUFFER_readSpan(buffer_t *b, uint8_t **span);
+
+/**
+ * @brief Remove n bytes read from the span from BUFFER_readSpan
+ *
+ * @param b pointer to the buffer struct
+ * @param n number of bytes read, at most the length of the span
+ */
+void BUFFER_commitRead(buffer_t *b, uint8_t n);
+
+/**
+ * @brief Lock-free ring buffer for one producer and one consumer, such as an
+ * ISR and the main loop. The producer only writes tail and the consumer only
+ * writes head. Both are free running 8-bit counters so each is read and
+ * written in one instruction and no critical section is needed. The size must
+ * be a power of two up to 128 so the index is masked instead of using modulo.
+ *
+ */
+typedef struct
+{
+    uint8_t *valuesptr;
+    volatile uint8_t head, tail;
+    uint8_t mask;
+
+} ring_t;
+
+/**
+ * @brief abstracted constructor for ring that doesn't require malloc
+ * Fails to compile when SIZE is not a power of two up to 128.
+ *
+ */
+#define RING_CREATE(SIZE, VALUES_PTR)                                         \
+    {                                                                         \
+        .valuesptr = VALUES_PTR, .head = 0, .tail = 0,                        \
+        .mask      = (SIZE)-1 +                                               \
+                0 * sizeof(char[(((SIZE) & ((SIZE)-1)) == 0 && (SIZE) <= 128) \
+                                    ? 1                                       \
+                                    : -1])                                    \
+    }
+
+/**
+ * @brief Keep the compiler from moving the access of a value across the update
+ * of the index that hands it over to the other side
+ *
+ */
+#define RING_BARRIER() __asm__ __volatile__("" ::: "memory")
+
+/**
+ * @brief Return number of bytes in the ring
+ *
+ * @param r pointer to the ring struct
+ * @return uint8_t
+ */
+static inline uint8_t RING_available(ring_t *r)
+{
+    return (uint8_t)(r->tail - r->head);
+}
+
+/**
+ * @brief Check if the ring is empty
+ *
+ * @param r pointer to the ring struct
+ * @return true empty
+ * @return false not empty
+ */
+static inline bool RING_empty(ring_t *r) { return r->tail == r->head; }
+
+/**
+ * @brief Check if the ring is full
+ *
+ * @param r pointer to the ring struct
+ * @return true full
+ * @return false not full
+ */
+static inline bool RING_full(ring_t *r)
+{
+    return (uint8_t)(r->tail - r->head) > r->mask;
+}
+
+/**
+ * @brief Add a byte to the ring, only called by the producer
+ *
+ * @param r pointer to the ring struct
+ * @param value byte to add
+ * @return true added
+ * @return false ring was full
+ */
+static inline bool RING_enqueue(ring_t *r, uint8_t value)
+{
+    uint8_t tail = r->tail;
+
+    if ((uint8_t)(tail - r->head) > r->mask)
+    {
+        return false;
+    }
+    r->valuesptr[tail & r->mask] = value;
+    RING_BARRIER();
+    r->tail = tail + 1;
+    return true;
+}
+
+/**
+ * @brief Remove a byte from the ring, only called by the consumer
+ *
+ * @param r pointer to the ring struct
+ * @return uint8_t the byte or BUFFER_EMPTY_VAL if the ring was empty
+ */
+static inline uint8_t RING_dequeue(ring_t *r)
+{
+    uint8_t head = r->head;
+    uint8_t value;
+
+    if (r->tail == head)
+    {
+        return BUFFER_EMPTY_VAL;
+    }
+    RING_BARRIER();
+    value = r->valuesptr[head & r->mask];
+    RING_BARRIER();
+    r->head = head + 1;
+    return value;
+}
+
+/**
+ * @brief Read a byte offset from the oldest byte without removing it, only
+ * called by the consumer
+ *
+ * @param r pointer to the ring struct
+ * @param offset position from the oldest byte
+ * @return uint8_t the byte or BUFFER_EMPTY_VAL if there is no byte at offset
+ */
+uint8_t RING_peek(ring_t *r, uint8_t offset);
+
+/**
+ * @brief Declare a lock-free ring of SIZE elements of TYPE for one producer and
+ * one consumer, like ring_t but specialized at compile time. SIZE must be a
+ * power of two up to 32768. Rings up to 128 elements use 8-bit indexes, larger
+ * rings use 16-bit indexes and disable interupts only while reading or writing
+ * an index. The declaration produces:
+ * - NAME_t, the ring type, empty when zero initialized
+ * - bool NAME_enqueue(NAME_t *r, TYPE value), only called by the producer
+ * - bool NAME_dequeue(NAME_t *r, TYPE *value), only called by the consumer
+ * - NAME_available(r), NAME_empty(r) and NAME_full(r)
+ *
+ * Example:
+ *      RING_DECLARE(samples, uint16_t, 32)
+ *      static samples_t adc_samples;
+ *      ...
+ *      samples_enqueue(&adc_samples, ADC);
+ *
+ */
+#define RING_DECLARE(NAME, TYPE, SIZE)                                        \
+    _Static_assert(((SIZE) & ((SIZE)-1)) == 0 && (SIZE) <= 32768,             \
+                   #NAME " size must be a power of two up to 32768");         \
+                                                                              \
+    typedef __typeof__(__builtin_choose_expr((SIZE) <= 128, (uint8_t)0,       \
+                                             (uint16_t)0)) NAME##_index_t;    \
+                                                                              \
+    typedef struct                                                            \
+    {                                                                         \
+        TYPE values[SIZE];                                                    \
+        volatile NAME##_index_t head, tail;                                   \
+    } NAME##_t;                                                               \
+                                                                              \
+    static inline NAME##_index_t NAME##_load(volatile NAME##_index_t *i)      \
+    {                                                                         \
+        NAME##_index_t v;                                                     \
+        if (sizeof(v) == 1)                                                   \
+        {                                                                     \
+            return *i;                                                        \
+        }                                                                     \
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { v = *i; }                         \
+        return v;                                                             \
+    }                                                                         \
+                                                                              \
+    static inline void NAME##_store(volatile NAME##_index_t *i,               \
+                                    NAME##_index_t v)                         \
+    {                                                                         \
+        RING_BARRIER();                                                       \
+        if (sizeof(v) == 1)                                                   \
+        {                                                                     \
+            *i = v;                                                           \
+            return;                                                           \
+        }                                                                     \
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { *i = v; }                         \
+    }                                                                         \
+                                                                              \
+    static inline NAME##_index_t NAME##_available(NAME##_t *r)                \
+    {                                                                         \
+        return (NAME##_index_t)(NAME##_load(&r->tail) -                       \
+                                NAME##_load(&r->head));                       \
+    }                                                                         \
+                                                                              \
+    static inline bool NAME##_empty(NAME##_t *r)                              \
+    {                                                                         \
+        return NAME##_available(r) == 0;                                      \
+    }                                                                         \
+                                                                              \
+    static inline bool NAME##_full(NAME##_t *r)                               \
+    {                                                                         \
+        return NAME##_available(r) == (SIZE);                                 \
+    }                                                                         \
+                                                                              \
+    static inline bool NAME##_enqueue(NAME##_t *r, TYPE value)                \
+    {                                                                         \
+        NAME##_index_t tail = r->tail;                                        \
+        if ((NAME##_index_t)(tail - NAME##_load(&r->head)) == (SIZE))         \
+        {                                                                     \
+            return false;                                                     \
+        }                                                                     \
+        r->values[tail & ((SIZE)-1)] = value;                                 \
+        NAME##_store(&r->tail, tail + 1);                                     \
+        return true;                                                          \
+    }                                                                         \
+                                                                              \
+    static inline bool NAME##_dequeue(NAME##_t *r, TYPE *value)               \
+    {                                                                         \
+        NAME##_index_t head = r->head;                                        \
+        if (NAME##_load(&r->tail) == head)                                    \
+        {                                                                     \
+            return false;                                                     \
+        }                                                                     \
+        RING_BARRIER();                                                       \
+        *value = r->values[head & ((SIZE)-1)];                                \
+        NAME##_store(&r->head, head + 1);                                     \
+        return true;                                                          \
+    }
+
 #endif /* BUFFER_H */
\ No newline at end of file
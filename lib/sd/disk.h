@@ -0,0 +1,66 @@
+/*___________________________________________________________________________________________________
+
+Title:
+        disk.h v1.0
+
+Description:
+        Block device interface used by the FAT library. A device is a table
+        of functions that transfer 512 byte sectors. The SD card driver
+        provides SD_Disk and a disk image file on a PC provides IMAGE_Disk
+        (disk_image.h). Select the device with FAT_bindDisk() before mounting.
+_____________________________________________________________________________________________________*/
+
+#ifndef DISK_H_
+#define DISK_H_
+
+#include <avrlibdefs.h>
+
+/*************************************************************
+        SYSTEM DEFINES
+**************************************************************/
+#define DISK_SECTOR_SIZE 512 // the only sector size supported
+
+/*************************************************************
+        GLOBALS
+**************************************************************/
+/* Block device functions (DISK_OPS). All return 0 on success. */
+typedef struct
+{
+    // Prepare the device for use. The return code is saved in
+    // fs_low_level_code of the FAT object.
+    uint8_t (*init)(void);
+
+    // Read or write one sector
+    uint8_t (*read)(uint32_t sector, uint8_t *buf);
+    uint8_t (*write)(uint32_t sector, const uint8_t *buf);
+
+    // Read or write count consecutive sectors from or to a buffer of
+    // count * 512 bytes
+    uint8_t (*read_multiple)(uint32_t sector, uint8_t *buf, uint16_t count);
+    uint8_t (*write_multiple)(uint32_t sector, const uint8_t *buf,
+                              uint16_t count);
+
+    // Fill count consecutive sectors with 0 without a data buffer
+    uint8_t (*zero)(uint32_t sector, uint16_t count);
+
+    // Finish pending transfers and release the device
+    uint8_t (*sync)(void);
+
+    // Number of sectors of the device or 0 if unknown
+    uint32_t (*sector_count)(void);
+
+    // Number of sectors of the unit the device erases and writes best, such
+    // as the allocation unit of an SD card, or 0 if unknown. Called once by
+    // FAT_mountVolume().
+    uint32_t (*erase_unit)(void);
+
+    // Start reading one sector and return while the data is still being
+    // transferred in the background. The data is valid after sync() returned
+    // 0. Devices that can't do this read the sector before returning.
+    uint8_t (*read_async)(uint32_t sector, uint8_t *buf);
+} DISK_OPS;
+
+// SD card over SPI (disk_sd.c)
+extern const DISK_OPS SD_Disk;
+
+#endif /* DISK_H_ */
@@ -0,0 +1,160 @@
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "sd/disk_image.h"
+#include "sd/sd.h"
+
+/*************************************************************
+        PRIVATE
+**************************************************************/
+static uint8_t disk_image_init(void);
+static uint8_t disk_image_read(uint32_t sector, uint8_t *buf);
+static uint8_t disk_image_write(uint32_t sector, const uint8_t *buf);
+static uint8_t disk_image_read_multiple(uint32_t sector, uint8_t *buf,
+                                        uint16_t count);
+static uint8_t disk_image_write_multiple(uint32_t sector, const uint8_t *buf,
+                                         uint16_t count);
+static uint8_t disk_image_zero(uint32_t sector, uint16_t count);
+static uint8_t disk_image_sync(void);
+static uint32_t disk_image_sector_count(void);
+static uint32_t disk_image_erase_unit(void);
+static uint8_t disk_image_seek(uint32_t sector, uint16_t count);
+
+/*************************************************************
+        GLOBALS
+**************************************************************/
+// The main buffer of the file system is provided by the SD card driver on the
+// target. It is defined here since sd.c is not built on a PC.
+uint8_t SD_Buffer[SD_BUFFER_SIZE + 1];
+
+const DISK_OPS IMAGE_Disk = {
+    disk_image_init,           disk_image_read,
+    disk_image_write,          disk_image_read_multiple,
+    disk_image_write_multiple, disk_image_zero,
+    disk_image_sync,           disk_image_sector_count,
+    disk_image_erase_unit,     disk_image_read,
+};
+
+IMAGE_STATS IMAGE_Stats;
+
+static FILE *image;
+static uint32_t image_sectors;
+
+/*************************************************************
+        FUNCTIONS
+**************************************************************/
+uint8_t IMAGE_open(const char *path)
+{
+    IMAGE_close();
+
+    image = fopen(path, "r+b");
+    if (image == 0)
+        return 1;
+
+    if (fseeko(image, 0, SEEK_END))
+    {
+        IMAGE_close();
+        return 1;
+    }
+    image_sectors = ftello(image) / DISK_SECTOR_SIZE;
+
+    IMAGE_Stats.reads         = 0;
+    IMAGE_Stats.writes        = 0;
+    IMAGE_Stats.sectors_read  = 0;
+    IMAGE_Stats.sectors_write = 0;
+    return 0;
+}
+
+void IMAGE_close(void)
+{
+    if (image == 0)
+        return;
+
+    fclose(image);
+    image         = 0;
+    image_sectors = 0;
+}
+
+static uint8_t disk_image_init(void) { return image == 0; }
+
+static uint8_t disk_image_read(uint32_t sector, uint8_t *buf)
+{
+    if (disk_image_read_multiple(sector, buf, 1))
+        return 1;
+
+    // Same as the card driver, a null follows a single sector
+    buf[DISK_SECTOR_SIZE] = 0;
+    return 0;
+}
+
+static uint8_t disk_image_write(uint32_t sector, const uint8_t *buf)
+{
+    return disk_image_write_multiple(sector, buf, 1);
+}
+
+static uint8_t disk_image_read_multiple(uint32_t sector, uint8_t *buf,
+                                        uint16_t count)
+{
+    if (disk_image_seek(sector, count))
+        return 1;
+
+    IMAGE_Stats.reads++;
+    IMAGE_Stats.sectors_read += count;
+
+    return fread(buf, DISK_SECTOR_SIZE, count, image) != count;
+}
+
+static uint8_t disk_image_write_multiple(uint32_t sector, const uint8_t *buf,
+                                         uint16_t count)
+{
+    if (disk_image_seek(sector, count))
+        return 1;
+
+    IMAGE_Stats.writes++;
+    IMAGE_Stats.sectors_write += count;
+
+    return fwrite(buf, DISK_SECTOR_SIZE, count, image) != count;
+}
+
+static uint8_t disk_image_zero(uint32_t sector, uint16_t count)
+{
+    static const uint8_t zeros[DISK_SECTOR_SIZE];
+
+    if (disk_image_seek(sector, count))
+        return 1;
+
+    IMAGE_Stats.writes++;
+    IMAGE_Stats.sectors_write += count;
+
+    while (count--)
+    {
+        if (fwrite(zeros, DISK_SECTOR_SIZE, 1, image) != 1)
+            return 1;
+    }
+
+    return 0;
+}
+
+static uint8_t disk_image_sync(void)
+{
+    if (image == 0)
+        return 0;
+    return fflush(image) != 0;
+}
+
+static uint32_t disk_image_sector_count(void) { return image_sectors; }
+
+static uint32_t disk_image_erase_unit(void) { return 0; }
+
+/*______________________________________________________________________________________________
+        Move the file position to a sector after checking that count sectors
+from there are inside the image
+_______________________________________________________________________________________________*/
+static uint8_t disk_image_seek(uint32_t sector, uint16_t count)
+{
+    if ((image == 0) || (sector >= image_sectors) ||
+        (count > image_sectors - sector))
+        return 1;
+
+    return fseeko(image, (off_t)sector * DISK_SECTOR_SIZE, SEEK_SET) != 0;
+}
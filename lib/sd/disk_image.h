@@ -0,0 +1,57 @@
+/*___________________________________________________________________________________________________
+
+Title:
+        disk_image.h v1.0
+
+Description:
+        Block device backed by a disk image file for building the FAT library
+        on a PC with gcc. Images made with mkfs.vfat or dd from a card can be
+        mounted, read and written without the hardware, for testing and for
+        measuring the file system. Uses POSIX stdio only.
+
+        Example:
+                IMAGE_open("card.img");
+                FAT_bindDisk(&IMAGE_Disk);
+                FAT_mountVolume();
+                ...
+                FAT_unmountVolume();
+                IMAGE_close();
+_____________________________________________________________________________________________________*/
+
+#ifndef DISK_IMAGE_H_
+#define DISK_IMAGE_H_
+
+#include "sd/disk.h"
+
+/*************************************************************
+        GLOBALS
+**************************************************************/
+extern const DISK_OPS IMAGE_Disk;
+
+/* Transfer counters, reset by IMAGE_open() */
+typedef struct
+{
+    uint32_t reads;         // read calls
+    uint32_t writes;        // write calls
+    uint32_t sectors_read;  // sectors read by all calls
+    uint32_t sectors_write; // sectors written by all calls
+} IMAGE_STATS;
+
+extern IMAGE_STATS IMAGE_Stats;
+
+/*************************************************************
+        FUNCTION PROTOTYPES
+**************************************************************/
+/*______________________________________________________________________________________________
+        Open an image file for reading and writing
+
+        return		0 on success
+_______________________________________________________________________________________________*/
+uint8_t IMAGE_open(const char *path);
+
+/*______________________________________________________________________________________________
+        Write buffered data and close the image file
+_______________________________________________________________________________________________*/
+void IMAGE_close(void);
+
+#endif /* DISK_IMAGE_H_ */
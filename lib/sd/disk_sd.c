@@ -0,0 +1,104 @@
+#include <avrlibdefs.h>
+#include <spi.h>
+
+#include "sd/disk.h"
+#include "sd/sd.h"
+
+/*************************************************************
+        PRIVATE
+**************************************************************/
+static uint8_t disk_sd_init(void);
+static uint8_t disk_sd_read(uint32_t sector, uint8_t *buf);
+static uint8_t disk_sd_write(uint32_t sector, const uint8_t *buf);
+static uint8_t disk_sd_read_multiple(uint32_t sector, uint8_t *buf,
+                                     uint16_t count);
+static uint32_t disk_sd_erase_unit(void);
+#ifdef SPI_ASYNC
+static uint8_t disk_sd_read_async(uint32_t sector, uint8_t *buf);
+#else
+#define disk_sd_read_async disk_sd_read
+#endif
+
+/*************************************************************
+        GLOBALS
+**************************************************************/
+const DISK_OPS SD_Disk = {
+    disk_sd_init,             disk_sd_read,
+    disk_sd_write,            disk_sd_read_multiple,
+    sd_write_multiple_blocks, sd_write_zero_blocks,
+    sd_stream_end,            sd_capacity,
+    disk_sd_erase_unit,       disk_sd_read_async,
+};
+
+/*************************************************************
+        FUNCTIONS
+**************************************************************/
+static uint8_t disk_sd_init(void) { return sd_init(); }
+
+/*______________________________________________________________________________________________
+        R1 is 0 when the card accepted the command but the data token never
+came, so the token saved by the driver is checked as well.
+_______________________________________________________________________________________________*/
+static uint8_t disk_sd_read(uint32_t sector, uint8_t *buf)
+{
+    uint8_t res = sd_read_single_block(sector, buf);
+
+    return res || SD_ResponseToken != 0xFE;
+}
+
+/*______________________________________________________________________________________________
+        The card returns the data response token instead of 0 so the token
+saved by the driver is checked. It is left at 0x00 without writing the block
+when the previous write timed out while programming.
+_______________________________________________________________________________________________*/
+static uint8_t disk_sd_write(uint32_t sector, const uint8_t *buf)
+{
+    sd_write_single_block(sector, (uint8_t *)buf);
+    return SD_ResponseToken != 0x05;
+}
+
+/*______________________________________________________________________________________________
+        Read consecutive sectors using a read stream that is kept open, so a
+following call that continues from the last sector doesn't need a new command.
+The stream is closed by the other transfers or sync().
+_______________________________________________________________________________________________*/
+static uint8_t disk_sd_read_multiple(uint32_t sector, uint8_t *buf,
+                                     uint16_t count)
+{
+    if ((sd_read_stream_position() != sector) && sd_read_stream_begin(sector))
+        return 1;
+
+    while (count--)
+    {
+        if (sd_read_stream_next(buf))
+            return 1;
+        buf += SD_BUFFER_SIZE;
+    }
+
+    return 0;
+}
+
+#ifdef SPI_ASYNC
+/*______________________________________________________________________________________________
+        The data is moved by the SPI interrupt and its CRC is checked by
+sd_stream_end(), the sync() of the disk. Without SPI_ASYNC the sector is read
+by disk_sd_read().
+_______________________________________________________________________________________________*/
+static uint8_t disk_sd_read_async(uint32_t sector, uint8_t *buf)
+{
+    return sd_read_block_async(sector, buf, 0);
+}
+#endif
+
+/*______________________________________________________________________________________________
+        The allocation unit is read from the SD Status of the card
+_______________________________________________________________________________________________*/
+static uint32_t disk_sd_erase_unit(void)
+{
+    SD_INFO info;
+
+    if (sd_get_info(&info))
+        return 0;
+
+    return info.au_size;
+}
@@ -1,13 +1,13 @@
 #include <avrlibdefs.h>
 
+#include "disk.h"
 #include "sd.h"
 #include "utils.h"
-#include <avr/io.h>
-#include <debug_minimal.h>
 #include <sd/fat.h>
 #include <string.h>
 
 #ifdef DEBUG
+#include <debug_minimal.h>
 #define FAT_DEBUG_print(s)    DEBUG_print("[FAT]: " s)
 #define FAT_DEBUG_println(s)  DEBUG_println("[FAT]: " s)
 #define FAT_DEBUG_printnum(i) DEBUG_printnum(i)
@@ -27,9 +27,82 @@ typedef union lng
     uint8_t Int[4];
 } lng;
 
+#if FAT_TABLE_CACHE_SECTORS > 0
+// A FAT table sector held in RAM
+typedef struct
+{
+    SECTSIZE_t sector; // sector offset inside the FAT table
+    bool dirty;        // modified and not yet written to the card
+    uint8_t buf[SD_BUFFER_SIZE + 1]; // the card driver adds a null at the end
+} FAT_TABLE_CACHE;
+
+#define FAT_TABLE_CACHE_EMPTY 0xFFFFFFFF // marks an unused cache slot
+#endif
+
+#if FAT_DIR_CACHE_ENTRIES > 0
+// A resolved name inside a directory and the location of its entry
+typedef struct
+{
+    CLSTSIZE_t parent_cluster; // start cluster of the directory searched
+    CLSTSIZE_t entry_cluster;  // cluster that holds the entry
+    CLSTSIZE_t start_cluster;  // first cluster of the file or directory
+    uint16_t entry_sector;     // sector of the entry inside entry_cluster
+    uint16_t item;             // index of the item inside the directory
+    uint8_t entry_offset;      // entry number inside the sector
+    uint8_t attrib;            // attributes of the entry
+    char name[FAT_MAX_FILENAME_LENGTH + 1]; // name as read from the card
+} FAT_DIR_CACHE;
+#endif
+
+#define FAT_BUF_SECTOR_NONE 0xFFFFFFFF // the buffer holds no sector of a file
+
 static FAT_FRESULT _FAT_dirRegister(const char *path, uint8_t task);
 static void _FAT_freset(FAT_FILE *file_p);
 static uint8_t _FAT_nextFileCluster(FAT_FILE *file_p);
+static FAT_FRESULT _FAT_fwriteNextCluster(FAT_FILE *fp);
+static CLSTSIZE_t _FAT_findFreeRun(CLSTSIZE_t first_cluster,
+                                   CLSTSIZE_t last_cluster,
+                                   CLSTSIZE_t nr_clusters, bool aligned);
+static FAT_FRESULT _FAT_readSectors(SECTSIZE_t sector, uint8_t *buf,
+                                    uint16_t count);
+static FAT_FRESULT _FAT_readEnd(void);
+static uint8_t _FAT_readBuffer(SECTSIZE_t sector);
+#if FAT_EXTENT_MAP == 1
+static CLSTSIZE_t _FAT_extentNext(FAT_FILE *fp, CLSTSIZE_t cluster);
+static CLSTSIZE_t _FAT_extentSeek(FAT_FILE *fp, CLSTSIZE_t skip_clusters);
+static void _FAT_extentAppend(FAT_FILE *fp, CLSTSIZE_t prev_cluster,
+                              CLSTSIZE_t cluster);
+static void _FAT_extentTrim(FAT_FILE *fp, CLSTSIZE_t last_cluster);
+#endif
+static uint8_t *_FAT_fileBuffer(FAT_FILE *fp);
+static CLSTSIZE_t _FAT_getEntryInfo(FAT_FILE *finfo_p, uint8_t entry);
+#if FAT_DIR_CACHE_ENTRIES > 0
+static bool _FAT_dirCacheMatch(const char *cached, const char *name);
+static FAT_DIR_CACHE *_FAT_dirCacheFind(CLSTSIZE_t parent_cluster,
+                                        const char *name);
+static void _FAT_dirCacheAdd(FAT_DIR *dir_p, uint8_t entry,
+                             CLSTSIZE_t start_cluster, uint8_t attrib);
+static FAT_FRESULT _FAT_dirCacheWalk(FAT_DIR *dir_p, uint8_t task);
+static void _FAT_dirCacheClear(void);
+#endif
+static FAT_FRESULT _FAT_fileLoadSector(FAT_FILE *fp, SECTSIZE_t sector);
+#if FAT_READ_AHEAD == 1
+static uint8_t *_FAT_readAheadNext(FAT_FILE *fp);
+static uint8_t *_FAT_readAheadSlot(FAT_FILE *fp, uint8_t slot);
+static void _FAT_readAheadDrop(FAT_FILE *fp);
+#endif
+#if FAT_JOURNAL == 1
+static FAT_FRESULT _FAT_journalOpen(bool create);
+static FAT_FRESULT _FAT_journalReplay(void);
+static FAT_FRESULT _FAT_journalRead(uint8_t slot, FAT_FILE *rec, uint32_t *seq);
+static FAT_FRESULT _FAT_journalApply(FAT_FILE *rec);
+static FAT_FRESULT _FAT_journalApplySlot(uint8_t slot, FAT_FILE *fp);
+static FAT_FRESULT _FAT_journalWrite(FAT_FILE *fp);
+static FAT_FRESULT _FAT_journalForget(FAT_FILE *fp);
+static void _FAT_journalDrop(FAT_FILE *fp);
+static FAT_FRESULT _FAT_journalFold(FAT_FILE *fp);
+static uint32_t _FAT_journalCheck(void);
+#endif
 
 // System
 static void _FAT_removeChain(CLSTSIZE_t cluster);
@@ -37,8 +110,13 @@ static FAT_FRESULT _FAT_updateFileInfo(FAT_FILE *fp, uint8_t task);
 static FAT_FRESULT _FAT_allocateCluster(CLSTSIZE_t *new_cluster,
                                         CLSTSIZE_t new_cluster_val);
 static void _FAT_moveWindow(FAT_DIR *dir_p, CLSTSIZE_t start_cluster);
-static FAT_FRESULT _FAT_clearCluster(CLSTSIZE_t cluster, bool first_sector);
-static CLSTSIZE_t FAT_tableFindFree(uint8_t task);
+#if FAT_DIR_CHECKPOINTS == 1
+static void _FAT_dirSeek(FAT_DIR *dir_p, uint16_t idx);
+static void _FAT_dirCheckpoint(FAT_DIR *dir_p, uint8_t entry);
+#endif
+static FAT_FRESULT _FAT_clearCluster(CLSTSIZE_t cluster, uint8_t first);
+static CLSTSIZE_t _FAT_tableFindNextFree(void);
+static uint32_t _FAT_tableCountFree(void);
 static unsigned char ChkSum(unsigned char *pFcbName);
 static void _FAT_stringLFN(uint16_t start_idx, uint16_t length,
                            const char **data, uint8_t data_size);
@@ -53,8 +131,19 @@ static FAT_FRESULT _FAT_getFileNextSector(FAT_DIR *dir_p);
 static uint16_t MATH_remainder(uint16_t divident, uint16_t divisor,
                                uint16_t quotient);
 static SECTSIZE_t _FAT_clusterToSector(CLSTSIZE_t cluster);
+static uint32_t _FAT_getLong(uint16_t idx);
+static void _FAT_setLong(uint16_t idx, uint32_t value);
 static CLSTSIZE_t _FAT_tableReadSet(CLSTSIZE_t cluster, CLSTSIZE_t new_value,
                                     uint8_t task);
+static uint8_t *_FAT_tableLoad(SECTSIZE_t fat_sector);
+static FAT_FRESULT _FAT_tableMarkDirty(SECTSIZE_t fat_sector);
+static FAT_FRESULT _FAT_tableFlush(void);
+static FAT_FRESULT _FAT_tableWrite(SECTSIZE_t fat_sector, uint8_t *buf);
+static FAT_FRESULT _FAT_tableSetRun(CLSTSIZE_t first_cluster,
+                                    CLSTSIZE_t nr_clusters, bool link);
+#if FAT_SUPPORT_FAT32 == 1
+static FAT_FRESULT _FAT_syncFSInfo(void);
+#endif
 static void _FAT_parse_long_names(char buff[], uint16_t sector_offset);
 static uint8_t _FAT_parse_long_names_(char buff[], uint8_t start_idx,
                                       uint16_t sector_offset, uint8_t buff_idx,
@@ -65,12 +154,45 @@ static uint8_t _FAT_parse_long_names_(char buff[], uint8_t start_idx,
 **************************************************************/
 static char FAT_filename[FAT_MAX_FILENAME_LENGTH + 1]; // file name
 static FAT_DIR *bufferModBy;
+static SECTSIZE_t bufferSector = FAT_BUF_SECTOR_NONE; // read by freadInto()
 static bool set_null = false; // used to add null terminator to long file names
 static bool null_is_set = false; //
 
 static FAT fat_obj;              // card object
 static FAT *fat = &fat_obj;
 
+#if FAT_DISK_SD == 1
+static const DISK_OPS *disk = &SD_Disk; // device the volume is mounted from
+#else
+static const DISK_OPS *disk;
+#endif
+
+#if FAT_TABLE_CACHE_SECTORS > 0
+static FAT_TABLE_CACHE fat_cache[FAT_TABLE_CACHE_SECTORS];
+static uint8_t fat_cache_last;   // slot used by the last table access
+static uint8_t fat_cache_victim; // next slot to be evicted
+#endif
+
+#if FAT_DIR_CACHE_ENTRIES > 0
+static FAT_DIR_CACHE dir_cache[FAT_DIR_CACHE_ENTRIES];
+static uint8_t dir_cache_victim; // next record to be replaced
+#endif
+
+#if FAT_DIR_CHECKPOINTS == 1
+static uint8_t dir_generation; // changed when entries are added
+#endif
+
+#if FAT_JOURNAL == 1
+static SECTSIZE_t journal_sector; // first sector of the journal, 0 if none
+static uint32_t journal_seq;      // sequence number of the next record
+static bool journal_folded;       // a checkpoint was written to its entry
+// Entry of the record in each journal sector, sector 0 if there is none
+static SECTSIZE_t journal_slot_sector[FAT_JOURNAL_SECTORS];
+static uint8_t journal_slot_offset[FAT_JOURNAL_SECTORS];
+// The record is the last checkpoint of its file and not in the entry yet
+static bool journal_slot_live[FAT_JOURNAL_SECTORS];
+#endif
+
 /*************************************************************
         FUNCTIONS
 **************************************************************/
@@ -78,7 +200,6 @@ FAT_MOUNT_RESULT FAT_mountVolume(void)
 {
     lng temp_long;
     uint8_t fs_partition_type = 0; // 4, 6 or 14 for FAT16
-    uint8_t BPB_NumFATs       = 0; // number of FATs
     uint16_t i;
     uint16_t BPB_RsvdSecCnt = 0;   // reserved sector count
     uint16_t BPB_RootEntCnt =
@@ -91,22 +212,45 @@ FAT_MOUNT_RESULT FAT_mountVolume(void)
     fat->RootFirstCluster    = 0;
     fat->fs_partition_offset = 0;
     fat->fs_type             = 0;
+    fat->BPB_FSInfo          = 0;
+    fat->free_clusters       = FAT32_FSI_UNKNOWN;
+    fat->fsinfo_dirty        = false;
     temp_long.Long           = 0;
+#if FAT_JOURNAL == 1
+    journal_sector = 0;
+    journal_folded = false;
+#endif
 
-    // Assign function to pointer
-    // card_read_single_block = &sd_read_single_block;
+#if FAT_TABLE_CACHE_SECTORS > 0
+    // Drop the FAT table sectors of a previously mounted volume
+    for (i = 0; i < FAT_TABLE_CACHE_SECTORS; i++)
+    {
+        fat_cache[i].sector = FAT_TABLE_CACHE_EMPTY;
+        fat_cache[i].dirty  = false;
+    }
+    fat_cache_victim = 0;
+#endif
+#if FAT_DIR_CACHE_ENTRIES > 0
+    _FAT_dirCacheClear();
+#endif
 
     FAT_DEBUG_println("mount volume started");
 
+    if (disk == 0)
+        return MR_DEVICE_INIT_FAIL;
+
     // Card initialization
-    fat->fs_low_level_code = sd_init();
+    fat->fs_low_level_code = disk->init();
     if (fat->fs_low_level_code)
     {
         return MR_DEVICE_INIT_FAIL;
     }
 
+    // Large contiguous allocations are aligned to the erase unit
+    fat->erase_unit = disk->erase_unit();
+
     // Read the first sector that could be MBR or Boot Sector
-    fat->fs_low_level_code = sd_read_single_block(0, SD_Buffer);
+    fat->fs_low_level_code = _FAT_readBuffer(0);
     if (fat->fs_low_level_code)
         return MR_ERR;
 
@@ -154,8 +298,7 @@ FAT_MOUNT_RESULT FAT_mountVolume(void)
 
     // Read the Boot Record of detected partition or sector 0 including the Boot
     // Sector fs_partition_offset will be 0 if there is no MBR
-    fat->fs_low_level_code =
-        sd_read_single_block(fat->fs_partition_offset, SD_Buffer);
+    fat->fs_low_level_code = _FAT_readBuffer(fat->fs_partition_offset);
     if (fat->fs_low_level_code)
         return MR_ERR;
 
@@ -186,7 +329,7 @@ FAT_MOUNT_RESULT FAT_mountVolume(void)
     BPB_RsvdSecCnt   = temp_long.Long;
 
     // Number of FATs
-    BPB_NumFATs = SD_Buffer[FAT_BPB_NR_OF_FATS];
+    fat->BPB_NumFATs = SD_Buffer[FAT_BPB_NR_OF_FATS];
 
     // Root entries
     temp_long.Int[0] = SD_Buffer[FAT_BPB_ROOT_DIR_ENTRIES];
@@ -244,7 +387,7 @@ FAT_MOUNT_RESULT FAT_mountVolume(void)
     // 0 of the volume is not necessarily sector 0 of the drive due to
     // partitioning.
     fat->FirstDataSector =
-        BPB_RsvdSecCnt + (BPB_NumFATs * fat->FATSz) + fat->RootDirSectors;
+        BPB_RsvdSecCnt + (fat->BPB_NumFATs * fat->FATSz) + fat->RootDirSectors;
 
     // Determine the count of sectors in the data region of the volume
     if (BPB_TotSec16 != 0)
@@ -253,9 +396,14 @@ FAT_MOUNT_RESULT FAT_mountVolume(void)
         temp_long.Long = fat->BPB_TotSec32;
     DataSec = temp_long.Long - fat->FirstDataSector;
 
+    // The volume must fit on the device when its size is known
+    if (disk->sector_count() &&
+        (fat->fs_partition_offset + temp_long.Long > disk->sector_count()))
+        return MR_FAT_ERR;
+
     // Now we determine the count of clusters
     // This computation rounds down
-    fat->CountofClusters = (DataSec / fat->BPB_SecPerClus) - 0.5;
+    fat->CountofClusters = DataSec / fat->BPB_SecPerClus;
 
     // Determine the FAT type
     if (fat->CountofClusters < 4085)
@@ -283,6 +431,12 @@ FAT_MOUNT_RESULT FAT_mountVolume(void)
         temp_long.Int[2]      = SD_Buffer[FAT32_BPB_ROOT_CLUST + 2];
         temp_long.Int[3]      = SD_Buffer[FAT32_BPB_ROOT_CLUST + 3];
         fat->RootFirstCluster = temp_long.Long;
+
+        // FSInfo sector
+        temp_long.Long   = 0;
+        temp_long.Int[0] = SD_Buffer[FAT32_BPB_FS_INFO];
+        temp_long.Int[1] = SD_Buffer[FAT32_BPB_FS_INFO + 1];
+        fat->BPB_FSInfo  = temp_long.Long;
     }
 
     if ((fat->fs_type != FS_FAT16) && (fat->fs_type != FS_FAT32))
@@ -310,15 +464,108 @@ FAT_MOUNT_RESULT FAT_mountVolume(void)
 
     fat->entries_per_sector = fat->BPB_BytsPerSec / 32;
 
+    // Seed the allocation cursor. On FAT32 the FSInfo sector holds a hint of
+    // where the free clusters begin, otherwise start from the first cluster.
+    fat->next_free          = 2;
+
+#if FAT_SUPPORT_FAT32 == 1
+    if (fat->fs_type == FS_FAT32 && fat->BPB_FSInfo)
+    {
+        fat->fs_low_level_code =
+            _FAT_readBuffer(fat->fs_partition_offset + fat->BPB_FSInfo);
+        if (fat->fs_low_level_code)
+            return MR_ERR;
+
+        if (_FAT_getLong(FAT32_FSI_LEAD_SIG) == FAT32_FSI_LEAD_SIG_VAL &&
+            _FAT_getLong(FAT32_FSI_STRUC_SIG) == FAT32_FSI_STRUC_SIG_VAL)
+        {
+            temp_long.Long = _FAT_getLong(FAT32_FSI_NXT_FREE);
+
+            // The hint is not guaranteed to be valid
+            if ((temp_long.Long >= 2) &&
+                (temp_long.Long < fat->CountofClusters + 2))
+                fat->next_free = temp_long.Long;
+
+            // Last known free cluster count. Values that can't be right are
+            // ignored and the count is made on the first free space query.
+            temp_long.Long = _FAT_getLong(FAT32_FSI_FREE_COUNT);
+            if (temp_long.Long <= fat->CountofClusters)
+                fat->free_clusters = temp_long.Long;
+        }
+        else
+        {
+            fat->BPB_FSInfo = 0; // not a valid FSInfo sector, don't update it
+        }
+    }
+#endif
+
+#if FAT_JOURNAL == 1
+    // Finish the checkpoints of files that were not synced before the volume
+    // was last removed. A volume without a journal file is still mounted.
+    if ((_FAT_journalOpen(false) == FR_OK) && _FAT_journalReplay())
+        return MR_ERR;
+#endif
+
     FAT_DEBUG_println("mount volume completed");
 
     return MR_OK;
 }
 
+void FAT_bindDisk(const DISK_OPS *ops) { disk = ops; }
+
+FAT_FRESULT FAT_unmountVolume(void)
+{
+    FAT_FRESULT res;
+
+#if FAT_JOURNAL == 1
+    // Write the sizes of the checkpoints of this mount to the entries
+    if (journal_sector)
+    {
+        for (uint8_t slot = 0; slot < FAT_JOURNAL_SECTORS; slot++)
+        {
+            if (journal_slot_live[slot])
+            {
+                res = _FAT_journalApplySlot(slot, 0);
+                if (res)
+                    return res;
+            }
+        }
+    }
+#endif
+
+    res = _FAT_tableFlush();
+    if (res)
+        return res;
+
+    // Release the card if a read stream is still open
+    if (disk->sync())
+        return FR_DEVICE_ERR;
+
+    fat->fs_type = 0;
+    return FR_OK;
+}
+
 uint64_t FAT_volumeFreeSpace(void)
 {
-    uint64_t free_clusters = FAT_tableFindFree(FAT_TASK_TABLE_COUNT_FREE);
-    return free_clusters * fat->BPB_SecPerClus * fat->BPB_BytsPerSec;
+    // Count the free clusters only once. The count is then kept up to date
+    // each time an entry of the FAT table changes.
+    if (fat->free_clusters == FAT32_FSI_UNKNOWN)
+    {
+        // A count that failed stays unknown and is not written to FSInfo
+        fat->free_clusters = _FAT_tableCountFree();
+        if (fat->free_clusters == FAT32_FSI_UNKNOWN)
+            return 0;
+        fat->fsinfo_dirty = true;
+    }
+
+    return (uint64_t)fat->free_clusters * fat->BPB_SecPerClus *
+           fat->BPB_BytsPerSec;
+}
+
+uint64_t FAT_volumeCountFreeSpace(void)
+{
+    fat->free_clusters = FAT32_FSI_UNKNOWN;
+    return FAT_volumeFreeSpace();
 }
 
 uint64_t FAT_volumeCapacity(void)
@@ -338,8 +585,7 @@ FAT_FRESULT FAT_getLabel(char *label, uint32_t *vol_sn)
     lng buf;
 
     // Read first sector of root
-    FAT_FRESULT return_code =
-        sd_read_single_block(fat->RootFirstSector, SD_Buffer);
+    FAT_FRESULT return_code = _FAT_readBuffer(fat->RootFirstSector);
     if (return_code)
         return return_code;
 
@@ -359,7 +605,7 @@ FAT_FRESULT FAT_getLabel(char *label, uint32_t *vol_sn)
 
     // Extract volume serial number
     // Read first sector of boot record
-    return_code = sd_read_single_block(fat->fs_partition_offset, SD_Buffer);
+    return_code = _FAT_readBuffer(fat->fs_partition_offset);
     if (return_code)
         return return_code;
 
@@ -413,7 +659,19 @@ uint16_t FAT_createDate(void)
 
 FAT_FRESULT FAT_makeDir(const char *path)
 {
-    return _FAT_dirRegister(path, FAT_TASK_MKDIR);
+    FAT_FRESULT res = _FAT_dirRegister(path, FAT_TASK_MKDIR);
+#if FAT_DIR_CACHE_ENTRIES > 0
+    _FAT_dirCacheClear();
+#endif
+#if FAT_DIR_CHECKPOINTS == 1
+    dir_generation++;
+#endif
+
+    // The new entry is already on the card so the clusters allocated for it
+    // must be too
+    if (res == FR_OK)
+        res = _FAT_tableFlush();
+    return res;
 }
 
 FAT_FRESULT FAT_openDir(FAT_DIR *dir_p, const char *path)
@@ -422,6 +680,9 @@ FAT_FRESULT FAT_openDir(FAT_DIR *dir_p, const char *path)
     dir_p->dir_active_item = dir_p->dir_entry_offset = 0;
     dir_p->dir_start_cluster                         = fat->RootFirstCluster;
     dir_p->dir_open                                  = false;
+#if FAT_DIR_CHECKPOINTS == 1
+    dir_p->checkpoints = 0;
+#endif
 
     _FAT_moveWindow(dir_p,
                     fat->RootFirstCluster); // start directory search from root
@@ -452,6 +713,9 @@ FAT_FRESULT FAT_openDirByIndex(FAT_DIR *dir_p, FAT_FILE *finfo_p, uint16_t idx)
 
     dir_p->dir_open_by_idx = false;
     dir_p->dir_active_item = dir_p->dir_entry_offset = 0;
+#if FAT_DIR_CHECKPOINTS == 1
+    dir_p->checkpoints_len = 0;
+#endif
 
     if (!(finfo_p->file_attrib & FAT_FILE_ATTR_DIRECTORY))
     { // check if it is a directory
@@ -479,11 +743,12 @@ FAT_FRESULT FAT_dirBack(FAT_DIR *dir_p)
         dir_p, dir_p->dir_start_cluster); // start from beginning of directory
 
     // Read first sector
-    res = sd_read_single_block(dir_p->dir_start_sector, SD_Buffer);
+    res = _FAT_readBuffer(dir_p->dir_start_sector);
     if (res)
         return FR_DEVICE_ERR;
 
     // Get cluster of parent
+    buf.Long   = 0;
     buf.Int[0] = SD_Buffer[FAT_DIR_FIRST_CLUS_LOW + 32];
     buf.Int[1] = SD_Buffer[FAT_DIR_FIRST_CLUS_LOW + 32 + 1];
 
@@ -499,6 +764,9 @@ FAT_FRESULT FAT_dirBack(FAT_DIR *dir_p)
 #endif
 
     dir_p->dir_start_cluster = buf.Long;
+#if FAT_DIR_CHECKPOINTS == 1
+    dir_p->checkpoints_len = 0;
+#endif
 
     // Set window to parent directory
     _FAT_moveWindow(dir_p, dir_p->dir_start_cluster);
@@ -518,6 +786,9 @@ FAT_FRESULT FAT_findByIndex(FAT_DIR *dir_p, FAT_FILE *finfo_p, uint16_t idx)
 
     _FAT_moveWindow(
         dir_p, dir_p->dir_start_cluster); // start from beginning of directory
+#if FAT_DIR_CHECKPOINTS == 1
+    _FAT_dirSeek(dir_p, idx);
+#endif
     res                  = FAT_findNext(dir_p, finfo_p);
 
     dir_p->find_by_index = 0;
@@ -535,8 +806,8 @@ FAT_FRESULT FAT_findNext(FAT_DIR *dir_p, FAT_FILE *finfo_p)
     // modifies the main buffer then the sector is re-loaded
     if ((dir_p->dir_entry_offset == 0) || (bufferModBy != dir_p))
     {
-        response_code = sd_read_single_block(
-            dir_p->dir_start_sector + dir_p->dir_active_sector, SD_Buffer);
+        response_code = _FAT_readBuffer(dir_p->dir_start_sector +
+                                        dir_p->dir_active_sector);
         if (response_code)
             return FR_DEVICE_ERR;
         bufferModBy = dir_p;
@@ -592,35 +863,8 @@ BEGIN:;
             has_long_name = false;
         } // end get file name
 
-        // File size
-        buff_long.Int[0]   = SD_Buffer[FAT_DIR_FILE_SIZE + (e * 32)];
-        buff_long.Int[1]   = SD_Buffer[FAT_DIR_FILE_SIZE + (e * 32) + 1];
-        buff_long.Int[2]   = SD_Buffer[FAT_DIR_FILE_SIZE + (e * 32) + 2];
-        buff_long.Int[3]   = SD_Buffer[FAT_DIR_FILE_SIZE + (e * 32) + 3];
-        finfo_p->file_size = buff_long.Long;
-
-        // Get write date
-        buff_long.Int[0]         = SD_Buffer[FAT_DIR_WRITE_DATE + (e * 32)];
-        buff_long.Int[1]         = SD_Buffer[FAT_DIR_WRITE_DATE + (e * 32) + 1];
-        finfo_p->file_write_date = buff_long.Long;
-
-        // Get write time
-        buff_long.Int[0]         = SD_Buffer[FAT_DIR_WRITE_TIME + (e * 32)];
-        buff_long.Int[1]         = SD_Buffer[FAT_DIR_WRITE_TIME + (e * 32) + 1];
-        finfo_p->file_write_time = buff_long.Long;
-
-        // Start cluster
-        buff_long.Int[0] = SD_Buffer[FAT_DIR_FIRST_CLUS_LOW + (e * 32)];
-        buff_long.Int[1] = SD_Buffer[FAT_DIR_FIRST_CLUS_LOW + (e * 32) + 1];
-
-#if FAT_SUPPORT_FAT32 == 1
-        if (fat->fs_type == FS_FAT32)
-        {
-            buff_long.Int[2] = SD_Buffer[FAT_DIR_FIRST_CLUS_HIGH + (e * 32)];
-            buff_long.Int[3] =
-                SD_Buffer[FAT_DIR_FIRST_CLUS_HIGH + (e * 32) + 1];
-        }
-#endif
+        // File size, write date and time and start cluster
+        buff_long.Long = _FAT_getEntryInfo(finfo_p, e);
 
         if (dir_p->dir_open_by_idx == true)
             dir_p->dir_start_cluster = buff_long.Long;
@@ -630,6 +874,10 @@ BEGIN:;
         // Keep track of the index position of the item inside this directory
         dir_p->dir_active_item++;
         dir_p->dir_entry_offset = e + 1;
+#if FAT_DIR_CHECKPOINTS == 1
+        if (dir_p->find_by_index)
+            _FAT_dirCheckpoint(dir_p, e);
+#endif
 
         if (dir_p->find_by_index == 0)
         {
@@ -655,6 +903,82 @@ BEGIN:;
     return FR_NOT_FOUND;
 }
 
+#if FAT_DIR_CHECKPOINTS == 1
+FAT_FRESULT FAT_dirSetCheckpoints(FAT_DIR *dir_p,
+                                  FAT_DIR_CHECKPOINT *checkpoints,
+                                  uint8_t size)
+{
+    if (dir_p->dir_open == false)
+        return FR_DENIED;
+
+    dir_p->checkpoints      = size ? checkpoints : 0;
+    dir_p->checkpoints_size = size;
+    dir_p->checkpoints_len  = 0;
+    dir_p->checkpoints_gen  = dir_generation;
+    return FR_OK;
+}
+
+/*______________________________________________________________________________________________
+        Private: Move the window to the nearest recorded position before item
+idx. The window must be at the beginning of the directory.
+_______________________________________________________________________________________________*/
+static void _FAT_dirSeek(FAT_DIR *dir_p, uint16_t idx)
+{
+    FAT_DIR_CHECKPOINT *cp;
+    uint16_t nr = 0;
+
+    if (dir_p->checkpoints == 0)
+        return;
+
+    // Entries were added since the positions were recorded, so the items
+    // after them may have moved
+    if (dir_p->checkpoints_gen != dir_generation)
+    {
+        dir_p->checkpoints_len = 0;
+        dir_p->checkpoints_gen = dir_generation;
+    }
+
+    // Number of positions before item idx
+    if (idx)
+        nr = (idx - 1) / FAT_DIR_CHECKPOINT_INTERVAL;
+    if (nr > dir_p->checkpoints_len)
+        nr = dir_p->checkpoints_len;
+    if (nr == 0)
+        return;
+
+    cp = &dir_p->checkpoints[nr - 1];
+    _FAT_moveWindow(dir_p, cp->cluster);
+    dir_p->dir_active_sector = cp->sector;
+    dir_p->dir_entry_offset  = cp->entry_offset;
+    dir_p->dir_active_item   = nr * FAT_DIR_CHECKPOINT_INTERVAL;
+
+    // The sector of the position is not in the main buffer
+    bufferModBy = 0;
+}
+
+/*______________________________________________________________________________________________
+        Private: Record the position after the active item if it is the next
+one to be recorded and there is room for it
+
+        entry		entry of the item inside the active sector
+_______________________________________________________________________________________________*/
+static void _FAT_dirCheckpoint(FAT_DIR *dir_p, uint8_t entry)
+{
+    FAT_DIR_CHECKPOINT *cp;
+
+    if ((dir_p->checkpoints == 0) ||
+        (dir_p->checkpoints_len >= dir_p->checkpoints_size) ||
+        (dir_p->dir_active_item !=
+         (dir_p->checkpoints_len + 1) * FAT_DIR_CHECKPOINT_INTERVAL))
+        return;
+
+    cp               = &dir_p->checkpoints[dir_p->checkpoints_len++];
+    cp->cluster      = dir_p->dir_active_cluster;
+    cp->sector       = dir_p->dir_active_sector;
+    cp->entry_offset = entry + 1;
+}
+#endif
+
 uint16_t FAT_dirCountItems(FAT_DIR *dir_p)
 {
     dir_p->dir_nr_of_items = 0;
@@ -673,7 +997,8 @@ static FAT_FRESULT _FAT_dirRegister(const char *path, uint8_t task)
     char f_sfn[11 + 1]; // short file name length + null
     f_sfn[11]                    = 0;
     uint16_t entry_start         = 0;
-    uint16_t entry_cluster       = 0;
+    CLSTSIZE_t entry_cluster     = 0;
+    CLSTSIZE_t last_cluster      = 0;
     uint16_t entry_sector_offset = 0;
     uint32_t entry_start_sector  = 0;
     uint16_t dir_nr_of_entries   = 0;
@@ -772,6 +1097,9 @@ static FAT_FRESULT _FAT_dirRegister(const char *path, uint8_t task)
     // entries
     while ((response_code = _FAT_getFileNextSector(&dir_obj)) == FR_OK)
     {
+        // Keep the last cluster of the directory to expand it
+        last_cluster = dir_obj.dir_active_cluster;
+
         // Parse each entry in a sector
         for (e = 0; e < entries_per_sector; e++)
         {
@@ -813,27 +1141,27 @@ static FAT_FRESULT _FAT_dirRegister(const char *path, uint8_t task)
     if (empty_entries != dir_entries_necessary &&
         dir_obj.dir_start_cluster > 1 && dir_nr_of_entries < 65535)
     {
-        // Find a free cluster in the FAT table
-        file_cluster_available = FAT_tableFindFree(FAT_TASK_TABLE_FIND_FREE);
-        if (file_cluster_available < 2)
-            return FR_NO_SPACE; // no free space found
-
-        // Update FAT table to point to the new allocated cluster
-        // dir_obj.dir_start_cluster must point to file_cluster_available
+        // Find a free cluster in the FAT table, make
+        // dir_obj.dir_start_cluster point to it and mark it with EOC
         response_code =
-            _FAT_tableReadSet(dir_obj.dir_start_cluster, file_cluster_available,
-                              FAT_TASK_TABLE_SET);
-        if (response_code == 0)
-            return FR_DEVICE_ERR;
-
-        // Allocate the free cluster by marking it with EOC (End Of Chain)
-        response_code = _FAT_tableReadSet(file_cluster_available, fat->EOC,
-                                          FAT_TASK_TABLE_SET);
-        if (response_code == 0)
-            return FR_DEVICE_ERR;
+            _FAT_allocateCluster(&file_cluster_available, last_cluster);
+        if (response_code != FR_OK)
+            return response_code;
 
         // Clear the cluster with 0
-        _FAT_clearCluster(file_cluster_available, 0);
+        response_code = _FAT_clearCluster(file_cluster_available, 0);
+        if (response_code != FR_OK)
+            return response_code;
+
+        // The entries start in the new cluster if the last one had no free
+        // entries at its end
+        if (entry_start_sector == 0)
+        {
+            entry_start         = 0;
+            entry_cluster       = file_cluster_available;
+            entry_start_sector  = _FAT_clusterToSector(file_cluster_available);
+            entry_sector_offset = 0;
+        }
 
         empty_entries = dir_entries_necessary;
     }
@@ -856,8 +1184,11 @@ static FAT_FRESULT _FAT_dirRegister(const char *path, uint8_t task)
             if (response_code != FR_OK)
                 return response_code;
 
-            // Clear the cluster with 0
-            _FAT_clearCluster(file_cluster_available, 0);
+            // Clear the cluster with 0. The first sector is written below
+            // with the dot entries.
+            response_code = _FAT_clearCluster(file_cluster_available, 1);
+            if (response_code != FR_OK)
+                return response_code;
 
             file_first_sector = _FAT_clusterToSector(file_cluster_available);
             if (file_first_sector == 0)
@@ -1008,10 +1339,9 @@ static FAT_FRESULT _FAT_dirRegister(const char *path, uint8_t task)
             // to be changed in the next loop
             if ((entry_start == (entries_per_sector)-1) || (empty_entries == 1))
             {
-                sd_write_single_block(dir_obj.dir_start_sector +
-                                          dir_obj.dir_active_sector - 1,
-                                      SD_Buffer);
-                if (SD_ResponseToken != 0x05)
+                if (disk->write(dir_obj.dir_start_sector +
+                                    dir_obj.dir_active_sector - 1,
+                                SD_Buffer))
                     return FR_DEVICE_ERR;
             }
 
@@ -1084,8 +1414,7 @@ static FAT_FRESULT _FAT_dirRegister(const char *path, uint8_t task)
             SD_Buffer[32 + FAT_DIR_FIRST_CLUS_LOW + 1] =
                 dir_obj.dir_start_cluster >> 8;
 
-            sd_write_single_block(file_first_sector, SD_Buffer);
-            if (SD_ResponseToken != 0x05)
+            if (disk->write(file_first_sector, SD_Buffer))
                 return FR_DEVICE_ERR;
         }
     }
@@ -1099,7 +1428,16 @@ static FAT_FRESULT _FAT_dirRegister(const char *path, uint8_t task)
 
 FAT_FRESULT FAT_makeFile(const char *path)
 {
-    return _FAT_dirRegister(path, FAT_TASK_MKFILE);
+    FAT_FRESULT res = _FAT_dirRegister(path, FAT_TASK_MKFILE);
+#if FAT_DIR_CACHE_ENTRIES > 0
+    _FAT_dirCacheClear();
+#endif
+#if FAT_DIR_CHECKPOINTS == 1
+    dir_generation++;
+#endif
+    if (res == FR_OK)
+        res = _FAT_tableFlush();
+    return res;
 }
 
 FAT_FRESULT FAT_fwriteFloat(FAT_FILE *fp, float float_nr, uint8_t decimals)
@@ -1143,10 +1481,21 @@ FAT_FRESULT FAT_fwrite(FAT_FILE *fp, const void *buff, uint16_t btw,
     CLSTSIZE_t file_cluster_available = 0;
     uint16_t i                        = 0;
     const uint8_t *wbuff              = (const uint8_t *)buff;
+    uint8_t *sbuff                    = _FAT_fileBuffer(fp);
     *bw                               = 0;
+#if FAT_MULTI_BLOCK == 1
+    uint16_t nr_sectors;
+#endif
 
     if (fp->file_open != true)
         return FR_DENIED;
+#if FAT_READ_AHEAD == 1
+    _FAT_readAheadDrop(fp);
+#endif
+
+    // The data written to the main buffer is not on the card yet
+    if (sbuff == SD_Buffer)
+        bufferSector = FAT_BUF_SECTOR_NONE;
 
     // Allocate and set start cluster if is not set
     if (fp->file_start_cluster == 0)
@@ -1159,11 +1508,21 @@ FAT_FRESULT FAT_fwrite(FAT_FILE *fp, const void *buff, uint16_t btw,
             file_cluster_available;
         fp->file_start_sector  = _FAT_clusterToSector(file_cluster_available);
         fp->file_active_sector = 0;
-        _FAT_clearCluster(file_cluster_available, 1); // clear only first sector
+#if FAT_EXTENT_MAP == 1
+        _FAT_extentAppend(fp, 0, file_cluster_available);
+#endif
 
         res = _FAT_updateFileInfo(fp, FAT_TASK_SET_START_CLUSTER);
         if (res)
             return res;
+
+        // The new cluster holds no data, so the first sector is started in
+        // the buffer instead of being cleared on the card and read back
+        memset(sbuff, 0, SD_BUFFER_SIZE);
+#if FAT_FILE_BUFFERS == 1
+        fp->buf_sector = fp->file_start_sector;
+#endif
+        fp->w_sec_changed = false;
     }
 
     // Load the sector to continue writing to, if the fseek() or fsync() was
@@ -1172,10 +1531,10 @@ FAT_FRESULT FAT_fwrite(FAT_FILE *fp, const void *buff, uint16_t btw,
     {
         fp->w_sec_changed = false;
 
-        res               = sd_read_single_block(
-            fp->file_start_sector + fp->file_active_sector, SD_Buffer);
+        res               = _FAT_fileLoadSector(
+            fp, fp->file_start_sector + fp->file_active_sector);
         if (res)
-            return FR_DEVICE_ERR;
+            return res;
     }
 
     // The case when the file pointer is set at the end of a cluster using
@@ -1186,7 +1545,10 @@ FAT_FRESULT FAT_fwrite(FAT_FILE *fp, const void *buff, uint16_t btw,
                                    fp->file_active_cluster);
         if (res)
             return res;
-        fp->eof                 = false;
+        fp->eof = false;
+#if FAT_EXTENT_MAP == 1
+        _FAT_extentAppend(fp, fp->file_active_cluster, file_cluster_available);
+#endif
 
         fp->file_active_cluster = file_cluster_available;
         fp->file_start_sector   = _FAT_clusterToSector(file_cluster_available);
@@ -1213,49 +1575,58 @@ FAT_FRESULT FAT_fwrite(FAT_FILE *fp, const void *buff, uint16_t btw,
             fp->w_sec_changed    = false; // set by fsync()
             fp->file_update_size = true;
 
-            // Last sector of the cluster
-            if (fp->file_active_sector >= fat->BPB_SecPerClus)
+            res                  = _FAT_fwriteNextCluster(fp);
+            if (res)
+                return res;
+
+#if FAT_MULTI_BLOCK == 1
+            // Write the whole sectors left in the user buffer directly to the
+            // rest of the cluster. The last byte is kept for the main buffer
+            // so the sector that will be synced is always the last one. A
+            // single sector is cheaper to write through the main buffer.
+            nr_sectors = (btw - i - 1) / SD_BUFFER_SIZE;
+            if (nr_sectors > fat->BPB_SecPerClus - fp->file_active_sector)
+                nr_sectors = fat->BPB_SecPerClus - fp->file_active_sector;
+
+            if (nr_sectors > 1)
             {
-                // Buffer fp->file_active_cluster that _FAT_nextFileCluster()
-                // will modify
-                file_cluster_available = fp->file_active_cluster;
+                if (disk->write_multiple(fp->file_start_sector +
+                                             fp->file_active_sector,
+                                         wbuff, nr_sectors))
+                    return FR_DEVICE_ERR;
 
-                // Find and set next cluster of the file
-                _FAT_nextFileCluster(fp);
+                wbuff += nr_sectors * SD_BUFFER_SIZE;
+                i += nr_sectors * SD_BUFFER_SIZE;
+                fp->fptr += nr_sectors * SD_BUFFER_SIZE;
+                fp->file_active_sector += nr_sectors;
 
-                // Allocate a new cluster if this is the last one
-                if (fp->eof)
-                {
-                    res = _FAT_allocateCluster(&file_cluster_available,
-                                               file_cluster_available);
-                    if (res)
-                        return res;
-                    fp->eof                 = false;
-
-                    fp->file_active_cluster = file_cluster_available;
-                    fp->file_start_sector =
-                        _FAT_clusterToSector(file_cluster_available);
-                }
+                res = _FAT_fwriteNextCluster(fp);
+                if (res)
+                    return res;
             }
+#endif
 
             if (fp->fptr < fp->file_size)
             {
                 // Load the next sector if the file pointer is not at the end of
                 // file to preserve existing data
-                res = sd_read_single_block(
-                    fp->file_start_sector + fp->file_active_sector, SD_Buffer);
+                res = _FAT_fileLoadSector(
+                    fp, fp->file_start_sector + fp->file_active_sector);
                 if (res)
-                    return FR_DEVICE_ERR;
+                    return res;
             }
             else
             {
                 // Fill the buffer with 0 to clear it for the next sector
-                _FAT_fillBufferArray(0, SD_BUFFER_SIZE, 0);
+                memset(sbuff, 0, SD_BUFFER_SIZE);
+#if FAT_FILE_BUFFERS == 1
+                fp->buf_sector = fp->file_start_sector + fp->file_active_sector;
+#endif
             }
         }
 
         // fp->buffer_idx is set by fseek()
-        SD_Buffer[fp->buffer_idx++] = *wbuff++;
+        sbuff[fp->buffer_idx++] = *wbuff++;
         fp->fptr++;
     }
 
@@ -1263,18 +1634,75 @@ FAT_FRESULT FAT_fwrite(FAT_FILE *fp, const void *buff, uint16_t btw,
     return FR_OK;
 }
 
+/*______________________________________________________________________________________________
+        Private: Move to the next cluster of the file, allocating a new one at
+the end of the chain, when the active sector passed the end of the cluster.
+Used by fwrite().
+_______________________________________________________________________________________________*/
+static FAT_FRESULT _FAT_fwriteNextCluster(FAT_FILE *fp)
+{
+    FAT_FRESULT res;
+    CLSTSIZE_t file_cluster_available;
+    CLSTSIZE_t last_cluster;
+
+    // Last sector of the cluster
+    if (fp->file_active_sector >= fat->BPB_SecPerClus)
+    {
+        // Buffer fp->file_active_cluster that _FAT_nextFileCluster()
+        // will modify
+        last_cluster = fp->file_active_cluster;
+
+        // Find and set next cluster of the file
+        _FAT_nextFileCluster(fp);
+
+        // Allocate a new cluster if this is the last one
+        if (fp->eof)
+        {
+            res = _FAT_allocateCluster(&file_cluster_available, last_cluster);
+            if (res)
+                return res;
+            fp->eof = false;
+#if FAT_EXTENT_MAP == 1
+            _FAT_extentAppend(fp, last_cluster, file_cluster_available);
+#endif
+
+            fp->file_active_cluster = file_cluster_available;
+            fp->file_start_sector   = _FAT_clusterToSector(file_cluster_available);
+        }
+    }
+
+    return FR_OK;
+}
+
 FAT_FRESULT FAT_ftruncate(FAT_FILE *fp)
 {
     CLSTSIZE_t next_clst;
 
-    if ((fp->fptr >= fp->file_size) || (fp->file_open != true))
-        return FR_DENIED; // if fptr is on the eof
+    // Truncating at the end of file releases the clusters reserved by
+    // fexpand() that were not written
+    if ((fp->fptr > fp->file_size) || (fp->file_open != true))
+        return FR_DENIED; // if fptr is past the eof
+#if FAT_DIR_CACHE_ENTRIES > 0
+    _FAT_dirCacheClear();
+#endif
+#if FAT_READ_AHEAD == 1
+    _FAT_readAheadDrop(fp);
+#endif
+#if FAT_JOURNAL == 1
+    // A checkpoint of the file from before the truncation must not be
+    // replayed, its records are erased before the entry is changed
+    if (journal_sector && _FAT_journalForget(fp))
+        return FR_DEVICE_ERR;
+#endif
 
     // When set file size to zero, remove entire cluster chain
     if (fp->fptr == 0)
     {
         _FAT_removeChain(fp->file_start_cluster);
         fp->file_start_cluster = 0;
+#if FAT_EXTENT_MAP == 1
+        fp->extent_map_len = 0;
+#endif
         _FAT_updateFileInfo(fp, FAT_TASK_SET_START_CLUSTER);
         _FAT_freset(fp);
     }
@@ -1295,80 +1723,742 @@ FAT_FRESULT FAT_ftruncate(FAT_FILE *fp)
 
         // Remove rest of cluster chain
         _FAT_removeChain(next_clst);
+#if FAT_EXTENT_MAP == 1
+        _FAT_extentTrim(fp, fp->file_active_cluster);
+#endif
     }
 
     fp->file_size = fp->fptr;
     _FAT_updateFileInfo(fp, FAT_TASK_SET_FILESIZE);
 
-    return FR_OK;
+    // Release the clusters on the card only after the entry stopped using them
+    return _FAT_tableFlush();
 }
 
-FAT_FRESULT FAT_fsync(FAT_FILE *fp)
+FAT_FRESULT FAT_fexpand(FAT_FILE *fp, FSIZE_t size, bool contiguous)
 {
     FAT_FRESULT res;
-
-    // If fseek() was used before and fwrite() return an error and didn't
-    // changed fp->w_sec_changed to false, this prevents overwriting existing
-    // data
-    if ((fp->file_open != true) || (fp->w_sec_changed == true))
+    CLSTSIZE_t cluster;
+    CLSTSIZE_t prev_cluster = fat->EOC;
+    uint32_t cluster_size = (uint32_t)fat->BPB_SecPerClus * fat->BPB_BytsPerSec;
+    CLSTSIZE_t nr_clusters = (size + cluster_size - 1) / cluster_size;
+    CLSTSIZE_t start_cluster;
+
+    // Only a file without clusters can be expanded
+    if ((fp->file_open != true) || (fp->file_start_cluster != 0))
         return FR_DENIED;
 
-    // Write to file
-    sd_write_single_block(fp->file_start_sector + fp->file_active_sector,
-                          SD_Buffer);
-    // BUG: for some reason my sd card returns != 0x05 but does sucessfully
-    // write if (SD_ResponseToken != 0x05)
-    //     return FR_DEVICE_ERR;
+    if (nr_clusters == 0)
+        return FR_OK;
 
-    // Update file size
-    if (fp->file_update_size == true && fp->fptr > fp->file_size)
+    if (contiguous)
     {
-        res = _FAT_updateFileInfo(fp, FAT_TASK_SET_FILESIZE);
-        if (res)
-            return res;
-    }
-
-    // Flag for the write function to load active sector in memory
-    // since between fsync() and fwrite(), other functions could have
-    // modified the buffer
-    fp->w_sec_changed = true;
-
-    return FR_OK;
-}
-
-FAT_FRESULT FAT_fopen(FAT_DIR *dir_p, FAT_FILE *file_p, char *file_name)
-{
-    FAT_FRESULT res;
-    file_p->file_open = false;
-    if (dir_p->dir_open == false)
-        return FR_DENIED;
+        // A run that fills at least one erase unit of the device starts on an
+        // erase unit boundary if possible, so the card is written in whole
+        // units
+        bool aligned = fat->erase_unit &&
+                       ((uint32_t)nr_clusters * fat->BPB_SecPerClus >=
+                        fat->erase_unit);
+
+        // Look for a run of free clusters starting from the allocation
+        // cursor, then from the beginning of the FAT up to the cursor. The
+        // FAT is read once at most.
+        start_cluster = _FAT_findFreeRun(
+            fat->next_free, fat->CountofClusters + 1, nr_clusters, aligned);
+        if ((start_cluster == 0) && (fat->next_free > 2))
+            start_cluster = _FAT_findFreeRun(
+                2, fat->next_free + nr_clusters - 2, nr_clusters, aligned);
+        if (start_cluster == 0)
+            return FR_NO_SPACE;
+
+        // Link the run one FAT sector at a time
+        if (_FAT_tableSetRun(start_cluster, nr_clusters, true))
+            return FR_DEVICE_ERR;
+        cluster = start_cluster + nr_clusters;
+#if FAT_EXTENT_MAP == 1
+        for (CLSTSIZE_t c = start_cluster; c < cluster; c++)
+            _FAT_extentAppend(fp, c - 1, c);
+#endif
 
-    // Move pointer to the beginning of active directory
-    _FAT_moveWindow(dir_p, dir_p->dir_start_cluster);
+        fat->next_free = cluster;
+        if (fat->next_free > fat->CountofClusters + 1)
+            fat->next_free = 2;
+    }
+    else
+    {
+        start_cluster = 0;
+        while (nr_clusters--)
+        {
+            res = _FAT_allocateCluster(&cluster, prev_cluster);
+            if (res)
+            {
+                // Release what was allocated
+                _FAT_removeChain(start_cluster);
+                return res;
+            }
+#if FAT_EXTENT_MAP == 1
+            _FAT_extentAppend(fp, prev_cluster, cluster);
+#endif
 
-    // Find the file and get the starting cluster
-    res = _FAT_followPath(dir_p, file_name, FAT_TASK_FIND_FILE);
-    if (res != FR_OK)
-        return res;
+            if (start_cluster == 0)
+                start_cluster = cluster;
+            prev_cluster = cluster;
+        }
+    }
 
-    // Get file info
-    res = FAT_findByIndex(dir_p, file_p, dir_p->dir_active_item);
+    res = _FAT_tableFlush();
     if (res)
         return res;
 
-    // Save entry location as a handle for changing file size
-    file_p->entry_start_sector =
-        dir_p->dir_start_sector + dir_p->dir_active_sector;
-    file_p->entry_offset     = dir_p->dir_entry_offset - 1;
-
-    file_p->w_sec_changed    = true;
-    file_p->file_update_size = true;
+    fp->file_start_cluster = fp->file_active_cluster = start_cluster;
+    fp->file_start_sector  = _FAT_clusterToSector(start_cluster);
+    fp->file_active_sector = 0;
 
-    _FAT_freset(file_p);
-    return FR_OK;
+    return _FAT_updateFileInfo(fp, FAT_TASK_SET_START_CLUSTER);
 }
 
-FAT_FRESULT FAT_fopenByIndex(FAT_DIR *dir_p, FAT_FILE *file_p, uint16_t idx)
+/*______________________________________________________________________________________________
+        Private: Find the first run of nr_clusters free clusters between
+first_cluster and last_cluster
+
+        aligned		true to prefer a run starting on a cluster whose first
+sector is a multiple of the erase unit. After the first unaligned run is found
+the search goes on for one more erase unit at most, which is where the free
+space around that run would hold an aligned one. The unaligned run is returned
+if none was found.
+
+        return		first cluster of the run or 0 if not found
+_______________________________________________________________________________________________*/
+static CLSTSIZE_t _FAT_findFreeRun(CLSTSIZE_t first_cluster,
+                                   CLSTSIZE_t last_cluster,
+                                   CLSTSIZE_t nr_clusters, bool aligned)
+{
+    uint8_t *buff = 0;
+    uint16_t idx;
+    CLSTSIZE_t run_start     = 0;
+    CLSTSIZE_t run_length    = 0;
+    CLSTSIZE_t aligned_start = 0;
+    CLSTSIZE_t found         = 0;
+    CLSTSIZE_t found_limit   = 0;
+    // FAT entries per sector: 256 on FAT16, 128 on FAT32
+    uint16_t entries = fat->BPB_BytsPerSec >> fat->fs_type;
+
+    if (first_cluster < 2)
+        first_cluster = 2;
+    if (last_cluster > fat->CountofClusters + 1)
+        last_cluster = fat->CountofClusters + 1;
+
+    for (CLSTSIZE_t cluster = first_cluster; cluster <= last_cluster; cluster++)
+    {
+        if (found && (cluster > found_limit))
+            break;
+
+        // Load the FAT sector at the start and on each sector boundary
+        if ((buff == 0) || (cluster % entries == 0))
+        {
+            buff = _FAT_tableLoad(cluster / entries);
+            if (buff == 0)
+                return 0;
+        }
+
+        idx = (cluster % entries) << fat->fs_type;
+
+        // Any non zero bit marks a used cluster. The 4 MSB of a FAT32 entry
+        // are reserved.
+        if (buff[idx] || buff[idx + 1] ||
+            ((fat->fs_type == FS_FAT32) &&
+             (buff[idx + 2] || (buff[idx + 3] & 0x0F))))
+        {
+            run_length    = 0;
+            aligned_start = 0;
+            continue;
+        }
+
+        if (run_length++ == 0)
+            run_start = cluster;
+
+        if (aligned == false)
+        {
+            if (run_length == nr_clusters)
+                return run_start;
+            continue;
+        }
+
+        if ((aligned_start == 0) &&
+            (_FAT_clusterToSector(cluster) % fat->erase_unit == 0))
+            aligned_start = cluster;
+        if (aligned_start && (cluster - aligned_start + 1 == nr_clusters))
+            return aligned_start;
+
+        if ((found == 0) && (run_length == nr_clusters))
+        {
+            found       = run_start;
+            found_limit = run_start + nr_clusters - 1 +
+                          fat->erase_unit / fat->BPB_SecPerClus;
+        }
+    }
+
+    return found;
+}
+
+FAT_FRESULT FAT_fsync(FAT_FILE *fp)
+{
+    FAT_FRESULT res;
+
+    // If fseek() was used before and fwrite() return an error and didn't
+    // changed fp->w_sec_changed to false, this prevents overwriting existing
+    // data
+    if ((fp->file_open != true) || (fp->w_sec_changed == true))
+        return FR_DENIED;
+
+    // Write to file
+    if (disk->write(fp->file_start_sector + fp->file_active_sector,
+                    _FAT_fileBuffer(fp)))
+        return FR_DEVICE_ERR;
+
+    // Write the cached FAT table before the entry that refers to it. This is
+    // skipped while fwrite() syncs each full sector.
+    if (fp->file_update_size == true)
+    {
+        res = _FAT_tableFlush();
+        if (res)
+            return res;
+    }
+
+    // Update file size
+    if (fp->file_update_size == true && fp->fptr > fp->file_size)
+    {
+        res = _FAT_updateFileInfo(fp, FAT_TASK_SET_FILESIZE);
+        if (res)
+            return res;
+#if FAT_JOURNAL == 1
+        // The entry is past the last checkpoint of the file
+        _FAT_journalDrop(fp);
+#endif
+    }
+
+    // Wait for the card to program the sectors, which reports a write that
+    // failed after it was accepted. fwrite() doesn't wait for each sector.
+    if ((fp->file_update_size == true) && disk->sync())
+        return FR_DEVICE_ERR;
+
+    // Flag for the write function to load active sector in memory
+    // since between fsync() and fwrite(), other functions could have
+    // modified the buffer. An own buffer is not used by other functions.
+#if FAT_FILE_BUFFERS == 1
+    if (fp->sector_buf == 0)
+#endif
+        fp->w_sec_changed = true;
+
+    return FR_OK;
+}
+#if FAT_JOURNAL == 1
+FAT_FRESULT FAT_journalCreate(void)
+{
+    if (journal_sector)
+        return FR_OK;
+
+    return _FAT_journalOpen(true);
+}
+
+FAT_FRESULT FAT_fcheckpoint(FAT_FILE *fp)
+{
+    FAT_FRESULT res;
+
+    if (journal_sector == 0)
+        return FAT_fsync(fp);
+
+    if ((fp->file_open != true) || (fp->w_sec_changed == true))
+        return FR_DENIED;
+
+    // The data and the clusters that hold it are on the card before the
+    // record that makes them part of the file
+    if (disk->write(fp->file_start_sector + fp->file_active_sector,
+                    _FAT_fileBuffer(fp)))
+        return FR_DEVICE_ERR;
+
+    if (fp->file_update_size == true && fp->fptr > fp->file_size)
+    {
+        res = _FAT_tableFlush();
+        if (res)
+            return res;
+
+        res = _FAT_journalWrite(fp);
+        if (res)
+            return res;
+    }
+
+    if (disk->sync())
+        return FR_DEVICE_ERR;
+
+    // The record was built in the main buffer
+#if FAT_FILE_BUFFERS == 1
+    if (fp->sector_buf == 0)
+#endif
+        fp->w_sec_changed = true;
+
+    return FR_OK;
+}
+
+/*______________________________________________________________________________________________
+        Private: Open the journal file in the root directory, creating it if
+requested. The journal sectors are written without the FAT so they must be
+consecutive.
+_______________________________________________________________________________________________*/
+static FAT_FRESULT _FAT_journalOpen(bool create)
+{
+    static char name[] = FAT_JOURNAL_NAME;
+    FAT_DIR dir;
+    FAT_FILE file;
+    FAT_FRESULT res;
+    CLSTSIZE_t cluster;
+    uint16_t sectors;
+
+    journal_sector = 0;
+
+    if (create)
+    {
+        res = FAT_makeFile("/" FAT_JOURNAL_NAME);
+        if (res && res != FR_EXIST)
+            return res;
+    }
+
+    res = FAT_openDir(&dir, "/");
+    if (res)
+        return res;
+    res = FAT_fopen(&dir, &file, name);
+    if (res)
+        return res;
+
+    // A new journal is filled with records that are not valid
+    if (create && file.file_start_cluster == 0)
+    {
+        res = FAT_fexpand(&file, (FSIZE_t)FAT_JOURNAL_SECTORS * SD_BUFFER_SIZE,
+                          true);
+        if (res)
+            return res;
+
+        if (disk->zero(file.file_start_sector, FAT_JOURNAL_SECTORS))
+            return FR_DEVICE_ERR;
+
+        file.fptr = (FSIZE_t)FAT_JOURNAL_SECTORS * SD_BUFFER_SIZE;
+        res       = _FAT_updateFileInfo(&file, FAT_TASK_SET_FILESIZE);
+        if (res)
+            return res;
+    }
+
+    if ((file.file_start_cluster < 2) ||
+        (file.file_size < (FSIZE_t)FAT_JOURNAL_SECTORS * SD_BUFFER_SIZE))
+        return FR_INCORRECT_ENTRY;
+
+    cluster = file.file_start_cluster;
+    for (sectors = fat->BPB_SecPerClus; sectors < FAT_JOURNAL_SECTORS;
+         sectors += fat->BPB_SecPerClus)
+    {
+        if (_FAT_tableReadSet(cluster, 0, FAT_TASK_TABLE_GET_NEXT) !=
+            cluster + 1)
+            return FR_INCORRECT_ENTRY;
+        cluster++;
+    }
+
+    journal_sector = _FAT_clusterToSector(file.file_start_cluster);
+    journal_seq    = 1;
+    for (sectors = 0; sectors < FAT_JOURNAL_SECTORS; sectors++)
+    {
+        journal_slot_sector[sectors] = 0;
+        journal_slot_live[sectors]   = false;
+    }
+    return FR_OK;
+}
+
+/*______________________________________________________________________________________________
+        Private: Apply the newest record of each file in the journal. The
+sequence numbers tell which record of a file is the newest since a file
+doesn't always get the next sector.
+_______________________________________________________________________________________________*/
+static FAT_FRESULT _FAT_journalReplay(void)
+{
+    FAT_FILE rec;
+    uint32_t slot_seq[FAT_JOURNAL_SECTORS];
+    uint32_t seq, newest_seq = 0;
+    uint8_t slot, i;
+    bool applied = false;
+    FAT_FRESULT res;
+
+    for (slot = 0; slot < FAT_JOURNAL_SECTORS; slot++)
+    {
+        res = _FAT_journalRead(slot, &rec, &seq);
+        if (res == FR_DEVICE_ERR)
+            return res;
+
+        journal_slot_sector[slot] = 0;
+        slot_seq[slot]            = 0;
+        if (res == FR_OK)
+        {
+            journal_slot_sector[slot] = rec.entry_start_sector;
+            journal_slot_offset[slot] = rec.entry_offset;
+            slot_seq[slot]            = seq;
+            if (seq > newest_seq)
+                newest_seq = seq;
+        }
+    }
+
+    if (newest_seq == 0)
+        return FR_OK;
+    journal_seq = newest_seq + 1;
+
+    for (slot = 0; slot < FAT_JOURNAL_SECTORS; slot++)
+    {
+        if (journal_slot_sector[slot] == 0)
+            continue;
+
+        // Older records of a file were replaced by the newest one
+        for (i = 0; i < FAT_JOURNAL_SECTORS; i++)
+        {
+            if ((journal_slot_sector[i] == journal_slot_sector[slot]) &&
+                (journal_slot_offset[i] == journal_slot_offset[slot]) &&
+                (slot_seq[i] > slot_seq[slot]))
+                break;
+        }
+        if (i < FAT_JOURNAL_SECTORS)
+            continue;
+
+        res = _FAT_journalApplySlot(slot, 0);
+        if (res)
+            return res;
+        applied = true;
+    }
+
+    if (applied)
+    {
+        FAT_DEBUG_println("journal replayed");
+        return _FAT_tableFlush();
+    }
+
+    return FR_OK;
+}
+
+/*______________________________________________________________________________________________
+        Private: Read a journal sector into the main buffer and get the record
+in rec: the entry location, start cluster, entry size (file_size), checkpoint
+size (fptr) and last cluster (file_active_cluster)
+
+        return		FR_NOT_FOUND if the sector holds no valid record
+_______________________________________________________________________________________________*/
+static FAT_FRESULT _FAT_journalRead(uint8_t slot, FAT_FILE *rec, uint32_t *seq)
+{
+    if (_FAT_readBuffer(journal_sector + slot))
+        return FR_DEVICE_ERR;
+
+    if ((_FAT_getLong(FAT_JNL_SIG) != FAT_JNL_SIG_VAL) ||
+        (_FAT_getLong(FAT_JNL_CHECK) != _FAT_journalCheck()))
+        return FR_NOT_FOUND;
+
+    *seq                     = _FAT_getLong(FAT_JNL_SEQ);
+    rec->entry_start_sector  = _FAT_getLong(FAT_JNL_ENTRY_SECTOR);
+    rec->entry_offset        = _FAT_getLong(FAT_JNL_ENTRY_OFFSET);
+    rec->file_start_cluster  = _FAT_getLong(FAT_JNL_START_CLUSTER);
+    rec->file_size           = _FAT_getLong(FAT_JNL_BASE_SIZE);
+    rec->fptr                = _FAT_getLong(FAT_JNL_SIZE);
+    rec->file_active_cluster = _FAT_getLong(FAT_JNL_LAST_CLUSTER);
+    return FR_OK;
+}
+
+/*______________________________________________________________________________________________
+        Private: Set the size of a checkpoint in the directory entry and end
+the cluster chain at the last cluster of the checkpoint. The record is only
+applied if the entry still belongs to the file with the size it had when the
+record was written and the chain reaches the last cluster.
+
+        return		FR_INCORRECT_ENTRY if the record doesn't apply
+_______________________________________________________________________________________________*/
+static FAT_FRESULT _FAT_journalApply(FAT_FILE *rec)
+{
+    uint32_t cluster_size = (uint32_t)fat->BPB_SecPerClus * fat->BPB_BytsPerSec;
+    FSIZE_t nr_clusters;
+    CLSTSIZE_t cluster;
+    CLSTSIZE_t next_clst;
+    FAT_FILE entry;
+    uint8_t name;
+
+    if ((rec->fptr <= rec->file_size) ||
+        (rec->entry_offset >= fat->entries_per_sector) ||
+        (rec->file_start_cluster < 2))
+        return FR_INCORRECT_ENTRY;
+
+    if (_FAT_readBuffer(rec->entry_start_sector))
+        return FR_DEVICE_ERR;
+
+    name = SD_Buffer[rec->entry_offset * 32 + FAT_DIR_NAME];
+    if ((name == FAT_DIR_FREE_SLOT) || (name == FAT_FILE_DELETED) ||
+        (_FAT_getEntryInfo(&entry, rec->entry_offset) !=
+         rec->file_start_cluster) ||
+        (entry.file_attrib &
+         (FAT_FILE_ATTR_DIRECTORY | FAT_FILE_ATTR_VOLUME_ID)) ||
+        (entry.file_size != rec->file_size))
+        return FR_INCORRECT_ENTRY;
+
+    // Follow the chain to the cluster of the last byte
+    cluster     = rec->file_start_cluster;
+    nr_clusters = (rec->fptr - 1) / cluster_size;
+    while (nr_clusters--)
+    {
+        cluster = _FAT_tableReadSet(cluster, 0, FAT_TASK_TABLE_GET_NEXT);
+        if ((cluster < 2) || (cluster > fat->CountofClusters + 1))
+            return FR_INCORRECT_ENTRY;
+    }
+    if (cluster != rec->file_active_cluster)
+        return FR_INCORRECT_ENTRY;
+
+    if (_FAT_updateFileInfo(rec, FAT_TASK_SET_FILESIZE))
+        return FR_DEVICE_ERR;
+
+    // Clusters allocated after the checkpoint hold no data of the file
+    next_clst = _FAT_tableReadSet(cluster, 0, FAT_TASK_TABLE_GET_NEXT);
+    if (next_clst != fat->EOC)
+    {
+        if (_FAT_tableReadSet(cluster, fat->EOC, FAT_TASK_TABLE_SET) == 0)
+            return FR_DEVICE_ERR;
+        if ((next_clst >= 2) && (next_clst <= fat->CountofClusters + 1))
+            _FAT_removeChain(next_clst);
+    }
+
+    return FR_OK;
+}
+
+/*______________________________________________________________________________________________
+        Private: Apply the record of a journal sector, which is then no longer
+the last checkpoint of a file. If fp is not 0 its size is updated.
+_______________________________________________________________________________________________*/
+static FAT_FRESULT _FAT_journalApplySlot(uint8_t slot, FAT_FILE *fp)
+{
+    FAT_FILE rec;
+    uint32_t seq;
+    FAT_FRESULT res;
+
+    journal_slot_live[slot] = false;
+
+    res = _FAT_journalRead(slot, &rec, &seq);
+    if (res == FR_OK)
+        res = _FAT_journalApply(&rec);
+    if (res == FR_DEVICE_ERR)
+        return res;
+
+    if ((res == FR_OK) && fp)
+        fp->file_size = rec.fptr;
+
+    return FR_OK;
+}
+
+/*______________________________________________________________________________________________
+        Private: Write a record of the size of a file to the next journal
+sector that doesn't hold the last checkpoint of a file. When every sector
+holds one, the checkpoint of another file in the next sector is written to
+its entry first. The record is built in the main buffer.
+_______________________________________________________________________________________________*/
+static FAT_FRESULT _FAT_journalWrite(FAT_FILE *fp)
+{
+    FAT_FILE entry;
+    FAT_FRESULT res;
+    uint8_t own = FAT_JOURNAL_SECTORS;
+    uint8_t slot, i;
+
+    for (slot = 0; slot < FAT_JOURNAL_SECTORS; slot++)
+    {
+        if (journal_slot_live[slot] &&
+            (journal_slot_sector[slot] == fp->entry_start_sector) &&
+            (journal_slot_offset[slot] == fp->entry_offset))
+            own = slot;
+    }
+
+    // The previous record of the file is kept until the new one is written
+    slot = journal_seq % FAT_JOURNAL_SECTORS;
+    for (i = 0; (i < FAT_JOURNAL_SECTORS) && journal_slot_live[slot]; i++)
+        slot = (slot + 1) % FAT_JOURNAL_SECTORS;
+
+    if (i == FAT_JOURNAL_SECTORS)
+    {
+        slot = journal_seq % FAT_JOURNAL_SECTORS;
+        if (slot == own)
+            slot = (slot + 1) % FAT_JOURNAL_SECTORS;
+
+        res = _FAT_journalApplySlot(slot, 0);
+        if (res)
+            return res;
+        res = _FAT_tableFlush();
+        if (res)
+            return res;
+        journal_folded = true;
+    }
+
+    // The entry of an open file could have been given the size of one of
+    // its checkpoints. The records must be based on the size in the entry.
+    if (journal_folded)
+    {
+        if (_FAT_readBuffer(fp->entry_start_sector))
+            return FR_DEVICE_ERR;
+        if ((_FAT_getEntryInfo(&entry, fp->entry_offset) ==
+             fp->file_start_cluster) &&
+            (entry.file_size > fp->file_size) && (entry.file_size <= fp->fptr))
+            fp->file_size = entry.file_size;
+        bufferModBy = 0;
+    }
+
+    _FAT_fillBufferArray(0, SD_BUFFER_SIZE, 0);
+    _FAT_setLong(FAT_JNL_SIG, FAT_JNL_SIG_VAL);
+    _FAT_setLong(FAT_JNL_SEQ, journal_seq);
+    _FAT_setLong(FAT_JNL_ENTRY_SECTOR, fp->entry_start_sector);
+    _FAT_setLong(FAT_JNL_ENTRY_OFFSET, fp->entry_offset);
+    _FAT_setLong(FAT_JNL_START_CLUSTER, fp->file_start_cluster);
+    _FAT_setLong(FAT_JNL_BASE_SIZE, fp->file_size);
+    _FAT_setLong(FAT_JNL_SIZE, fp->fptr);
+    _FAT_setLong(FAT_JNL_LAST_CLUSTER, fp->file_active_cluster);
+    _FAT_setLong(FAT_JNL_CHECK, _FAT_journalCheck());
+
+    if (disk->write(journal_sector + slot, SD_Buffer))
+        return FR_DEVICE_ERR;
+
+    if (own < FAT_JOURNAL_SECTORS)
+        journal_slot_live[own] = false;
+    journal_slot_sector[slot] = fp->entry_start_sector;
+    journal_slot_offset[slot] = fp->entry_offset;
+    journal_slot_live[slot]   = fp->fptr > fp->file_size;
+
+    journal_seq++;
+    return FR_OK;
+}
+
+/*______________________________________________________________________________________________
+        Private: Erase the records of a file so none of them is replayed
+_______________________________________________________________________________________________*/
+static FAT_FRESULT _FAT_journalForget(FAT_FILE *fp)
+{
+    uint8_t slot;
+
+    for (slot = 0; slot < FAT_JOURNAL_SECTORS; slot++)
+    {
+        if ((journal_slot_sector[slot] == fp->entry_start_sector) &&
+            (journal_slot_offset[slot] == fp->entry_offset))
+        {
+            if (disk->zero(journal_sector + slot, 1))
+                return FR_DEVICE_ERR;
+            journal_slot_sector[slot] = 0;
+            journal_slot_live[slot]   = false;
+        }
+    }
+
+    return FR_OK;
+}
+
+/*______________________________________________________________________________________________
+        Private: Forget the last checkpoint of a file after its size was
+written to the entry. The record stays in the journal but no longer applies.
+_______________________________________________________________________________________________*/
+static void _FAT_journalDrop(FAT_FILE *fp)
+{
+    uint8_t slot;
+
+    for (slot = 0; slot < FAT_JOURNAL_SECTORS; slot++)
+    {
+        if ((journal_slot_sector[slot] == fp->entry_start_sector) &&
+            (journal_slot_offset[slot] == fp->entry_offset))
+            journal_slot_live[slot] = false;
+    }
+}
+
+/*______________________________________________________________________________________________
+        Private: Write the size of the last checkpoint of this mount of a file
+being opened to its entry, so the file is opened with that size. The journal
+is only read if the file has such a checkpoint.
+_______________________________________________________________________________________________*/
+static FAT_FRESULT _FAT_journalFold(FAT_FILE *fp)
+{
+    FAT_FRESULT res;
+    uint8_t slot;
+
+    for (slot = 0; slot < FAT_JOURNAL_SECTORS; slot++)
+    {
+        if (journal_slot_live[slot] &&
+            (journal_slot_sector[slot] == fp->entry_start_sector) &&
+            (journal_slot_offset[slot] == fp->entry_offset))
+            break;
+    }
+    if (slot == FAT_JOURNAL_SECTORS)
+        return FR_OK;
+
+    res = _FAT_journalApplySlot(slot, fp);
+    if (res == FR_OK)
+        res = _FAT_tableFlush();
+
+    // The journal was read into the main buffer
+    bufferModBy = 0;
+    return res;
+}
+
+/*______________________________________________________________________________________________
+        Private: Check value of the record in the main buffer
+_______________________________________________________________________________________________*/
+static uint32_t _FAT_journalCheck(void)
+{
+    uint32_t sum = 0;
+    uint8_t idx;
+
+    for (idx = 0; idx < FAT_JNL_CHECK; idx += 4)
+        sum += _FAT_getLong(idx);
+
+    return ~sum;
+}
+#endif
+
+FAT_FRESULT FAT_fopen(FAT_DIR *dir_p, FAT_FILE *file_p, char *file_name)
+{
+    FAT_FRESULT res;
+    file_p->file_open = false;
+    if (dir_p->dir_open == false)
+        return FR_DENIED;
+
+    // Move pointer to the beginning of active directory
+    _FAT_moveWindow(dir_p, dir_p->dir_start_cluster);
+
+    // Find the file and get the starting cluster
+    res = _FAT_followPath(dir_p, file_name, FAT_TASK_FIND_FILE);
+    if (res != FR_OK)
+        return res;
+
+    // Get file info from the entry. The main buffer holds its sector and
+    // the window is left at the entry as FAT_findNext() would.
+    dir_p->dir_active_sector--;
+    bufferModBy = dir_p;
+    file_p->file_start_cluster =
+        _FAT_getEntryInfo(file_p, dir_p->dir_entry_offset - 1);
+
+    // Save entry location as a handle for changing file size
+    file_p->entry_start_sector =
+        dir_p->dir_start_sector + dir_p->dir_active_sector;
+    file_p->entry_offset     = dir_p->dir_entry_offset - 1;
+
+    file_p->w_sec_changed    = true;
+    file_p->file_update_size = true;
+#if FAT_JOURNAL == 1
+    res = _FAT_journalFold(file_p);
+    if (res)
+        return res;
+#endif
+#if FAT_EXTENT_MAP == 1
+    file_p->extent_map = 0;
+#endif
+#if FAT_FILE_BUFFERS == 1
+    file_p->sector_buf = 0;
+#endif
+#if FAT_READ_AHEAD == 1
+    file_p->ra_buf = 0;
+#endif
+
+    _FAT_freset(file_p);
+    return FR_OK;
+}
+
+FAT_FRESULT FAT_fopenByIndex(FAT_DIR *dir_p, FAT_FILE *file_p, uint16_t idx)
 {
     FAT_FRESULT res;
     file_p->file_open = false;
@@ -1377,6 +2467,28 @@ FAT_FRESULT FAT_fopenByIndex(FAT_DIR *dir_p, FAT_FILE *file_p, uint16_t idx)
 
     // Get file info
     res = FAT_findByIndex(dir_p, file_p, idx);
+    if (res == FR_OK)
+    {
+        // Save entry location as a handle for changing file size
+        file_p->entry_start_sector =
+            dir_p->dir_start_sector + dir_p->dir_active_sector;
+        file_p->entry_offset     = dir_p->dir_entry_offset - 1;
+
+        file_p->w_sec_changed    = true;
+        file_p->file_update_size = true;
+#if FAT_JOURNAL == 1
+        res = _FAT_journalFold(file_p);
+#endif
+    }
+#if FAT_EXTENT_MAP == 1
+    file_p->extent_map = 0;
+#endif
+#if FAT_FILE_BUFFERS == 1
+    file_p->sector_buf = 0;
+#endif
+#if FAT_READ_AHEAD == 1
+    file_p->ra_buf = 0;
+#endif
 
     _FAT_freset(file_p);
     return res;
@@ -1396,12 +2508,18 @@ static void _FAT_freset(FAT_FILE *file_p)
     file_p->file_start_sector =
         _FAT_clusterToSector(file_p->file_active_cluster);
     file_p->file_active_sector = 0;
+#if FAT_FILE_BUFFERS == 1
+    file_p->buf_sector = FAT_BUF_SECTOR_NONE;
+#endif
+#if FAT_READ_AHEAD == 1
+    _FAT_readAheadDrop(file_p);
+#endif
 }
 
 uint8_t *FAT_fread(FAT_FILE *file_p)
 {
-    FAT_FRESULT res;
     uint16_t idx;
+    uint8_t *sbuff = _FAT_fileBuffer(file_p);
 
     // End of a cluster
     if (file_p->file_active_sector >= fat->BPB_SecPerClus)
@@ -1413,19 +2531,196 @@ uint8_t *FAT_fread(FAT_FILE *file_p)
     if (file_p->eof)
         return 0;
 
-    // Read next sector
-    res = sd_read_single_block(
-        file_p->file_start_sector + file_p->file_active_sector, SD_Buffer);
-    if (res)
+#if FAT_READ_AHEAD == 1
+    if (file_p->ra_buf)
+    {
+        sbuff = _FAT_readAheadNext(file_p);
+        if (sbuff == 0)
+        {
+            file_p->file_err = FR_DEVICE_ERR;
+            return 0;
+        }
+    }
+    else
+#endif
+    {
+        // Read next sector. The caller may change the main buffer through
+        // the returned pointer, so it is not kept for freadInto().
+        if (sbuff == SD_Buffer)
+            bufferSector = FAT_BUF_SECTOR_NONE;
+        if (disk->read(file_p->file_start_sector + file_p->file_active_sector,
+                       sbuff))
+        {
+            file_p->file_err = FR_DEVICE_ERR;
+            return 0;
+        }
+        sbuff[SD_BUFFER_SIZE] = 0; // add null to the end
+#if FAT_FILE_BUFFERS == 1
+        file_p->buf_sector =
+            file_p->file_start_sector + file_p->file_active_sector;
+#endif
+    }
+
+    file_p->file_active_sector++;
+    idx                = file_p->buffer_idx;
+    file_p->buffer_idx = 0;
+    return &sbuff[idx];
+}
+
+FAT_FRESULT FAT_freadInto(FAT_FILE *fp, void *buff, uint16_t btr,
+                          uint16_t *br)
+{
+    uint8_t *rbuff = (uint8_t *)buff;
+    uint8_t *sbuff = _FAT_fileBuffer(fp);
+    uint16_t nr_bytes;
+    uint16_t nr_sectors;
+    SECTSIZE_t sector;
+    FAT_FRESULT res = FR_OK;
+    *br = 0;
+
+    if (fp->file_open != true)
+        return FR_DENIED;
+#if FAT_READ_AHEAD == 1
+    _FAT_readAheadDrop(fp);
+#endif
+
+    // Don't read past the end of file
+    if (fp->fptr >= fp->file_size)
+        return FR_OK;
+    if (btr > fp->file_size - fp->fptr)
+        btr = fp->file_size - fp->fptr;
+
+    // The main buffer will no longer hold the sector to write to
+    fp->w_sec_changed = true;
+
+    while (btr)
+    {
+        // The previous sector was read to the end
+        if (fp->buffer_idx > SD_BUFFER_SIZE - 1)
+        {
+            fp->buffer_idx = 0;
+            fp->file_active_sector++;
+        }
+
+        // End of a cluster
+        if (fp->file_active_sector >= fat->BPB_SecPerClus)
+        {
+            if (_FAT_nextFileCluster(fp))
+            {
+                res = FR_DEVICE_ERR; // the chain is shorter than the file
+                break;
+            }
+        }
+
+        if ((fp->buffer_idx == 0) && (btr >= SD_BUFFER_SIZE))
+        {
+            // Read the whole sectors left in the cluster directly into the
+            // user buffer
+            nr_sectors = btr / SD_BUFFER_SIZE;
+            if (nr_sectors > fat->BPB_SecPerClus - fp->file_active_sector)
+                nr_sectors = fat->BPB_SecPerClus - fp->file_active_sector;
+
+            if (_FAT_readSectors(fp->file_start_sector +
+                                     fp->file_active_sector,
+                                 rbuff, nr_sectors))
+            {
+                res = FR_DEVICE_ERR;
+                break;
+            }
+
+            // Leave the position at the end of the last sector read
+            fp->file_active_sector += nr_sectors - 1;
+            fp->buffer_idx = SD_BUFFER_SIZE;
+            nr_bytes       = nr_sectors * SD_BUFFER_SIZE;
+        }
+        else
+        {
+            // Partial sector goes through the main buffer or the own
+            // buffer, which may already hold it
+            sector = fp->file_start_sector + fp->file_active_sector;
+            if (_FAT_fileLoadSector(fp, sector))
+            {
+                res = FR_DEVICE_ERR;
+                break;
+            }
+            if (sbuff == SD_Buffer)
+                bufferSector = sector;
+
+            nr_bytes = SD_BUFFER_SIZE - fp->buffer_idx;
+            if (nr_bytes > btr)
+                nr_bytes = btr;
+
+            memcpy(rbuff, &sbuff[fp->buffer_idx], nr_bytes);
+            fp->buffer_idx += nr_bytes;
+        }
+
+        rbuff += nr_bytes;
+        fp->fptr += nr_bytes;
+        *br += nr_bytes;
+        btr -= nr_bytes;
+    }
+
+    // Release the card so other devices can use the bus between calls
+    if (_FAT_readEnd() && (res == FR_OK))
+        res = FR_DEVICE_ERR;
+
+    return res;
+}
+
+/*______________________________________________________________________________________________
+        Private: Read consecutive sectors into a buffer. With FAT_MULTI_BLOCK
+enabled the read stream is kept open so a following call that continues from
+the last sector doesn't need a new command. The public functions that read
+with it end the stream with _FAT_readEnd() before they return. No null is added
+at the end.
+
+        sector		first sector to read
+        buf			buffer of at least count * 512 bytes
+        count		number of sectors
+_______________________________________________________________________________________________*/
+static FAT_FRESULT _FAT_readSectors(SECTSIZE_t sector, uint8_t *buf,
+                                    uint16_t count)
+{
+    if (buf == SD_Buffer)
+        bufferSector = FAT_BUF_SECTOR_NONE;
+
+#if FAT_MULTI_BLOCK == 1
+    if (disk->read_multiple(sector, buf, count))
+        return FR_DEVICE_ERR;
+#else
+    while (count--)
     {
-        file_p->file_err = FR_DEVICE_ERR;
-        return 0;
+        if (disk->read(sector++, buf))
+            return FR_DEVICE_ERR;
+        buf += SD_BUFFER_SIZE;
     }
+#endif
 
-    file_p->file_active_sector++;
-    idx                = file_p->buffer_idx;
-    file_p->buffer_idx = 0;
-    return &SD_Buffer[idx];
+    return FR_OK;
+}
+
+/*______________________________________________________________________________________________
+        Private: Read a sector into the main buffer, which no longer holds the
+sector of a file read by freadInto()
+_______________________________________________________________________________________________*/
+static uint8_t _FAT_readBuffer(SECTSIZE_t sector)
+{
+    bufferSector = FAT_BUF_SECTOR_NONE;
+    return disk->read(sector, SD_Buffer);
+}
+
+/*______________________________________________________________________________________________
+        Private: End the read stream left open by _FAT_readSectors(), which
+keeps the card selected. Without FAT_MULTI_BLOCK there is no stream to end.
+_______________________________________________________________________________________________*/
+static FAT_FRESULT _FAT_readEnd(void)
+{
+#if FAT_MULTI_BLOCK == 1
+    if (disk->sync())
+        return FR_DEVICE_ERR;
+#endif
+
+    return FR_OK;
 }
 
 FSIZE_t FAT_getFptr(FAT_FILE *fp) { return fp->fptr; }
@@ -1436,6 +2731,9 @@ void FAT_fseek(FAT_FILE *fp, FSIZE_t fptr)
 {
     if (fptr > fp->file_size)
         return;
+#if FAT_READ_AHEAD == 1
+    _FAT_readAheadDrop(fp);
+#endif
 
     // Calculate the number of sectors to skip
     SECTSIZE_t skip_sectors = fptr / fat->BPB_BytsPerSec;
@@ -1456,6 +2754,11 @@ void FAT_fseek(FAT_FILE *fp, FSIZE_t fptr)
     // Since we don't keep track of how many clusters have been red
     // count the clusters from beginning of the file
     fp->file_active_cluster = fp->file_start_cluster;
+#if FAT_EXTENT_MAP == 1
+    // Jump over the clusters described by the extent map
+    skip_clusters = _FAT_extentSeek(fp, skip_clusters);
+#endif
+    fp->file_start_sector = _FAT_clusterToSector(fp->file_active_cluster);
 
     CLSTSIZE_t file_cluster_available;
 
@@ -1486,6 +2789,396 @@ void FAT_fseek(FAT_FILE *fp, FSIZE_t fptr)
     fp->file_err = 0;
 }
 
+#if FAT_EXTENT_MAP == 1
+FAT_FRESULT FAT_fmapExtents(FAT_FILE *fp, FAT_EXTENT *map, uint8_t size)
+{
+    CLSTSIZE_t cluster = fp->file_start_cluster;
+    CLSTSIZE_t next_cluster;
+    CLSTSIZE_t timeout = fat->CountofClusters;
+
+    if ((fp->file_open != true) || (size == 0))
+        return FR_DENIED;
+
+    fp->extent_map      = map;
+    fp->extent_map_size = size;
+    fp->extent_map_len  = 0;
+
+    // Empty file. The runs are added as the file grows.
+    if (cluster == 0)
+        return FR_OK;
+
+    map->start_cluster = cluster;
+    map->nr_clusters   = 1;
+    fp->extent_map_len = 1;
+
+    while (timeout--)
+    {
+        next_cluster = _FAT_tableReadSet(cluster, 0, FAT_TASK_TABLE_GET_NEXT);
+        if (next_cluster == 0)
+        {
+            fp->extent_map = 0;
+            return FR_DEVICE_ERR;
+        }
+
+        if (next_cluster == fat->EOC)
+            break;
+
+        if (next_cluster == cluster + 1)
+        {
+            map->nr_clusters++;
+        }
+        else
+        {
+            // Keep the first runs if the map is full
+            if (fp->extent_map_len == size)
+                return FR_NOT_ENOUGH_CORE;
+
+            map++;
+            map->start_cluster = next_cluster;
+            map->nr_clusters   = 1;
+            fp->extent_map_len++;
+        }
+
+        cluster = next_cluster;
+    }
+
+    return FR_OK;
+}
+
+/*______________________________________________________________________________________________
+        Private: Return the cluster that follows the given one using the extent
+map or 0 if the map doesn't know it. The FAT table must be read in that case.
+_______________________________________________________________________________________________*/
+static CLSTSIZE_t _FAT_extentNext(FAT_FILE *fp, CLSTSIZE_t cluster)
+{
+    FAT_EXTENT *ext = fp->extent_map;
+
+    if (ext == 0)
+        return 0;
+
+    for (uint8_t i = 0; i < fp->extent_map_len; i++, ext++)
+    {
+        if ((cluster >= ext->start_cluster) &&
+            (cluster - ext->start_cluster < ext->nr_clusters))
+        {
+            if (cluster - ext->start_cluster + 1 < ext->nr_clusters)
+                return cluster + 1;
+
+            // First cluster of the next run. After the last run only the FAT
+            // can tell if the chain ends or the map was too small.
+            if (i + 1 < fp->extent_map_len)
+                return ext[1].start_cluster;
+
+            return 0;
+        }
+    }
+
+    return 0;
+}
+
+/*______________________________________________________________________________________________
+        Private: Set the active cluster of the file to the cluster with index
+skip_clusters inside the chain using the extent map. If the map is too short
+the last mapped cluster is set instead.
+
+        return		number of clusters left to skip by following the FAT
+_______________________________________________________________________________________________*/
+static CLSTSIZE_t _FAT_extentSeek(FAT_FILE *fp, CLSTSIZE_t skip_clusters)
+{
+    FAT_EXTENT *ext = fp->extent_map;
+
+    if ((ext == 0) || (fp->extent_map_len == 0))
+        return skip_clusters;
+
+    for (uint8_t i = 0; i < fp->extent_map_len; i++, ext++)
+    {
+        if (skip_clusters < ext->nr_clusters)
+        {
+            fp->file_active_cluster = ext->start_cluster + skip_clusters;
+            return 0;
+        }
+
+        skip_clusters -= ext->nr_clusters;
+    }
+
+    // Continue from the last cluster of the map
+    ext--;
+    fp->file_active_cluster = ext->start_cluster + ext->nr_clusters - 1;
+    return skip_clusters + 1;
+}
+
+/*______________________________________________________________________________________________
+        Private: Add a cluster linked after prev_cluster to the extent map.
+Only a map ending with prev_cluster describes the whole chain, otherwise the
+map is left as it is.
+
+        prev_cluster	last cluster of the file or 0 if the file was empty
+        cluster			the newly allocated cluster
+_______________________________________________________________________________________________*/
+static void _FAT_extentAppend(FAT_FILE *fp, CLSTSIZE_t prev_cluster,
+                              CLSTSIZE_t cluster)
+{
+    FAT_EXTENT *ext = fp->extent_map;
+
+    if (ext == 0)
+        return;
+
+    if (fp->extent_map_len == 0)
+    {
+        ext->start_cluster = cluster;
+        ext->nr_clusters   = 1;
+        fp->extent_map_len = 1;
+        return;
+    }
+
+    ext += fp->extent_map_len - 1;
+    if (ext->start_cluster + ext->nr_clusters - 1 != prev_cluster)
+        return;
+
+    if (cluster == prev_cluster + 1)
+    {
+        ext->nr_clusters++;
+    }
+    else if (fp->extent_map_len < fp->extent_map_size)
+    {
+        ext++;
+        ext->start_cluster = cluster;
+        ext->nr_clusters   = 1;
+        fp->extent_map_len++;
+    }
+}
+
+/*______________________________________________________________________________________________
+        Private: Drop the clusters after last_cluster from the extent map. Used
+after the cluster chain was truncated.
+_______________________________________________________________________________________________*/
+static void _FAT_extentTrim(FAT_FILE *fp, CLSTSIZE_t last_cluster)
+{
+    FAT_EXTENT *ext = fp->extent_map;
+
+    if (ext == 0)
+        return;
+
+    for (uint8_t i = 0; i < fp->extent_map_len; i++, ext++)
+    {
+        if ((last_cluster >= ext->start_cluster) &&
+            (last_cluster - ext->start_cluster < ext->nr_clusters))
+        {
+            ext->nr_clusters   = last_cluster - ext->start_cluster + 1;
+            fp->extent_map_len = i + 1;
+            return;
+        }
+    }
+}
+#endif
+
+#if FAT_FILE_BUFFERS == 1
+FAT_FRESULT FAT_fsetBuffer(FAT_FILE *fp, uint8_t *buf)
+{
+    if (fp->file_open != true)
+        return FR_DENIED;
+
+    fp->sector_buf    = buf;
+    fp->buf_sector    = FAT_BUF_SECTOR_NONE;
+
+    // The active sector must be loaded in the new buffer before writing
+    fp->w_sec_changed = true;
+    return FR_OK;
+}
+#endif
+
+#if FAT_READ_AHEAD == 1
+FAT_FRESULT FAT_fsetReadAhead(FAT_FILE *fp, uint8_t *buf, uint8_t sectors)
+{
+    if (fp->file_open != true)
+        return FR_DENIED;
+
+    // The old window may still be written by a background read
+    _FAT_readAheadDrop(fp);
+    fp->ra_buf    = (sectors >= 2) ? buf : 0;
+    fp->ra_size   = sectors;
+    fp->ra_hits   = 0;
+    fp->ra_misses = 0;
+    return FR_OK;
+}
+
+/*______________________________________________________________________________________________
+        Private: Return the active sector of the file from the read-ahead
+window. The window is a ring of sectors that follow the active one. When the
+sector is not in it, the sector and the next ones of the cluster are read into
+all slots but one with one read stream. Each call then adds the sector read in
+the background to the ring and starts reading the sector after the window
+with disk->read_async() into a free slot. The SD card moves it with the SPI
+interrupt while the caller processes the returned sector. The window reaches
+up to the end of the next cluster, which is found when the window enters it so
+fread() doesn't read the FAT at the boundary.
+
+        return		pointer to the sector or 0 on a device error
+_______________________________________________________________________________________________*/
+static uint8_t *_FAT_readAheadNext(FAT_FILE *fp)
+{
+    SECTSIZE_t sector = fp->file_start_sector + fp->file_active_sector;
+    uint8_t *slot;
+    uint8_t count, i;
+    uint16_t next;
+    CLSTSIZE_t cluster;
+
+    if (fp->ra_count)
+    {
+        // The window holds the sectors in the order fread() asks for them
+        fp->ra_hits++;
+        fp->ra_count--;
+    }
+    else if (fp->ra_sector == sector)
+    {
+        // The data is checked when the transfer ends
+        fp->ra_sector = FAT_BUF_SECTOR_NONE;
+        if (disk->sync())
+            return 0;
+        fp->ra_hits++;
+    }
+    else
+    {
+        fp->ra_misses++;
+        _FAT_readAheadDrop(fp);
+
+        count = fat->BPB_SecPerClus - fp->file_active_sector;
+        if (count > fp->ra_size - 1)
+            count = fp->ra_size - 1;
+
+        for (i = 0; i < count; i++)
+        {
+            if (_FAT_readSectors(sector + i, _FAT_readAheadSlot(fp, i), 1))
+                return 0;
+        }
+        if (_FAT_readEnd())
+            return 0;
+        fp->ra_count = count - 1;
+    }
+
+    slot                 = _FAT_readAheadSlot(fp, fp->ra_head);
+    slot[SD_BUFFER_SIZE] = 0; // add null to the end
+    if (++fp->ra_head == fp->ra_size)
+        fp->ra_head = 0;
+
+    if (fp->ra_sector != FAT_BUF_SECTOR_NONE)
+    {
+        // Every slot but the returned one is used
+        if (fp->ra_count + 2 == fp->ra_size)
+            return slot;
+
+        // The sector read in the background is usually done by now
+        fp->ra_sector = FAT_BUF_SECTOR_NONE;
+        if (disk->sync())
+            return 0;
+        fp->ra_count++;
+    }
+
+    // Sector after the window, counted from the start of the active cluster
+    next = fp->file_active_sector + 1 + fp->ra_count;
+    if (next < fat->BPB_SecPerClus)
+    {
+        sector = fp->file_start_sector + next;
+    }
+    else
+    {
+        if (fp->ra_next_cluster == 0)
+        {
+#if FAT_EXTENT_MAP == 1
+            cluster = _FAT_extentNext(fp, fp->file_active_cluster);
+            if (cluster == 0)
+#endif
+                cluster = _FAT_tableReadSet(fp->file_active_cluster, 0,
+                                            FAT_TASK_TABLE_GET_NEXT);
+            fp->ra_next_cluster = cluster;
+        }
+        cluster = fp->ra_next_cluster;
+
+        // End of the chain or of the next cluster
+        next -= fat->BPB_SecPerClus;
+        if ((cluster < 2) || (cluster > fat->CountofClusters + 1) ||
+            (next >= fat->BPB_SecPerClus))
+            return slot;
+        sector = _FAT_clusterToSector(cluster) + next;
+    }
+
+    i = fp->ra_head + fp->ra_count;
+    if (i >= fp->ra_size)
+        i -= fp->ra_size;
+    if (disk->read_async(sector, _FAT_readAheadSlot(fp, i)))
+        return 0;
+    fp->ra_sector = sector;
+
+    return slot;
+}
+
+/*______________________________________________________________________________________________
+        Private: Address of a slot of the read-ahead window
+_______________________________________________________________________________________________*/
+static uint8_t *_FAT_readAheadSlot(FAT_FILE *fp, uint8_t slot)
+{
+    return &fp->ra_buf[slot * (uint16_t)(SD_BUFFER_SIZE + 1)];
+}
+
+/*______________________________________________________________________________________________
+        Private: Empty the read-ahead window after the position of the file
+was changed by other functions. A sector still being read into the window is
+waited for. It is not used, so a device error is not reported.
+_______________________________________________________________________________________________*/
+static void _FAT_readAheadDrop(FAT_FILE *fp)
+{
+    if (fp->ra_buf && (fp->ra_sector != FAT_BUF_SECTOR_NONE))
+        disk->sync();
+
+    fp->ra_sector       = FAT_BUF_SECTOR_NONE;
+    fp->ra_head         = 0;
+    fp->ra_count        = 0;
+    fp->ra_next_cluster = 0;
+}
+#endif
+
+/*______________________________________________________________________________________________
+        Private: Return the buffer that holds the data of the file, the own
+buffer if one was attached or the main buffer.
+_______________________________________________________________________________________________*/
+static uint8_t *_FAT_fileBuffer(FAT_FILE *fp)
+{
+#if FAT_FILE_BUFFERS == 1
+    if (fp->sector_buf)
+        return fp->sector_buf;
+#endif
+    return SD_Buffer;
+}
+
+/*______________________________________________________________________________________________
+        Private: Load a sector of the file in its buffer. An own buffer that
+already holds the sector is not read again, nor is the main buffer when it
+still holds the sector read by freadInto().
+_______________________________________________________________________________________________*/
+static FAT_FRESULT _FAT_fileLoadSector(FAT_FILE *fp, SECTSIZE_t sector)
+{
+    uint8_t *sbuff = _FAT_fileBuffer(fp);
+
+#if FAT_FILE_BUFFERS == 1
+    if (fp->sector_buf && (fp->buf_sector == sector))
+        return FR_OK;
+#endif
+    if (sbuff == SD_Buffer)
+    {
+        if (bufferSector == sector)
+            return FR_OK;
+        bufferSector = FAT_BUF_SECTOR_NONE;
+    }
+
+    if (disk->read(sector, sbuff))
+        return FR_DEVICE_ERR;
+
+#if FAT_FILE_BUFFERS == 1
+    fp->buf_sector = sector;
+#endif
+    return FR_OK;
+}
+
 bool FAT_feof(FAT_FILE *fp)
 {
     return ((fp->eof) || (fp->fptr >= fp->file_size));
@@ -1592,9 +3285,24 @@ static uint8_t _FAT_nextFileCluster(FAT_FILE *file_p)
     if (file_p->file_active_cluster < 2)
         return 1; // cluster allocation must start from 2
 
+    CLSTSIZE_t next_cluster = 0;
+
     // Find next cluster of the file
-    file_p->file_active_cluster = _FAT_tableReadSet(file_p->file_active_cluster,
-                                                    0, FAT_TASK_TABLE_GET_NEXT);
+#if FAT_READ_AHEAD == 1
+    // The read-ahead window found it when it reached the end of the cluster
+    next_cluster            = file_p->ra_next_cluster;
+    file_p->ra_next_cluster = 0;
+    if (next_cluster == 0)
+#endif
+#if FAT_EXTENT_MAP == 1
+    // Clusters inside the extent map don't need a FAT lookup
+    next_cluster = _FAT_extentNext(file_p, file_p->file_active_cluster);
+    if (next_cluster == 0)
+#endif
+        next_cluster = _FAT_tableReadSet(file_p->file_active_cluster, 0,
+                                         FAT_TASK_TABLE_GET_NEXT);
+
+    file_p->file_active_cluster = next_cluster;
     file_p->file_active_sector  = 0;
 
     if (file_p->file_active_cluster == fat->EOC)
@@ -1621,7 +3329,7 @@ static FAT_FRESULT _FAT_updateFileInfo(FAT_FILE *fp, uint8_t task)
     FAT_FRESULT res;
     uint16_t idx = 0;
 
-    res          = sd_read_single_block(fp->entry_start_sector, SD_Buffer);
+    res          = _FAT_readBuffer(fp->entry_start_sector);
     if (res)
         return FR_DEVICE_ERR;
 
@@ -1652,8 +3360,7 @@ static FAT_FRESULT _FAT_updateFileInfo(FAT_FILE *fp, uint8_t task)
 #endif
     }
 
-    sd_write_single_block(fp->entry_start_sector, SD_Buffer);
-    if (SD_ResponseToken != 0x05)
+    if (disk->write(fp->entry_start_sector, SD_Buffer))
         return FR_DEVICE_ERR;
 
     return FR_OK;
@@ -1665,10 +3372,11 @@ ________________________________________________________________________________
 static FAT_FRESULT _FAT_allocateCluster(CLSTSIZE_t *new_cluster,
                                         CLSTSIZE_t fat_points_to)
 {
-    FAT_FRESULT response_code = 0;
+    // Holds a cluster number, so it must not be narrowed to FAT_FRESULT
+    CLSTSIZE_t response_code = 0;
 
     // Find a free cluster in the FAT table for the new file
-    *new_cluster = FAT_tableFindFree(FAT_TASK_TABLE_FIND_FREE);
+    *new_cluster = _FAT_tableFindNextFree();
     if (*new_cluster < 2)
         return FR_NO_SPACE; // no free space found
 
@@ -1709,62 +3417,67 @@ static void _FAT_moveWindow(FAT_DIR *dir_p, CLSTSIZE_t start_cluster)
 }
 
 /*______________________________________________________________________________________________
-        Private: Fill each sector in a cluster with 0
+        Private: Fill the sectors of a cluster with 0, starting from sector
+first of the cluster. The sectors are cleared by the device in one transfer
+and the main buffer is not used.
 _______________________________________________________________________________________________*/
-static FAT_FRESULT _FAT_clearCluster(CLSTSIZE_t cluster, bool first_sector)
+static FAT_FRESULT _FAT_clearCluster(CLSTSIZE_t cluster, uint8_t first)
 {
-    uint8_t response_code = FR_OK;
-
-    _FAT_fillBufferArray(0, SD_BUFFER_SIZE, 0);
-    cluster = _FAT_clusterToSector(cluster);
-
-    for (uint16_t i = 0; i < fat->BPB_SecPerClus; i++)
-    {
-        response_code = sd_write_single_block(cluster + i, SD_Buffer);
-        if (SD_ResponseToken != 0x05)
-            return FR_DEVICE_ERR;
+    if (first >= fat->BPB_SecPerClus)
+        return FR_OK;
 
-        if (first_sector)
-            break; // clear only first sector
-    }
+    if (disk->zero(_FAT_clusterToSector(cluster) + first,
+                   fat->BPB_SecPerClus - first))
+        return FR_DEVICE_ERR;
 
-    return response_code;
+    return FR_OK;
 }
 
 /*______________________________________________________________________________________________
-        Private: Find a free cluster and returns it's number inside the FAT
-table. Also depending on task, can parse the FAT table and count all free
-clusters.
+        Private: Find the next free cluster and return its number, or 0 when
+the table is full or can't be read.
+
+        The search starts at the allocation cursor fat->next_free and wraps
+around at the end of the table, so consecutive allocations do not rescan the
+used part of the FAT. The cursor is moved past the returned cluster since the
+callers allocate it right away.
 _______________________________________________________________________________________________*/
-static CLSTSIZE_t FAT_tableFindFree(uint8_t task)
+static CLSTSIZE_t _FAT_tableFindNextFree(void)
 {
-    CLSTSIZE_t free_clusters = 0;
-    CLSTSIZE_t cluster_nr    = 0;
-    uint16_t sector_range    = fat->BPB_BytsPerSec;
-    uint8_t return_code;
+    CLSTSIZE_t cluster_nr = fat->next_free;
+    CLSTSIZE_t scanned    = 0;
+    uint16_t sector_range = fat->BPB_BytsPerSec;
+    uint16_t i;
+    SECTSIZE_t s;
+    uint8_t *buff;
     lng buf;
 
+    if ((cluster_nr < 2) || (cluster_nr > fat->CountofClusters + 1))
+        cluster_nr = 2;
+
+    // Sector and offset of the entry where the search starts
+    s = ((uint32_t)cluster_nr << fat->fs_type) / fat->BPB_BytsPerSec;
+    i = ((uint32_t)cluster_nr << fat->fs_type) - (s * fat->BPB_BytsPerSec);
+
     // Read each sector in the FAT table
-    for (uint16_t s = 0; s < fat->FATSz; s++)
+    for (; s < fat->FATSz; s++)
     {
-        return_code = sd_read_single_block(fat->Fat1StartSector + s, SD_Buffer);
-        if (return_code)
+        // The sector with a free cluster is needed again to allocate it, so
+        // keep it in the cache
+        buff = _FAT_tableLoad(s);
+        if (buff == 0)
             return 0;
 
-        // If this is the last FAT sector skip the invalid clusters at the end
-        // if(s == fat->FATSz - 1) sector_range = fat->BPB_BytsPerSec -
-        // (fat->FATmirageClusters * fat->FATDataSize);
-
         // Parse each entry in the FAT table sector
-        for (uint16_t i = 0; i < sector_range;)
+        for (; i < sector_range;)
         {
 #if FAT_SUPPORT_FAT32 == 1
             if (fat->fs_type == FS_FAT32)
             {
-                buf.Int[0] = SD_Buffer[i++];
-                buf.Int[1] = SD_Buffer[i++];
-                buf.Int[2] = SD_Buffer[i++];
-                buf.Int[3] = SD_Buffer[i++];
+                buf.Int[0] = buff[i++];
+                buf.Int[1] = buff[i++];
+                buf.Int[2] = buff[i++];
+                buf.Int[3] = buff[i++];
 
                 buf.Long &= 0x0FFFFFFF; // exclude the 4 MSB
             }
@@ -1773,25 +3486,101 @@ static CLSTSIZE_t FAT_tableFindFree(uint8_t task)
 
                 if (fat->fs_type == FS_FAT16)
             {
-                buf.Int[0] = SD_Buffer[i++];
-                buf.Int[1] = SD_Buffer[i++];
+                buf.Long   = 0;
+                buf.Int[0] = buff[i++];
+                buf.Int[1] = buff[i++];
+            }
+
+            if (buf.Long == 0 && cluster_nr >= 2)
+            {
+                fat->next_free = cluster_nr + 1;
+                return cluster_nr;
             }
 
-            if (buf.Long == 0)
+            cluster_nr++;
+
+            // Every entry was checked and none is free
+            if (++scanned > fat->CountofClusters + 1)
+                return 0;
+
+            // Skip the invalid clusters at the end
+            if (cluster_nr > fat->CountofClusters + 1)
+                break;
+        }
+
+        i = 0;
+
+        if (cluster_nr > fat->CountofClusters + 1)
+        {
+            // Wrap around to the beginning of the table and search the
+            // clusters before the cursor
+            cluster_nr = 0;
+            s          = -1; // incremented to sector 0 by the loop
+        }
+    }
+
+    return 0;
+}
+
+/*______________________________________________________________________________________________
+        Private: Count the free clusters of the FAT table. The table is read in
+one read stream, ended before returning, and each entry is tested by OR-ing its
+bytes, without assembling its value, by a loop for each FAT type.
+
+        return		number of free clusters or FAT32_FSI_UNKNOWN on a device
+error
+_______________________________________________________________________________________________*/
+static uint32_t _FAT_tableCountFree(void)
+{
+    CLSTSIZE_t free_clusters = 0;
+    CLSTSIZE_t entries       = fat->CountofClusters;
+    uint16_t nr_entries      = 2; // the first two entries are reserved
+    uint8_t *entry;
+    SECTSIZE_t s;
+
+    // The table is read directly from the card, so it must be up to date
+    if (_FAT_tableFlush())
+        return FAT32_FSI_UNKNOWN;
+
+    for (s = 0; entries && (s < fat->FATSz); s++)
+    {
+        if (_FAT_readSectors(fat->Fat1StartSector + s, SD_Buffer, 1))
+        {
+            _FAT_readEnd();
+            return FAT32_FSI_UNKNOWN;
+        }
+
+        // Entries of this sector, after the reserved ones of the first sector
+        entry      = &SD_Buffer[nr_entries << fat->fs_type];
+        nr_entries = (fat->BPB_BytsPerSec >> fat->fs_type) - nr_entries;
+        if (nr_entries > entries)
+            nr_entries = entries;
+        entries -= nr_entries;
+
+#if FAT_SUPPORT_FAT32 == 1
+        if (fat->fs_type == FS_FAT32)
+        {
+            // The 4 MSB are reserved
+            for (; nr_entries; nr_entries--, entry += 4)
+            {
+                if ((entry[0] | entry[1] | entry[2] | (entry[3] & 0x0F)) == 0)
+                    free_clusters++;
+            }
+        }
+        else
+#endif
+        {
+            for (; nr_entries; nr_entries--, entry += 2)
             {
-                free_clusters++;
-                if (task == FAT_TASK_TABLE_FIND_FREE)
-                    return cluster_nr;
+                if ((entry[0] | entry[1]) == 0)
+                    free_clusters++;
             }
-
-            cluster_nr++;
-
-            // Skip the invalid clusters at the end
-            if (cluster_nr > fat->CountofClusters + 2)
-                break;
         }
     }
 
+    if (_FAT_readEnd())
+        return FAT32_FSI_UNKNOWN;
+
     return free_clusters;
 }
 
@@ -1849,6 +3638,8 @@ ________________________________________________________________________________
 static void _FAT_fillBufferArray(uint16_t start_idx, uint16_t length,
                                  uint8_t value)
 {
+    bufferSector = FAT_BUF_SECTOR_NONE;
+
     for (uint16_t i = 0; i < length; i++)
     {
         SD_Buffer[start_idx + i] = value;
@@ -1911,12 +3702,41 @@ static FAT_FRESULT _FAT_followPath(FAT_DIR *dir_p, const char *path,
     bool path_match    = false;
     bool is_separator  = false;
     lng buf;
+#if FAT_DIR_CACHE_ENTRIES > 0
+    FAT_FRESULT res;
+#endif
 
     // Save the path start
     dir_p->ptr_path_buff     = path;
     dir_p->dir_active_sector = 0;
     dir_p->dir_active_item   = 0;
 
+    // Skip the first slash before reading the directory, which can be empty
+    if (IsSeparator(*path))
+    {
+        path++;
+        dir_p->ptr_path_buff++;
+
+        // Root directory
+        if (*path == 0)
+        {
+            dir_p->dir_start_cluster = fat->RootFirstCluster;
+            return FR_OK;
+        }
+    }
+
+#if FAT_DIR_CACHE_ENTRIES > 0
+    // Skip the directories already known and end here if the whole path is
+    // known
+    if (task == FAT_TASK_OPEN_DIR || task == FAT_TASK_FIND_FILE || task == 0)
+    {
+        res = _FAT_dirCacheWalk(dir_p, task);
+        if (res != FR_NOT_FOUND)
+            return res;
+        path = dir_p->ptr_path_buff;
+    }
+#endif
+
     while (_FAT_getFileNextSector(dir_p) == FR_OK)
     {
 
@@ -1983,19 +3803,6 @@ static FAT_FRESULT _FAT_followPath(FAT_DIR *dir_p, const char *path,
             // Find file/folder
             j = 0;
 
-            if (IsSeparator(*path))
-            {
-                path++;
-                dir_p->ptr_path_buff++; // skip the first slash
-
-                // Root directory
-                if (*path == 0)
-                {
-                    dir_p->dir_start_cluster = fat->RootFirstCluster;
-                    return FR_OK;
-                }
-            }
-
             // Load the remaining path to search
             path = dir_p->ptr_path_buff;
 
@@ -2043,24 +3850,28 @@ static FAT_FRESULT _FAT_followPath(FAT_DIR *dir_p, const char *path,
 
             if (path_match)
             {
+                buf.Long   = 0;
+                buf.Int[0] = SD_Buffer[FAT_DIR_FIRST_CLUS_LOW + (e * 32)];
+                buf.Int[1] = SD_Buffer[FAT_DIR_FIRST_CLUS_LOW + (e * 32) + 1];
+#if FAT_SUPPORT_FAT32 == 1
+                if (fat->fs_type == FS_FAT32)
+                {
+                    buf.Int[2] = SD_Buffer[FAT_DIR_FIRST_CLUS_HIGH + (e * 32)];
+                    buf.Int[3] =
+                        SD_Buffer[FAT_DIR_FIRST_CLUS_HIGH + (e * 32) + 1];
+                }
+#endif
+                dir_p->dir_entry_offset = e + 1;
+
+#if FAT_DIR_CACHE_ENTRIES > 0
+                if (task != FAT_TASK_SEARCH_SFN)
+                    _FAT_dirCacheAdd(dir_p, e, buf.Long, file_attrib);
+#endif
+
                 // Save the first cluster of the file but not when checking the
                 // SFN numeric-tail
                 if (task != FAT_TASK_SEARCH_SFN && task != FAT_TASK_FIND_FILE)
-                {
-                    buf.Int[0] = SD_Buffer[FAT_DIR_FIRST_CLUS_LOW + (e * 32)];
-                    buf.Int[1] =
-                        SD_Buffer[FAT_DIR_FIRST_CLUS_LOW + (e * 32) + 1];
-#if FAT_SUPPORT_FAT32 == 1
-                    if (fat->fs_type == FS_FAT32)
-                    {
-                        buf.Int[2] =
-                            SD_Buffer[FAT_DIR_FIRST_CLUS_HIGH + (e * 32)];
-                        buf.Int[3] =
-                            SD_Buffer[FAT_DIR_FIRST_CLUS_HIGH + (e * 32) + 1];
-                    }
-#endif
                     dir_p->dir_start_cluster = buf.Long;
-                }
 
                 // If this is the last dir in path means the file was found
                 if (*path == 0)
@@ -2093,6 +3904,210 @@ static FAT_FRESULT _FAT_followPath(FAT_DIR *dir_p, const char *path,
     return FR_NOT_FOUND;
 }
 
+/*______________________________________________________________________________________________
+        Private: Get the size, write date and time and attributes of the entry
+from the main buffer and return its first cluster.
+
+        entry		entry number inside the sector
+_______________________________________________________________________________________________*/
+static CLSTSIZE_t _FAT_getEntryInfo(FAT_FILE *finfo_p, uint8_t entry)
+{
+    uint16_t idx = entry * 32;
+    lng buf;
+
+    finfo_p->file_attrib     = SD_Buffer[FAT_DIR_ATTR + idx];
+    finfo_p->file_size       = _FAT_getLong(FAT_DIR_FILE_SIZE + idx);
+    finfo_p->file_write_date = SD_Buffer[FAT_DIR_WRITE_DATE + idx] |
+                               (SD_Buffer[FAT_DIR_WRITE_DATE + idx + 1] << 8);
+    finfo_p->file_write_time = SD_Buffer[FAT_DIR_WRITE_TIME + idx] |
+                               (SD_Buffer[FAT_DIR_WRITE_TIME + idx + 1] << 8);
+
+    // Start cluster. The high word is not used on FAT16.
+    buf.Long   = 0;
+    buf.Int[0] = SD_Buffer[FAT_DIR_FIRST_CLUS_LOW + idx];
+    buf.Int[1] = SD_Buffer[FAT_DIR_FIRST_CLUS_LOW + idx + 1];
+#if FAT_SUPPORT_FAT32 == 1
+    if (fat->fs_type == FS_FAT32)
+    {
+        buf.Int[2] = SD_Buffer[FAT_DIR_FIRST_CLUS_HIGH + idx];
+        buf.Int[3] = SD_Buffer[FAT_DIR_FIRST_CLUS_HIGH + idx + 1];
+    }
+#endif
+
+    return buf.Long;
+}
+
+#if FAT_DIR_CACHE_ENTRIES > 0
+/*______________________________________________________________________________________________
+        Private: Compare a cached name with a name of a path up to the next
+separator. Letters are compared without case as _FAT_followPath() does.
+_______________________________________________________________________________________________*/
+static bool _FAT_dirCacheMatch(const char *cached, const char *name)
+{
+    char c;
+
+    for (; *name && !IsSeparator(*name); cached++, name++)
+    {
+        c = IsUpper(*name) ? *name + 32 : *name;
+        if ((IsUpper(*cached) ? *cached + 32 : *cached) != c)
+            return false;
+    }
+
+    return *cached == 0;
+}
+
+/*______________________________________________________________________________________________
+        Private: Return the record of a name inside a directory or 0 if the
+name is not cached.
+
+        parent_cluster	start cluster of the directory
+        name			name to find, ended by a null or a separator
+_______________________________________________________________________________________________*/
+static FAT_DIR_CACHE *_FAT_dirCacheFind(CLSTSIZE_t parent_cluster,
+                                        const char *name)
+{
+    for (uint8_t i = 0; i < FAT_DIR_CACHE_ENTRIES; i++)
+    {
+        if ((dir_cache[i].item != 0) &&
+            (dir_cache[i].parent_cluster == parent_cluster) &&
+            _FAT_dirCacheMatch(dir_cache[i].name, name))
+            return &dir_cache[i];
+    }
+
+    return 0;
+}
+
+/*______________________________________________________________________________________________
+        Private: Save the entry that matched the name at dir_p->ptr_path_buff
+while scanning a directory, with its name in FAT_filename. The window of dir_p
+is at the sector after the one in the main buffer, as left by
+_FAT_getFileNextSector().
+
+        entry			entry number inside the sector
+        start_cluster	first cluster of the file or directory
+        attrib			attributes of the entry
+_______________________________________________________________________________________________*/
+static void _FAT_dirCacheAdd(FAT_DIR *dir_p, uint8_t entry,
+                             CLSTSIZE_t start_cluster, uint8_t attrib)
+{
+    FAT_DIR_CACHE *rec = &dir_cache[dir_cache_victim];
+    uint8_t i;
+
+    if (++dir_cache_victim >= FAT_DIR_CACHE_ENTRIES)
+        dir_cache_victim = 0;
+
+    rec->parent_cluster = dir_p->dir_start_cluster;
+    rec->entry_cluster  = dir_p->dir_active_cluster < 2 ? fat->RootFirstCluster
+                                                       : dir_p->dir_active_cluster;
+    rec->entry_sector   = dir_p->dir_active_sector - 1;
+    rec->entry_offset   = entry;
+    rec->start_cluster  = start_cluster;
+    rec->attrib         = attrib;
+    rec->item           = dir_p->dir_active_item;
+
+    for (i = 0; (i < FAT_MAX_FILENAME_LENGTH) && FAT_filename[i]; i++)
+        rec->name[i] = FAT_filename[i];
+    rec->name[i] = 0;
+}
+
+/*______________________________________________________________________________________________
+        Private: Follow the start of the path at dir_p->ptr_path_buff through
+the cached names. The known directories are entered as _FAT_followPath() does.
+If the last name is known too, the directory is set (OPEN_DIR) or the entry of
+the file is loaded in the main buffer with the window at it (FIND_FILE).
+
+        return		FR_NOT_FOUND if the rest of the path must be searched on
+the card from the directory and path left in dir_p
+_______________________________________________________________________________________________*/
+static FAT_FRESULT _FAT_dirCacheWalk(FAT_DIR *dir_p, uint8_t task)
+{
+    FAT_DIR_CACHE *rec;
+    const char *path = dir_p->ptr_path_buff;
+    const char *next;
+    SECTSIZE_t sector;
+    uint8_t *entry;
+    uint8_t i;
+
+    if (IsSeparator(*path))
+        path++;
+
+    while (*path)
+    {
+        rec = _FAT_dirCacheFind(dir_p->dir_start_cluster, path);
+        if (rec == 0)
+            return FR_NOT_FOUND;
+
+        next = path;
+        while (*next && !IsSeparator(*next))
+            next++;
+
+        // Last name in path
+        if (*next == 0)
+        {
+            if (task == FAT_TASK_OPEN_DIR)
+            {
+                if (!(rec->attrib & FAT_FILE_ATTR_DIRECTORY))
+                    return FR_NOT_A_DIRECTORY;
+                dir_p->dir_start_cluster = rec->start_cluster;
+                return FR_OK;
+            }
+
+            if (task != FAT_TASK_FIND_FILE)
+                return FR_OK; // the name exists
+
+            // Load the entry and check that it was not changed
+            sector = rec->entry_cluster < 2
+                         ? fat->RootFirstSector
+                         : _FAT_clusterToSector(rec->entry_cluster);
+            sector += rec->entry_sector;
+            if (_FAT_readBuffer(sector))
+                return FR_DEVICE_ERR;
+            bufferModBy = 0;
+
+            entry       = &SD_Buffer[rec->entry_offset * 32];
+            if ((entry[FAT_DIR_NAME] == FAT_DIR_FREE_SLOT) ||
+                (entry[FAT_DIR_NAME] == FAT_FILE_DELETED) ||
+                (entry[FAT_DIR_ATTR] != rec->attrib))
+            {
+                _FAT_dirCacheClear();
+                return FR_NOT_FOUND;
+            }
+
+            // The name is not read from the card again
+            for (i = 0; rec->name[i]; i++)
+                FAT_filename[i] = rec->name[i];
+            FAT_filename[i] = 0;
+
+            _FAT_moveWindow(dir_p, rec->entry_cluster);
+            dir_p->dir_active_sector = rec->entry_sector + 1;
+            dir_p->dir_entry_offset  = rec->entry_offset + 1;
+            dir_p->dir_active_item   = rec->item;
+            return FR_OK;
+        }
+
+        // Enter the directory
+        if (!(rec->attrib & FAT_FILE_ATTR_DIRECTORY))
+            return FR_NOT_FOUND;
+        dir_p->dir_start_cluster = rec->start_cluster;
+        _FAT_moveWindow(dir_p, rec->start_cluster);
+        path                 = next + 1;
+        dir_p->ptr_path_buff = path;
+    }
+
+    return FR_NOT_FOUND;
+}
+
+/*______________________________________________________________________________________________
+        Private: Drop all cached names
+_______________________________________________________________________________________________*/
+static void _FAT_dirCacheClear(void)
+{
+    for (uint8_t i = 0; i < FAT_DIR_CACHE_ENTRIES; i++)
+        dir_cache[i].item = 0;
+    dir_cache_victim = 0;
+}
+#endif
+
 /*______________________________________________________________________________________________
         Private: Used to create SFN (Short File Name) entry. It formats the
 filename and adds a numeric tail if necessary. It sets needs_lfn true or false
@@ -2178,7 +4193,7 @@ static FAT_FRESULT _FAT_createSFN(FAT_DIR *dir_p, const char *source,
 
     // Get extension
     j = 0;
-    while (*source && dots)
+    while (dots && *source)
     {
         source++; // skip the dot first
 
@@ -2302,8 +4317,8 @@ static FAT_FRESULT _FAT_getFileNextSector(FAT_DIR *dir_p)
         dir_p->dir_active_sector = 0;
     }
 
-    response_code = sd_read_single_block(
-        dir_p->dir_start_sector + dir_p->dir_active_sector, SD_Buffer);
+    response_code =
+        _FAT_readBuffer(dir_p->dir_start_sector + dir_p->dir_active_sector);
     if (response_code)
         return FR_DEVICE_ERR;
 
@@ -2335,6 +4350,31 @@ static SECTSIZE_t _FAT_clusterToSector(CLSTSIZE_t cluster)
            fat->FirstDataSector + fat->fs_partition_offset;
 }
 
+/*______________________________________________________________________________________________
+        Private: Read a little-endian 32-bit value from the main buffer array
+_______________________________________________________________________________________________*/
+static uint32_t _FAT_getLong(uint16_t idx)
+{
+    lng buf;
+
+    buf.Int[0] = SD_Buffer[idx];
+    buf.Int[1] = SD_Buffer[idx + 1];
+    buf.Int[2] = SD_Buffer[idx + 2];
+    buf.Int[3] = SD_Buffer[idx + 3];
+    return buf.Long;
+}
+
+/*______________________________________________________________________________________________
+        Private: Store a 32-bit little endian value in the main buffer
+_______________________________________________________________________________________________*/
+static void _FAT_setLong(uint16_t idx, uint32_t value)
+{
+    SD_Buffer[idx]     = value;
+    SD_Buffer[idx + 1] = value >> 8;
+    SD_Buffer[idx + 2] = value >> 16;
+    SD_Buffer[idx + 3] = value >> 24;
+}
+
 /*______________________________________________________________________________________________
         Private: Read the FAT table and get the next cluster using current one.
 Depending on task it can also set a cluster to the specified value.
@@ -2342,6 +4382,9 @@ ________________________________________________________________________________
 static CLSTSIZE_t _FAT_tableReadSet(CLSTSIZE_t cluster, CLSTSIZE_t new_value,
                                     uint8_t task)
 {
+    uint8_t *buff;
+    CLSTSIZE_t value;
+
     // Offset inside the FAT table
     // Take the cluster number and double it. That's the same as bit-shifting
     // the entire value one place to the left.
@@ -2349,69 +4392,295 @@ static CLSTSIZE_t _FAT_tableReadSet(CLSTSIZE_t cluster, CLSTSIZE_t new_value,
                          << fat->fs_type; // 1 or 2; for FAT16 or FAT32 because
                                           // cluster * 2 is cluster << 1
     // ThisFATSecNum
-    uint16_t ThisFATSecNum = FATOffset / fat->BPB_BytsPerSec;
+    SECTSIZE_t ThisFATSecNum = FATOffset / fat->BPB_BytsPerSec;
     // ThisFATEntOffset
     uint16_t ThisFATEntOffset =
         FATOffset - (ThisFATSecNum * fat->BPB_BytsPerSec);
 
     // Read FAT and get the next cluster
-    uint8_t return_code =
-        sd_read_single_block(fat->Fat1StartSector + ThisFATSecNum, SD_Buffer);
-    if (return_code)
+    buff = _FAT_tableLoad(ThisFATSecNum);
+    if (buff == 0)
         return 0;
 
     // Read cluster value
+    value = buff[ThisFATEntOffset];
+    value |= buff[ThisFATEntOffset + 1] << 8;
+
+#if FAT_SUPPORT_FAT32 == 1
+    if (fat->fs_type == FS_FAT32)
+    {
+        value |= (CLSTSIZE_t)buff[ThisFATEntOffset + 2] << 16;
+        value |= (CLSTSIZE_t)buff[ThisFATEntOffset + 3] << 24;
+    }
+#endif
+
     if ((task == FAT_TASK_TABLE_READ_SET) || (task == FAT_TASK_TABLE_GET_NEXT))
     {
-        cluster = SD_Buffer[ThisFATEntOffset];
-        cluster |= SD_Buffer[ThisFATEntOffset + 1] << 8;
+        cluster = value;
 
 #if FAT_SUPPORT_FAT32 == 1
         if (fat->fs_type == FS_FAT32)
-        {
-            cluster |= (CLSTSIZE_t)SD_Buffer[ThisFATEntOffset + 2] << 16;
-            cluster |= (CLSTSIZE_t)SD_Buffer[ThisFATEntOffset + 3] << 24;
             cluster = cluster & 0x0FFFFFFF;
-        }
 #endif
     }
 
     // Set cluster to the given value
     if ((task == FAT_TASK_TABLE_READ_SET) || (task == FAT_TASK_TABLE_SET))
     {
-#if FAT_SUPPORT_FAT32 == 1
-        // First read existing value in order to preserve the first 4 MSB
-        if (fat->fs_type == FS_FAT32)
+        // Keep the free cluster count up to date. The 4 MSB of a FAT32 entry
+        // are reserved.
+        if (fat->free_clusters != FAT32_FSI_UNKNOWN)
         {
-            CLSTSIZE_t clst_buf = SD_Buffer[ThisFATEntOffset];
-            clst_buf |= SD_Buffer[ThisFATEntOffset + 1] << 8;
-            clst_buf |= (CLSTSIZE_t)SD_Buffer[ThisFATEntOffset + 2] << 16;
-            clst_buf |= (CLSTSIZE_t)SD_Buffer[ThisFATEntOffset + 3] << 24;
-            clst_buf &= 0xF0000000;
-            new_value |= clst_buf; // add the 4 MSB to the existing value
+            if (((value & 0x0FFFFFFF) == 0) && (new_value != 0))
+                fat->free_clusters--;
+            else if (((value & 0x0FFFFFFF) != 0) && (new_value == 0))
+                fat->free_clusters++;
         }
+        fat->fsinfo_dirty = true;
+
+#if FAT_SUPPORT_FAT32 == 1
+        // Preserve the first 4 MSB of the existing value
+        if (fat->fs_type == FS_FAT32)
+            new_value |= value & 0xF0000000;
 #endif
 
-        // Write new cluster value to main buffer
-        SD_Buffer[ThisFATEntOffset]     = new_value;
-        SD_Buffer[ThisFATEntOffset + 1] = new_value >> 8;
+        // Write new cluster value to the FAT sector buffer
+        buff[ThisFATEntOffset]     = new_value;
+        buff[ThisFATEntOffset + 1] = new_value >> 8;
 
 #if FAT_SUPPORT_FAT32 == 1
         if (fat->fs_type == FS_FAT32)
         {
-            SD_Buffer[ThisFATEntOffset + 2] = new_value >> 16;
-            SD_Buffer[ThisFATEntOffset + 3] = new_value >> 24;
+            buff[ThisFATEntOffset + 2] = new_value >> 16;
+            buff[ThisFATEntOffset + 3] = new_value >> 24;
         }
 #endif
 
-        sd_write_single_block(fat->Fat1StartSector + ThisFATSecNum, SD_Buffer);
-        if (SD_ResponseToken != 0x05)
+        if (_FAT_tableMarkDirty(ThisFATSecNum))
             return 0;
     }
 
     return cluster;
 }
 
+/*______________________________________________________________________________________________
+        Private: Return a pointer to a buffer holding the given sector of the
+FAT table or 0 on a device error. With the FAT table cache enabled the sector
+is looked up in the cache first and on a miss it replaces the oldest loaded
+sector, writing it to the card if modified. Otherwise the sector is read into
+the main buffer array.
+
+        fat_sector		sector offset inside the FAT table
+_______________________________________________________________________________________________*/
+static uint8_t *_FAT_tableLoad(SECTSIZE_t fat_sector)
+{
+#if FAT_TABLE_CACHE_SECTORS > 0
+    FAT_TABLE_CACHE *slot;
+
+    for (uint8_t i = 0; i < FAT_TABLE_CACHE_SECTORS; i++)
+    {
+        if (fat_cache[i].sector == fat_sector)
+        {
+            // Keep the sector in use away from eviction
+            if (i == fat_cache_victim &&
+                ++fat_cache_victim >= FAT_TABLE_CACHE_SECTORS)
+                fat_cache_victim = 0;
+
+            fat_cache_last = i;
+            return fat_cache[i].buf;
+        }
+    }
+
+    fat_cache_last = fat_cache_victim;
+    if (++fat_cache_victim >= FAT_TABLE_CACHE_SECTORS)
+        fat_cache_victim = 0;
+    slot = &fat_cache[fat_cache_last];
+
+    if (slot->dirty)
+    {
+        if (_FAT_tableWrite(slot->sector, slot->buf))
+            return 0;
+        slot->dirty = false;
+    }
+
+    slot->sector = FAT_TABLE_CACHE_EMPTY;
+    if (disk->read(fat->Fat1StartSector + fat_sector, slot->buf))
+        return 0;
+    slot->sector = fat_sector;
+
+    return slot->buf;
+#else
+    if (_FAT_readBuffer(fat->Fat1StartSector + fat_sector))
+        return 0;
+    return SD_Buffer;
+#endif
+}
+
+/*______________________________________________________________________________________________
+        Private: Called after a FAT sector returned by _FAT_tableLoad() was
+modified. The sector is written to the card now if the FAT table cache is
+disabled, otherwise when it's evicted or the cache is flushed.
+_______________________________________________________________________________________________*/
+static FAT_FRESULT _FAT_tableMarkDirty(SECTSIZE_t fat_sector)
+{
+#if FAT_TABLE_CACHE_SECTORS > 0
+    fat_cache[fat_cache_last].dirty = true;
+    return FR_OK;
+#else
+    return _FAT_tableWrite(fat_sector, SD_Buffer);
+#endif
+}
+
+/*______________________________________________________________________________________________
+        Private: Write the modified sectors in the FAT table cache to the card
+_______________________________________________________________________________________________*/
+static FAT_FRESULT _FAT_tableFlush(void)
+{
+#if FAT_TABLE_CACHE_SECTORS > 0
+    for (uint8_t i = 0; i < FAT_TABLE_CACHE_SECTORS; i++)
+    {
+        if (fat_cache[i].dirty)
+        {
+            if (_FAT_tableWrite(fat_cache[i].sector, fat_cache[i].buf))
+                return FR_DEVICE_ERR;
+            fat_cache[i].dirty = false;
+        }
+    }
+#endif
+
+#if FAT_SUPPORT_FAT32 == 1
+    return _FAT_syncFSInfo();
+#else
+    return FR_OK;
+#endif
+}
+
+/*______________________________________________________________________________________________
+        Private: Write a FAT table sector to each copy of the FAT
+_______________________________________________________________________________________________*/
+static FAT_FRESULT _FAT_tableWrite(SECTSIZE_t fat_sector, uint8_t *buf)
+{
+    SECTSIZE_t sector = fat->Fat1StartSector + fat_sector;
+
+    for (uint8_t i = 0; i < fat->BPB_NumFATs; i++)
+    {
+        if (disk->write(sector, buf))
+            return FR_DEVICE_ERR;
+        sector += fat->FATSz;
+    }
+
+    return FR_OK;
+}
+
+/*______________________________________________________________________________________________
+        Private: Link nr_clusters free clusters from first_cluster into a chain
+ending with EOC, or free them again. Each FAT sector is loaded once, all its
+entries in the run are set in place and the sector is written to each copy of
+the FAT, whether the FAT table cache is enabled or not. If linking fails, the
+entries set so far are freed again.
+
+        link		true to link the run, false to free it
+
+        return		FR_OK or FR_DEVICE_ERR
+_______________________________________________________________________________________________*/
+static FAT_FRESULT _FAT_tableSetRun(CLSTSIZE_t first_cluster,
+                                    CLSTSIZE_t nr_clusters, bool link)
+{
+    uint8_t *buff;
+    uint16_t idx;
+    SECTSIZE_t fat_sector;
+    CLSTSIZE_t value;
+    CLSTSIZE_t cluster      = first_cluster;
+    CLSTSIZE_t last_cluster = first_cluster + nr_clusters - 1;
+    FAT_FRESULT res         = FR_OK;
+    // FAT entries per sector: 256 on FAT16, 128 on FAT32
+    uint16_t entries = fat->BPB_BytsPerSec >> fat->fs_type;
+
+    while ((res == FR_OK) && (cluster <= last_cluster))
+    {
+        fat_sector = cluster / entries;
+        buff       = _FAT_tableLoad(fat_sector);
+        if (buff == 0)
+        {
+            res = FR_DEVICE_ERR;
+            break;
+        }
+
+        // Set the entries of the run inside this sector
+        do
+        {
+            value = 0;
+            if (link)
+                value = (cluster == last_cluster) ? fat->EOC : cluster + 1;
+
+            idx           = (cluster % entries) << fat->fs_type;
+            buff[idx]     = value;
+            buff[idx + 1] = value >> 8;
+#if FAT_SUPPORT_FAT32 == 1
+            // Preserve the first 4 MSB of the existing value
+            if (fat->fs_type == FS_FAT32)
+            {
+                buff[idx + 2] = value >> 16;
+                buff[idx + 3] = (buff[idx + 3] & 0xF0) | ((value >> 24) & 0x0F);
+            }
+#endif
+
+            // The run was free before it was linked
+            if (fat->free_clusters != FAT32_FSI_UNKNOWN)
+            {
+                if (link)
+                    fat->free_clusters--;
+                else
+                    fat->free_clusters++;
+            }
+            cluster++;
+        } while ((cluster <= last_cluster) && (cluster % entries != 0));
+        fat->fsinfo_dirty = true;
+
+#if FAT_TABLE_CACHE_SECTORS > 0
+        // Written below, unless the write fails and a flush has to retry it
+        fat_cache[fat_cache_last].dirty = true;
+#endif
+        res = _FAT_tableWrite(fat_sector, buff);
+#if FAT_TABLE_CACHE_SECTORS > 0
+        if (res == FR_OK)
+            fat_cache[fat_cache_last].dirty = false;
+#endif
+    }
+
+    // Free the entries set so far, including those of the sector that failed
+    if (res && link && (cluster != first_cluster))
+        _FAT_tableSetRun(first_cluster, cluster - first_cluster, false);
+
+    return res;
+}
+
+#if FAT_SUPPORT_FAT32 == 1
+/*______________________________________________________________________________________________
+        Private: Write the free cluster count and the allocation cursor to the
+FSInfo sector if they changed. The sector is built in the main buffer from
+scratch since all the other bytes are signatures or reserved.
+_______________________________________________________________________________________________*/
+static FAT_FRESULT _FAT_syncFSInfo(void)
+{
+    if ((fat->BPB_FSInfo == 0) || (fat->fsinfo_dirty == false))
+        return FR_OK;
+
+    _FAT_fillBufferArray(0, SD_BUFFER_SIZE, 0);
+    _FAT_setLong(FAT32_FSI_LEAD_SIG, FAT32_FSI_LEAD_SIG_VAL);
+    _FAT_setLong(FAT32_FSI_STRUC_SIG, FAT32_FSI_STRUC_SIG_VAL);
+    _FAT_setLong(FAT32_FSI_FREE_COUNT, fat->free_clusters);
+    _FAT_setLong(FAT32_FSI_NXT_FREE, fat->next_free);
+    _FAT_setLong(FAT32_FSI_TRAIL_SIG, FAT32_FSI_TRAIL_SIG_VAL);
+
+    if (disk->write(fat->fs_partition_offset + fat->BPB_FSInfo, SD_Buffer))
+        return FR_DEVICE_ERR;
+
+    fat->fsinfo_dirty = false;
+    return FR_OK;
+}
+#endif
+
 /*______________________________________________________________________________________________
         Private: Extract LFN
 _______________________________________________________________________________________________*/
@@ -49,17 +49,122 @@ https://www.programming-electronics-diy.xyz/2022/07/sd-memory-card-library-for-a
 #ifndef FAT_H_
 #define FAT_H_
 
+#include "disk.h"
 #include <avrlibdefs.h>
 
 /*************************************************************
         USER DEFINED SETTINGS
 **************************************************************/
+// Each option can be overridden by defining it before this file is included,
+// for example with -D on the compiler command line.
+#ifndef FAT_SUPPORT_FAT32
 #define FAT_SUPPORT_FAT32 1 // set to 0 to support only FAT16 and exclude FAT32
+#endif
+
+// Mount the SD card (SD_Disk) unless FAT_bindDisk() selected another device.
+// Builds without the card driver, such as on a PC with a disk image, define
+// this as 0.
+#ifndef FAT_DISK_SD
+#define FAT_DISK_SD 1
+#endif
 
 // FAT supports file names up to 260 characters including path
 // but that would take a lot of space so
 // shorter file names could be used instead
+#ifndef FAT_MAX_FILENAME_LENGTH
 #define FAT_MAX_FILENAME_LENGTH 30
+#endif
+
+// The options below that take RAM are off by default. The RAM they take on the
+// AVR is given for FAT_SUPPORT_FAT32.
+
+// Number of FAT table sectors kept in RAM. Modified FAT entries are written to
+// the card when a sector is evicted from the cache and on FAT_fsync() or
+// FAT_unmountVolume(). Set to 0 to read and write the FAT table through the
+// main buffer on every access.
+// RAM: 518 bytes per sector plus 2 bytes
+#ifndef FAT_TABLE_CACHE_SECTORS
+#define FAT_TABLE_CACHE_SECTORS 0
+#endif
+
+// Use multiple block transfers for consecutive sectors of a file. fwrite()
+// writes the whole sectors of a large buffer directly from it and freadInto()
+// reads them directly into the buffer. The transfers are ended before each
+// call returns, so other devices can use the SPI bus between calls.
+// RAM: none
+#ifndef FAT_MULTI_BLOCK
+#define FAT_MULTI_BLOCK 1
+#endif
+
+// Support a caller allocated extent map for files. When attached with
+// FAT_fmapExtents() the clusters of a file are found without reading the FAT
+// table during fseek() and sequential access.
+// RAM: 4 bytes per FAT_FILE, plus the map of 8 bytes per run
+#ifndef FAT_EXTENT_MAP
+#define FAT_EXTENT_MAP 0
+#endif
+
+// Allow a file to use its own sector buffer attached with FAT_fsetBuffer()
+// instead of the main buffer. Files with their own buffer can be written in
+// turns without syncing and reloading the active sector at each switch.
+// RAM: 6 bytes per FAT_FILE, plus 513 bytes per attached buffer
+#ifndef FAT_FILE_BUFFERS
+#define FAT_FILE_BUFFERS 0
+#endif
+
+// Allow a file to use a caller allocated read-ahead window attached with
+// FAT_fsetReadAhead(). fread() then fills the window with one multiple block
+// transfer, keeps it filled by reading the next sector in the background while
+// the caller processes the one returned, and resolves the link to the next
+// cluster ahead of the cluster boundary. The SD card reads in the background
+// only with SPI_ASYNC defined in spi_conf.h. At the fosc/2 SPI clock of the SD
+// driver the background read is slower than a blocking one, since the SPI
+// interrupt costs more than a byte. SPI_ASYNC only pays off at slower clocks.
+// RAM: 17 bytes per FAT_FILE, plus 513 bytes per sector of the window
+#ifndef FAT_READ_AHEAD
+#define FAT_READ_AHEAD 0
+#endif
+
+// Number of recently resolved names kept in RAM. fopen() and openDir() find a
+// known file or directory without scanning its parent directory. The records
+// are dropped by makeDir(), makeFile() and ftruncate(). Set to 0 to always
+// scan the directories. A record is used only when its whole name matches.
+// RAM: 19 bytes plus FAT_MAX_FILENAME_LENGTH per entry (49 by default), plus
+// 1 byte
+#ifndef FAT_DIR_CACHE_ENTRIES
+#define FAT_DIR_CACHE_ENTRIES 0
+#endif
+
+// Support a caller allocated array of directory positions attached with
+// FAT_dirSetCheckpoints(). findByIndex() records the position after every
+// FAT_DIR_CHECKPOINT_INTERVAL items and starts from the nearest one instead of
+// the first sector of the directory.
+// RAM: 5 bytes per FAT_DIR plus 1 byte, plus the array of 7 bytes per position
+#ifndef FAT_DIR_CHECKPOINTS
+#define FAT_DIR_CHECKPOINTS 0
+#endif
+#ifndef FAT_DIR_CHECKPOINT_INTERVAL
+#define FAT_DIR_CHECKPOINT_INTERVAL 16
+#endif
+
+// Keep a journal of file size checkpoints in a file of the root directory
+// created by FAT_journalCreate(). FAT_fcheckpoint() then saves the data of a
+// file with one journal sector write instead of rewriting its directory entry
+// and FAT_mountVolume() sets the sizes recorded before a power loss.
+// RAM: 9 bytes + 6 bytes per journal sector
+#ifndef FAT_JOURNAL
+#define FAT_JOURNAL 0
+#endif
+
+// Sectors of the journal, used in turns by the checkpoints. A sector that
+// holds the last checkpoint of a file is skipped. When all of them do, the
+// checkpoint of another file is first written to its entry.
+#ifndef FAT_JOURNAL_SECTORS
+#define FAT_JOURNAL_SECTORS 8
+#endif
+#ifndef FAT_JOURNAL_NAME
+#define FAT_JOURNAL_NAME "journal.sys"
+#endif
 
 typedef int32_t INT_SIZE; // can be int32_t (default) or int64_t
 
@@ -67,8 +172,6 @@ typedef int32_t INT_SIZE; // can be int32_t (default) or int64_t
         SYSTEM DEFINES
 **************************************************************/
 #define FAT_TASK_SEARCH_SFN        1
-#define FAT_TASK_TABLE_COUNT_FREE  2
-#define FAT_TASK_TABLE_FIND_FREE   3
 #define FAT_TASK_MKDIR             4
 #define FAT_TASK_MKFILE            5
 #define FAT_TASK_TABLE_SET         6
@@ -169,6 +272,29 @@ typedef int32_t INT_SIZE; // can be int32_t (default) or int64_t
 #define FAT32_BS_VOL_LABEL 71 // volume label (FAT32)
 #define FAT32_BS_FS_TYPE   82 // set to the string:"FAT32 "
 
+/* FSInfo sector (FAT32 only) */
+#define FAT32_FSI_LEAD_SIG      0   // lead signature, must be 0x41615252
+#define FAT32_FSI_STRUC_SIG     484 // structure signature, must be 0x61417272
+#define FAT32_FSI_FREE_COUNT    488 // last known free cluster count
+#define FAT32_FSI_NXT_FREE      492 // hint for the next free cluster
+#define FAT32_FSI_TRAIL_SIG     508 // trail signature, must be 0xAA550000
+#define FAT32_FSI_LEAD_SIG_VAL  0x41615252
+#define FAT32_FSI_STRUC_SIG_VAL 0x61417272
+#define FAT32_FSI_TRAIL_SIG_VAL 0xAA550000
+#define FAT32_FSI_UNKNOWN       0xFFFFFFFF // free count or hint is not known
+
+/* Journal record, one per journal sector */
+#define FAT_JNL_SIG           0  // signature, must be 0x4C4E524A ("JRNL")
+#define FAT_JNL_SEQ           4  // sequence number, counts from 1
+#define FAT_JNL_ENTRY_SECTOR  8  // sector of the directory entry
+#define FAT_JNL_ENTRY_OFFSET  12 // entry number inside the sector
+#define FAT_JNL_START_CLUSTER 16 // first cluster of the file
+#define FAT_JNL_BASE_SIZE     20 // file size in the entry when recorded
+#define FAT_JNL_SIZE          24 // file size at the checkpoint
+#define FAT_JNL_LAST_CLUSTER  28 // cluster that holds the last byte
+#define FAT_JNL_CHECK         32 // complement of the sum of the fields above
+#define FAT_JNL_SIG_VAL       0x4C4E524A
+
 /* Directory Entry */
 #define FAT_DIR_NAME              0x00
 #define FAT_DIR_ATTR              11
@@ -261,7 +387,8 @@ typedef enum
     FR_ROOT_DIR, // When going back the directory path this is returned when the
                  // active dir is root
     FR_INDEX_OUT_OF_RANGE,
-    FR_DEVICE_ERR // A hard error occurred in the low level disk I/O layer
+    FR_DEVICE_ERR, // A hard error occurred in the low level disk I/O layer
+    FR_NOT_ENOUGH_CORE // The extent map is too small for the cluster chain
 } FAT_FRESULT;
 
 /* File system object structure (FAT) */
@@ -284,7 +411,14 @@ typedef struct
                               // sector of the volume that contains the BPB
     uint16_t Fat1StartSector;
     uint16_t Fat2StartSector;
-    uint8_t FATDataSize; // 2-bytes if FAT16, 4-bytes if FAT32
+    CLSTSIZE_t next_free; // allocation cursor: cluster where the search for a
+                          // free cluster starts
+    uint32_t free_clusters; // number of free clusters or FAT32_FSI_UNKNOWN
+    uint16_t BPB_FSInfo;    // sector of the FSInfo structure (FAT32 only)
+    uint32_t erase_unit;    // sectors of the device erase unit, 0 if unknown
+    bool fsinfo_dirty;      // free count or cursor changed since last sync
+    uint8_t BPB_NumFATs;    // number of FAT copies
+    uint8_t FATDataSize;  // 2-bytes if FAT16, 4-bytes if FAT32
     uint8_t
         entries_per_sector; // number of entries in a sector given a 32 bytes
                             // entry. For a 512 bytes per sector: 512 / 32 = 16
@@ -293,6 +427,14 @@ typedef struct
     uint8_t BPB_SecPerClus;    // sectors per cluster
 } FAT;
 
+/* Position in a directory after an item (FAT_DIR_CHECKPOINT) */
+typedef struct
+{
+    CLSTSIZE_t cluster;   // cluster that holds the entry of the item
+    uint16_t sector;      // sector of the entry inside the cluster
+    uint8_t entry_offset; // entry after the item inside the sector
+} FAT_DIR_CHECKPOINT;
+
 /* Directory object structure (FAT_DIR) */
 typedef struct
 {
@@ -311,8 +453,22 @@ typedef struct
     uint16_t find_by_index;
     uint8_t filename_length;
     const char *ptr_path_buff;
+#if FAT_DIR_CHECKPOINTS == 1
+    FAT_DIR_CHECKPOINT *checkpoints; // positions in the directory (0 if not
+                                     // used)
+    uint8_t checkpoints_size;        // number of positions the array can hold
+    uint8_t checkpoints_len;         // number of positions recorded
+    uint8_t checkpoints_gen;         // directory changes when recorded
+#endif
 } FAT_DIR;
 
+/* Run of contiguous clusters of a file (FAT_EXTENT) */
+typedef struct
+{
+    CLSTSIZE_t start_cluster; // first cluster of the run
+    CLSTSIZE_t nr_clusters;   // number of clusters in the run
+} FAT_EXTENT;
+
 /* File information structure (FAT_FILE) */
 typedef struct
 {
@@ -336,6 +492,25 @@ typedef struct
     bool file_open;
     bool w_sec_changed; // write sector changed
     bool eof;
+#if FAT_EXTENT_MAP == 1
+    FAT_EXTENT *extent_map;  // cluster runs of the file (0 if not used)
+    uint8_t extent_map_size; // number of runs the map can hold
+    uint8_t extent_map_len;  // number of runs in use
+#endif
+#if FAT_FILE_BUFFERS == 1
+    uint8_t *sector_buf;   // own sector buffer (0 if the main buffer is used)
+    SECTSIZE_t buf_sector; // sector held by sector_buf
+#endif
+#if FAT_READ_AHEAD == 1
+    uint8_t *ra_buf;            // read-ahead window (0 if not used)
+    SECTSIZE_t ra_sector;       // sector being read in the background
+    uint8_t ra_size;            // number of sectors the window can hold
+    uint8_t ra_head;            // slot of the next sector fread() returns
+    uint8_t ra_count;           // sectors read and not returned yet
+    CLSTSIZE_t ra_next_cluster; // cluster after the active one, 0 if unknown
+    uint16_t ra_hits;   // fread() calls served by the sector read ahead
+    uint16_t ra_misses; // fread() calls that had to read the sector
+#endif
 } FAT_FILE;
 
 /*************************************************************
@@ -351,11 +526,31 @@ typedef struct
         FUNCTION PROTOTYPES
 **************************************************************/
 // Volume
+/*______________________________________________________________________________________________
+        Select the block device that the next FAT_mountVolume() will use, such
+as SD_Disk or IMAGE_Disk. Unmount the volume first.
+_______________________________________________________________________________________________*/
+void FAT_bindDisk(const DISK_OPS *ops);
 FAT_MOUNT_RESULT FAT_mountVolume(void);
 /*______________________________________________________________________________________________
-        Return volume free space in bytes
+        Write all cached FAT table sectors to the card and, with FAT_JOURNAL,
+the sizes of the checkpoints to the directory entries. Open files must be
+synchronized with fsync() or fcheckpoint() before the card is removed.
+_______________________________________________________________________________________________*/
+FAT_FRESULT FAT_unmountVolume(void);
+/*______________________________________________________________________________________________
+        Return volume free space in bytes. The free clusters are counted on the
+first call if the FSInfo sector of FAT32 doesn't hold the count, then the count
+is kept up to date by each allocation and release. 0 is returned if the count
+failed on a device error, and the count is made again on the next call.
 _______________________________________________________________________________________________*/
 uint64_t FAT_volumeFreeSpace(void);
+/*______________________________________________________________________________________________
+        Count the free clusters of the FAT table again and return volume free
+space in bytes. The FSInfo count is only a hint, so use this if the card was
+written by a system that doesn't keep it up to date.
+_______________________________________________________________________________________________*/
+uint64_t FAT_volumeCountFreeSpace(void);
 /*______________________________________________________________________________________________
         Return volume capacity in bytes
 _______________________________________________________________________________________________*/
@@ -427,6 +622,25 @@ position. Index must start from 1. If index is greater than the number of items
 inside the directory, then FR_NOT_FOUND will be returned.
 _______________________________________________________________________________________________*/
 FAT_FRESULT FAT_findByIndex(FAT_DIR *dir_p, FAT_FILE *finfo_p, uint16_t idx);
+#if FAT_DIR_CHECKPOINTS == 1
+/*______________________________________________________________________________________________
+        Attach an array of positions to an opened directory. findByIndex(),
+openDirByIndex() and fopenByIndex() then record the position after every
+FAT_DIR_CHECKPOINT_INTERVAL items they pass and start from the nearest position
+before the item, so any index is found by reading only a few sectors, in both
+directions. findNext() continues from the item found. The positions are
+recorded again after makeDir() or makeFile() and when the directory object
+moves to another directory. The array is released by openDir().
+
+        dir_p		Pointer to the directory object structure
+        checkpoints	Array of positions. size positions cover
+(size + 1) * FAT_DIR_CHECKPOINT_INTERVAL items.
+        size		Number of positions in the array
+_______________________________________________________________________________________________*/
+FAT_FRESULT FAT_dirSetCheckpoints(FAT_DIR *dir_p,
+                                  FAT_DIR_CHECKPOINT *checkpoints,
+                                  uint8_t size);
+#endif
 /*______________________________________________________________________________________________
         Get file info of the first or next item in the directory that was opened
 previously
@@ -465,7 +679,8 @@ FAT_FRESULT FAT_fwriteString(FAT_FILE *fp, const char *string);
         The write pointer advances with each byte written.
         CAUTION: running other functions will overwrite the common data buffer
 causing the loss of unsaved data. Use fsync() before using any other function
-including fseek().
+including fseek(). A file with its own buffer set by fsetBuffer() only needs
+fsync() before fseek() and to save the data to the card.
 
         fp			Pointer to the file object structure
         buff		Pointer to the data to be written
@@ -476,16 +691,53 @@ ________________________________________________________________________________
 FAT_FRESULT FAT_fwrite(FAT_FILE *fp, const void *buff, uint16_t btw,
                        uint16_t *bw);
 /*______________________________________________________________________________________________
-        Truncates the file size to the current file read/write pointer
+        Truncates the file size to the current file read/write pointer. At the
+end of file it releases the clusters reserved by fexpand() that were not used.
 _______________________________________________________________________________________________*/
 FAT_FRESULT FAT_ftruncate(FAT_FILE *fp);
 /*______________________________________________________________________________________________
-        Flush cached data of the writing file
+        Allocate the clusters for size bytes to an empty file before writing to
+it. The following writes fill the reserved clusters without searching the FAT
+for free space so the write time of each sector stays predictable. The file
+size is not changed and grows with the data written. Use ftruncate() at the end
+of file to release the clusters that were not used.
+
+        fp			Pointer to the file object structure
+        size		Number of bytes to reserve
+        contiguous	true to allocate a single run of consecutive clusters.
+On a fragmented card this can fail with FR_NO_SPACE even if enough free space
+exists.
+_______________________________________________________________________________________________*/
+FAT_FRESULT FAT_fexpand(FAT_FILE *fp, FSIZE_t size, bool contiguous);
+/*______________________________________________________________________________________________
+        Flush cached data of the writing file and wait until the device has
+stored it. FR_DEVICE_ERR is returned if a write failed after it was accepted.
 _______________________________________________________________________________________________*/
 FAT_FRESULT FAT_fsync(FAT_FILE *fp);
+#if FAT_JOURNAL == 1
+/*______________________________________________________________________________________________
+        Create the journal file in the root directory if it doesn't exist and
+start recording checkpoints. The journal is found again by FAT_mountVolume().
+
+        return		FR_INCORRECT_ENTRY if the file exists but is shorter than
+FAT_JOURNAL_SECTORS or its clusters are not consecutive
+_______________________________________________________________________________________________*/
+FAT_FRESULT FAT_journalCreate(void);
+/*______________________________________________________________________________________________
+        Same as fsync() but a new file size is written to the journal instead
+of the directory entry. After a power loss FAT_mountVolume() sets the size of
+the last checkpoint of each file and releases the clusters after it, if the
+entry was not changed since by fsync() or ftruncate(). Opening the file again
+writes the size of its last checkpoint to the entry, as FAT_unmountVolume()
+does for every file, so the file must be synchronized or checkpointed before.
+Without a journal the function calls fsync().
+_______________________________________________________________________________________________*/
+FAT_FRESULT FAT_fcheckpoint(FAT_FILE *fp);
+#endif
 /*______________________________________________________________________________________________
         Open a file using it's name. The search will be made inside the active
-directory.
+directory. If the file was opened recently its entry is found without scanning
+the directory and getFilename() returns the name as written in file_name.
 _______________________________________________________________________________________________*/
 FAT_FRESULT FAT_fopen(FAT_DIR *dir_p, FAT_FILE *file_p, char *file_name);
 /*______________________________________________________________________________________________
@@ -501,6 +753,83 @@ used to preserve RAM. The file must be opened using the appropriate function
 before it can be read.
 _______________________________________________________________________________________________*/
 uint8_t *FAT_fread(FAT_FILE *file_p);
+/*______________________________________________________________________________________________
+        Read data from the file at the file read/write pointer into a user
+buffer. The pointer advances with each byte read and the read stops at the end
+of file. Whole sectors are transferred from the card directly into the buffer
+and only partial sectors pass through the main buffer. A partial sector left in
+the main buffer by the previous call is not read again, unless other functions
+used the main buffer in between. Use fseek() before switching between this
+function and fread() on the same file.
+
+        fp			Pointer to the file object structure
+        buff		Pointer to the buffer to store the data in
+        btr			Number of bytes to read
+        br			Pointer to the variable to return number of
+bytes read
+_______________________________________________________________________________________________*/
+FAT_FRESULT FAT_freadInto(FAT_FILE *fp, void *buff, uint16_t btr,
+                          uint16_t *br);
+#if FAT_EXTENT_MAP == 1
+/*______________________________________________________________________________________________
+        Attach an extent map to an opened file and fill it by following the
+cluster chain once. The map is a caller allocated array that describes the file
+as runs of contiguous clusters. fseek() and moving to the next cluster then
+don't need to read the FAT table. Clusters added by fwrite() are appended to
+the map while there is room. The map is released when the file is opened again.
+
+        fp			Pointer to the file object structure
+        map			Array of extents
+        size		Number of extents in the array
+
+        return		FR_NOT_ENOUGH_CORE if the chain has more runs than the
+map can hold. The runs that fit are still used.
+_______________________________________________________________________________________________*/
+FAT_FRESULT FAT_fmapExtents(FAT_FILE *fp, FAT_EXTENT *map, uint8_t size);
+#endif
+#if FAT_FILE_BUFFERS == 1
+/*______________________________________________________________________________________________
+        Attach a sector buffer to an opened file. fwrite(), fsync(), fread() and
+freadInto() then keep the data of the file in this buffer instead of the main
+buffer, so other functions and other files no longer overwrite it. The sector
+stays in the buffer after fsync() and is not read again by the next fwrite().
+The buffer is released when the file is opened again. Only one file object
+should be opened for a file while writing to it.
+
+        fp			Pointer to the file object structure
+        buf			Buffer of 513 bytes (SD_BUFFER_SIZE + 1 for the null
+added by fread()) or 0 to use the main buffer again. Unsaved data is not
+written when the buffer is changed.
+_______________________________________________________________________________________________*/
+FAT_FRESULT FAT_fsetBuffer(FAT_FILE *fp, uint8_t *buf);
+#endif
+#if FAT_READ_AHEAD == 1
+/*______________________________________________________________________________________________
+        Attach a read-ahead window to an opened file for sequential fread()
+calls. The window is a ring of sectors. When the sector of a call is not in
+it, fread() reads the sector and the following ones of the cluster into all
+slots but one with one read stream. Each call returns the sector of one slot
+and starts reading the sector after the window into a free slot with
+disk->read_async(), so the card transfers it while the caller processes the
+returned one. The next call waits for the end of that transfer and checks it,
+unless the window is full. The window reaches up to the end of the next
+cluster. Starting the read of the first sector of a cluster also finds the
+cluster, so crossing into it doesn't read the FAT. ra_hits and ra_misses of
+the file count the calls served from the window and the calls that filled it.
+        While a sector is being read ahead the SD card keeps the SPI bus. Other
+functions of the library and the SD driver wait for the transfer first. End it
+with FAT_fsetReadAhead(fp, 0, 0) before using other devices on the bus.
+        fseek(), fwrite(), ftruncate() and freadInto() empty the window. The
+window is released when the file is opened again. Only one file object should
+be opened for a file while reading it this way.
+
+        fp			Pointer to the file object structure
+        buf			Buffer of sectors * 513 bytes (SD_BUFFER_SIZE + 1 for the
+null added after each sector) or 0 to read one sector per call again
+        sectors		Number of sectors the window holds, at least 2
+_______________________________________________________________________________________________*/
+FAT_FRESULT FAT_fsetReadAhead(FAT_FILE *fp, uint8_t *buf, uint8_t sectors);
+#endif
 /*______________________________________________________________________________________________
         Return the file pointer
 _______________________________________________________________________________________________*/
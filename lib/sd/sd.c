@@ -3,8 +3,12 @@
 #include <avrlibdefs.h>
 #include <debug_minimal.h>
 #include <global.h>
+#include <avr/pgmspace.h>
 #include <spi.h>
 #include <util/delay.h>
+#ifdef SD_TIMER_TICKS
+#include <timer.h>
+#endif
 
 /*************************************************************
         MACRO FUNCTIONS Defines
@@ -86,26 +90,109 @@
 #define CMD58_ARG 0x00000000
 #define CMD58_CRC 0x00
 
+// CMD59 - CRC_ON_OFF
+// Turns on the CRC check of commands and data blocks
+#define CMD59        59
+#define CMD59_ARG_ON 0x00000001
+#define CMD59_CRC    0x00
+
+// CMD9 - SEND_CSD (Card Specific Data)
+// The 16 byte register is sent like a data block
+#define CMD9     9
+#define CMD9_CRC 0x00
+
+// CMD10 - SEND_CID (Card Identification)
+#define CMD10     10
+#define CMD10_CRC 0x00
+
+// ACMD13 - SD_STATUS - R2 response
+// The 64 byte SD Status is sent like a data block
+#define ACMD13         13
+#define ACMD13_CRC     0x00
+#define SD_STATUS_SIZE 64
+
 // CMD17 - READ_SINGLE_BLOCK
-// For a 16MHz oscillator and SPI clock set to divide by 2.
-// Thus, to get the number of bytes we need to send over SPI to reach 100ms, we
-// do (0.1s * 16000000 MHz) / (2 * 8 bytes) = 100000
-#define CMD17                17
-#define CMD17_CRC            0x00
-#define SD_MAX_READ_ATTEMPTS (0.1 * F_CPU) / (SPI0_CLK_DIV * 8)
+#define CMD17     17
+#define CMD17_CRC 0x00
 
 // CMD24 - WRITE_BLOCK
-// For a 16MHz oscillator and SPI clock set to divide by 2.
-// Thus, to get the number of bytes we need to send over SPI to reach 250ms, we
-// do (0.25s * 16000000 MHz) / (2 * 8 bytes) = 250000
-#define CMD24                 24
-#define CMD24_CRC             0x00
-#define SD_MAX_WRITE_ATTEMPTS (0.25 * F_CPU) / (SPI0_CLK_DIV * 8)
-
-// Card Type
-#define SD_V1_SDSC      1
-#define SD_V2_SDSC      2
-#define SD_V2_SDHC_SDXC 3
+#define CMD24     24
+#define CMD24_CRC 0x00
+
+// CMD12 - STOP_TRANSMISSION
+// Ends a multiple block read. The card sends a stuff byte before R1b.
+#define CMD12     12
+#define CMD12_ARG 0x00000000
+#define CMD12_CRC 0x00
+
+// CMD18 - READ_MULTIPLE_BLOCK
+// Data blocks are sent continuously until CMD12 is received
+#define CMD18     18
+#define CMD18_CRC 0x00
+
+// CMD25 - WRITE_MULTIPLE_BLOCK
+// Data blocks are received continuously until the Stop Tran token is sent
+#define CMD25     25
+#define CMD25_CRC 0x00
+
+// ACMD23 - SET_WR_BLK_ERASE_COUNT
+// Number of blocks to pre-erase before a multiple block write. This is only a
+// hint for the card to speed up the write and is limited to 23 bits.
+#define ACMD23     23
+#define ACMD23_CRC 0x00
+#define ACMD23_MAX 0x007FFFFF
+
+// Data Tokens
+#define SD_TOKEN_START_BLOCK       0xFE // CMD17, CMD18 and CMD24
+#define SD_TOKEN_START_BLOCK_MULTI 0xFC // CMD25
+#define SD_TOKEN_STOP_TRAN         0xFD // ends CMD25
+
+// Data Response (lower 5 bits)
+#define SD_DATA_ACCEPTED  0x05
+#define SD_DATA_CRC_ERROR 0x0B
+
+#ifndef SD_CRC_RETRIES
+#define SD_CRC_RETRIES 3
+#endif
+
+#ifdef SD_CRC
+#define SD_CRC_RETRY(error, attempts) sd_crc_retry(error, &attempts)
+#else
+#define SD_CRC_RETRY(error, attempts) ((void)(attempts), 0)
+#endif
+
+// Timeouts in ms
+#define SD_INIT_TIMEOUT  1000 // initialization with ACMD41
+#define SD_READ_TIMEOUT  100  // start token of a read
+#define SD_WRITE_TIMEOUT 250  // data response and programming of a write
+
+#ifdef SD_TIMER_TICKS
+#ifndef TIMER_TICK_N
+#error "SD_TIMER_TICKS needs the tick timer, define TIMER_TICK_N in timer_conf.h"
+#endif
+// Ticks of the tick timer, plus one since the first tick can come right after
+// the start
+#define SD_TIMEOUT(ms)                                                         \
+    ((uint16_t)(((ms) * (F_CPU / 1000UL) + TIMER_TICK_CLK_DIV - 1) /           \
+                TIMER_TICK_CLK_DIV) +                                          \
+     1)
+#else
+// Number of bytes polled. For a 16MHz oscillator and SPI clock set to divide
+// by 2 a byte takes 1us, so 1000 bytes are polled per ms.
+#define SD_TIMEOUT(ms) ((ms) * (F_CPU / 1000UL) / (SPI0_CLK_DIV * 8))
+#endif
+
+// Multiple block transfer state
+#define SD_STREAM_NONE        0
+#define SD_STREAM_READ        1
+#define SD_STREAM_WRITE       2
+#define SD_STREAM_ASYNC_READ  3 // single block moved by the SPI interrupt
+#define SD_STREAM_ASYNC_WRITE 4
+#define SD_STREAM_BUSY        5 // a written block is programmed, card released
+
+#if defined(SPI_ASYNC) && SPI_ASYNC_QUEUE_SIZE < 3
+#error "SPI_ASYNC_QUEUE_SIZE must be at least 3 for the SD card"
+#endif
 
 /*************************************************************
         Private Prototypes
@@ -153,6 +240,116 @@ static void sd_read_response3_7(uint8_t *res);
 _______________________________________________________________________________________________*/
 static void sd_command(uint8_t cmd, uint32_t arg, uint8_t crc);
 
+/*______________________________________________________________________________________________
+        Wait while the card holds the MISO line low after a write (timeout =
+250ms)
+
+        return		0 when the card is ready or 1 on timeout
+_______________________________________________________________________________________________*/
+static uint8_t sd_wait_ready(void);
+
+/*______________________________________________________________________________________________
+        Wait for a token from the card other than 0xFF
+
+        timeout		SD_TIMEOUT() of the time to wait
+
+        return		the token or 0xFF on timeout
+_______________________________________________________________________________________________*/
+static uint8_t sd_wait_token(uint32_t timeout);
+
+/*______________________________________________________________________________________________
+        Wait for the data response of a written block. The card is busy
+programming the block after an accepted response, see sd_wait_ready().
+
+        return		0 if the data was accepted or the data response if it was
+rejected (SD_DATA_CRC_ERROR)
+_______________________________________________________________________________________________*/
+static uint8_t sd_read_data_response(void);
+
+/*______________________________________________________________________________________________
+        Start a timeout of the tick timer when SD_TIMER_TICKS is defined or
+else of a number of polled bytes. sd_timeout_expired() is called once per
+polled byte.
+
+        timeout		SD_TIMEOUT() of the time to wait
+_______________________________________________________________________________________________*/
+static void sd_timeout_start(uint32_t timeout);
+static bool sd_timeout_expired(void);
+
+/*______________________________________________________________________________________________
+        Read the len bytes of a data block and its CRC
+
+        return		1 if CRCs are checked and the CRC doesn't match
+_______________________________________________________________________________________________*/
+static uint8_t sd_receive_data(uint8_t *buf, uint16_t len);
+
+/*______________________________________________________________________________________________
+        Send the 512 bytes of a data block and its CRC, or a dummy CRC if
+CRCs are off. A block of zeros is sent if buf is 0.
+_______________________________________________________________________________________________*/
+static void sd_transmit_data(const uint8_t *buf);
+
+/*______________________________________________________________________________________________
+        Read a register that is sent like a data block (CSD, CID or SD
+Status). ACMD13 must be preceded by CMD55.
+
+        return		0 on success, the R1 response, 1 on a token timeout or
+SD_CRC_ERROR
+_______________________________________________________________________________________________*/
+static uint8_t sd_read_register(uint8_t cmd, uint8_t *buf, uint8_t len);
+
+/*______________________________________________________________________________________________
+        Calculate the capacity in blocks and the maximum clock in Hz from the
+CSD register
+_______________________________________________________________________________________________*/
+static uint32_t sd_csd_capacity(const uint8_t *csd);
+static uint32_t sd_csd_clock(const uint8_t *csd);
+
+/*______________________________________________________________________________________________
+        Select the fastest SPI clock that doesn't exceed max_clock
+_______________________________________________________________________________________________*/
+static void sd_set_clock(uint32_t max_clock);
+
+#ifdef SD_CRC
+/*______________________________________________________________________________________________
+        Count a transfer that had a CRC error
+
+        return		1 if the transfer should be repeated, 0 if there was no
+error or the retries are used up
+_______________________________________________________________________________________________*/
+static uint8_t sd_crc_retry(uint8_t crc_error, uint8_t *attempts);
+
+/*______________________________________________________________________________________________
+        Calculate the CRC7 of a command, placed in the upper 7 bits
+_______________________________________________________________________________________________*/
+static uint8_t sd_crc7(const uint8_t *buf, uint8_t len);
+
+#ifdef SPI_ASYNC
+/*______________________________________________________________________________________________
+        Calculate the CRC-16/XMODEM (polynomial 0x1021, initial value 0) of
+a block transferred in the background
+_______________________________________________________________________________________________*/
+static uint16_t sd_crc16(const uint8_t *buf, uint16_t len);
+#endif
+
+/*______________________________________________________________________________________________
+        Same as SPI_transmitBlock() and SPI_receiveBlock() but the CRC16 of
+the bytes is calculated while they are shifted. A table lookup per byte
+mostly fits in the wait for SPIF at fosc/2.
+
+        return		CRC16 of the bytes
+_______________________________________________________________________________________________*/
+static uint16_t sd_transmit_block_crc16(const uint8_t *buf, uint16_t len);
+static uint16_t sd_receive_block_crc16(uint8_t *buf, uint16_t len);
+#endif
+
+#ifdef SPI_ASYNC
+/*______________________________________________________________________________________________
+        Called by the SPI interrupt when the data of a block was transferred
+_______________________________________________________________________________________________*/
+static void sd_async_done(SPI_Transfer *transfer);
+#endif
+
 // static void SPI_Init(void);
 // void SPI_Send(uint8_t *buf, uint16_t length);
 // static void SPI_SendByte(uint8_t byte);
@@ -164,11 +361,85 @@ static void sd_command(uint8_t cmd, uint32_t arg, uint8_t crc);
 **************************************************************/
 uint8_t SD_Buffer[SD_BUFFER_SIZE + 1]; // reserve 1 byte for the null
 uint8_t SD_ResponseToken;
+#ifdef SD_CRC
+uint16_t SD_CrcRetries;
+uint16_t SD_CrcFailures;
+#endif
 // Sectors below this value will not be written by the write functions.
 // Protected sectors could include Boot Sectors, FATs, Root Directory.
 // uint16_t SD_MaxProtectedSector;
 
 static uint8_t SD_CardType;
+static uint32_t SD_Capacity;    // number of blocks or 0 if unknown
+static uint8_t SD_StreamState;  // multiple block transfer in progress
+static uint32_t SD_StreamAddr;  // block address of the next block in a stream
+
+#ifdef SD_TIMER_TICKS
+static uint16_t SD_TimeoutStart;
+static uint16_t SD_TimeoutTicks;
+#else
+static uint32_t SD_TimeoutPolls;
+#endif
+
+// Allocation unit sizes in MB of the AU_SIZE codes 0x0A to 0x0F
+static const uint8_t SD_AuSizeMB[6] PROGMEM = {8, 12, 16, 24, 32, 64};
+
+// TRAN_SPEED time values multiplied by 10
+static const uint8_t SD_TranSpeedValue[16] PROGMEM = {
+    0, 10, 12, 13, 15, 20, 25, 30, 35, 40, 45, 50, 55, 60, 70, 80};
+
+#ifdef SD_CRC
+// CRC-16/XMODEM (polynomial 0x1021, initial value 0) of each byte value
+static const uint16_t SD_Crc16Table[256] PROGMEM = {
+    0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+    0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF,
+    0x1231, 0x0210, 0x3273, 0x2252, 0x52B5, 0x4294, 0x72F7, 0x62D6,
+    0x9339, 0x8318, 0xB37B, 0xA35A, 0xD3BD, 0xC39C, 0xF3FF, 0xE3DE,
+    0x2462, 0x3443, 0x0420, 0x1401, 0x64E6, 0x74C7, 0x44A4, 0x5485,
+    0xA56A, 0xB54B, 0x8528, 0x9509, 0xE5EE, 0xF5CF, 0xC5AC, 0xD58D,
+    0x3653, 0x2672, 0x1611, 0x0630, 0x76D7, 0x66F6, 0x5695, 0x46B4,
+    0xB75B, 0xA77A, 0x9719, 0x8738, 0xF7DF, 0xE7FE, 0xD79D, 0xC7BC,
+    0x48C4, 0x58E5, 0x6886, 0x78A7, 0x0840, 0x1861, 0x2802, 0x3823,
+    0xC9CC, 0xD9ED, 0xE98E, 0xF9AF, 0x8948, 0x9969, 0xA90A, 0xB92B,
+    0x5AF5, 0x4AD4, 0x7AB7, 0x6A96, 0x1A71, 0x0A50, 0x3A33, 0x2A12,
+    0xDBFD, 0xCBDC, 0xFBBF, 0xEB9E, 0x9B79, 0x8B58, 0xBB3B, 0xAB1A,
+    0x6CA6, 0x7C87, 0x4CE4, 0x5CC5, 0x2C22, 0x3C03, 0x0C60, 0x1C41,
+    0xEDAE, 0xFD8F, 0xCDEC, 0xDDCD, 0xAD2A, 0xBD0B, 0x8D68, 0x9D49,
+    0x7E97, 0x6EB6, 0x5ED5, 0x4EF4, 0x3E13, 0x2E32, 0x1E51, 0x0E70,
+    0xFF9F, 0xEFBE, 0xDFDD, 0xCFFC, 0xBF1B, 0xAF3A, 0x9F59, 0x8F78,
+    0x9188, 0x81A9, 0xB1CA, 0xA1EB, 0xD10C, 0xC12D, 0xF14E, 0xE16F,
+    0x1080, 0x00A1, 0x30C2, 0x20E3, 0x5004, 0x4025, 0x7046, 0x6067,
+    0x83B9, 0x9398, 0xA3FB, 0xB3DA, 0xC33D, 0xD31C, 0xE37F, 0xF35E,
+    0x02B1, 0x1290, 0x22F3, 0x32D2, 0x4235, 0x5214, 0x6277, 0x7256,
+    0xB5EA, 0xA5CB, 0x95A8, 0x8589, 0xF56E, 0xE54F, 0xD52C, 0xC50D,
+    0x34E2, 0x24C3, 0x14A0, 0x0481, 0x7466, 0x6447, 0x5424, 0x4405,
+    0xA7DB, 0xB7FA, 0x8799, 0x97B8, 0xE75F, 0xF77E, 0xC71D, 0xD73C,
+    0x26D3, 0x36F2, 0x0691, 0x16B0, 0x6657, 0x7676, 0x4615, 0x5634,
+    0xD94C, 0xC96D, 0xF90E, 0xE92F, 0x99C8, 0x89E9, 0xB98A, 0xA9AB,
+    0x5844, 0x4865, 0x7806, 0x6827, 0x18C0, 0x08E1, 0x3882, 0x28A3,
+    0xCB7D, 0xDB5C, 0xEB3F, 0xFB1E, 0x8BF9, 0x9BD8, 0xABBB, 0xBB9A,
+    0x4A75, 0x5A54, 0x6A37, 0x7A16, 0x0AF1, 0x1AD0, 0x2AB3, 0x3A92,
+    0xFD2E, 0xED0F, 0xDD6C, 0xCD4D, 0xBDAA, 0xAD8B, 0x9DE8, 0x8DC9,
+    0x7C26, 0x6C07, 0x5C64, 0x4C45, 0x3CA2, 0x2C83, 0x1CE0, 0x0CC1,
+    0xEF1F, 0xFF3E, 0xCF5D, 0xDF7C, 0xAF9B, 0xBFBA, 0x8FD9, 0x9FF8,
+    0x6E17, 0x7E36, 0x4E55, 0x5E74, 0x2E93, 0x3EB2, 0x0ED1, 0x1EF0,
+};
+
+#define SD_CRC16_UPDATE(crc, byte)                                            \
+    ((crc) << 8 ^                                                              \
+     pgm_read_word(&SD_Crc16Table[(uint8_t)((crc) >> 8 ^ (byte))]))
+#endif
+
+#ifdef SPI_ASYNC
+static SPI_Transfer SD_AsyncTransfer[3]; // start token, data and CRC
+static void (*SD_AsyncCallback)(void);
+static const uint8_t SD_StartToken = SD_TOKEN_START_BLOCK;
+#ifdef SD_CRC
+static uint8_t SD_AsyncCrc[2];
+static uint32_t SD_AsyncAddr; // block address to transfer again after an error
+static uint8_t *SD_AsyncBuf;
+#endif
+#endif
 
 /*************************************************************
         FUNCTIONS
@@ -176,13 +447,19 @@ static uint8_t SD_CardType;
 SD_RETURN_CODES sd_init(void)
 {
     uint8_t SD_Response[5]; // array to hold response
+    uint8_t csd[16];
     uint8_t cmdAttempts = 0;
+#ifdef SD_CRC
+    uint8_t res1;
+#endif
 
     // SPI Setup
     // SPI_Init();
 
     SD_DEBUG_println("Init started");
 
+    SD_StreamState = SD_STREAM_NONE;
+
     GPIO_setOutput(&(GPIO_TypeDef)SD_CS_PIN);
 
     SPI_init(&(SPI_Init_Typedef){.interuptEn       = false,
@@ -258,9 +535,19 @@ SD_RETURN_CODES sd_init(void)
     sd_read_response3_7(SD_Response);
     sd_deassert_cs();
 
-    // Enable maximum SPI speed
-    SPCR &= ~((1 << SPR1) | (1 << SPR0)); // set clock rate fosc/2
-    SPSR |= (1 << SPI2X);
+#ifdef SD_CRC
+    // CMD59 - CRC_ON_OFF - R1 response
+    // From now on the card checks the CRC of commands and written blocks
+    sd_assert_cs();
+    sd_command(CMD59, CMD59_ARG_ON, CMD59_CRC);
+    res1 = sd_read_response1();
+    sd_deassert_cs();
+
+    // Only the idle state bit may be set
+    if (res1 > 0x01)
+        return SD_CRC_ON_FAILED;
+#endif
+
     // Select initialization sequence path
     if (SD_Response[0] == 0x01)
     {
@@ -338,11 +625,80 @@ SD_RETURN_CODES sd_init(void)
     // CMD16 (SET_BLOCKLEN). For SDHC and SDXC cards the block length is always
     // set to 512 bytes.
 
+    // Read the capacity and the maximum transfer rate from the CSD and switch
+    // to the fastest SPI clock allowed. If the CSD can't be read the card is
+    // assumed to support the default 25MHz.
+    if (sd_read_register(CMD9, csd, sizeof(csd)) == 0)
+    {
+        SD_Capacity = sd_csd_capacity(csd);
+        sd_set_clock(sd_csd_clock(csd));
+    }
+    else
+    {
+        SD_Capacity = 0;
+        sd_set_clock(25000000);
+    }
+
     SD_DEBUG_println("Init completed");
 
     return SD_OK;
 }
 
+uint8_t sd_get_info(SD_INFO *info)
+{
+    uint8_t status[SD_STATUS_SIZE];
+    uint8_t res, au;
+
+    if (sd_stream_end())
+        return 1;
+
+    res = sd_read_register(CMD9, info->csd, sizeof(info->csd));
+    if (res == 0)
+        res = sd_read_register(CMD10, info->cid, sizeof(info->cid));
+    if (res)
+        return res;
+
+    info->card_type = SD_CardType;
+    info->capacity  = sd_csd_capacity(info->csd);
+    info->max_clock = sd_csd_clock(info->csd);
+
+    // SECTOR_SIZE - the smallest erasable unit in write blocks
+    info->erase_sector =
+        ((info->csd[10] & 0x3F) << 1 | info->csd[11] >> 7) + 1;
+
+    // ACMD13 - SD_STATUS - R2 response
+    sd_assert_cs();
+    sd_command(CMD55, CMD55_ARG, CMD55_CRC);
+    sd_read_response1();
+    sd_deassert_cs();
+
+    res = sd_read_register(ACMD13, status, SD_STATUS_SIZE);
+    if (res)
+        return res;
+
+    // The fields are numbered from bit 511 of the status down to bit 0
+    // SPEED_CLASS [447:440] - 0, 1, 2, 3 and 4 stand for class 0, 2, 4, 6, 10
+    info->speed_class = (status[8] == 4) ? 10 : status[8] * 2;
+
+    // AU_SIZE [431:428] - 16KB doubled up to 4MB, then 8, 12, 16, 24, 32, 64MB
+    au = status[10] >> 4;
+    if (au == 0)
+        info->au_size = 0;
+    else if (au < 0x0A)
+        info->au_size = 32UL << (au - 1);
+    else
+        info->au_size = (uint32_t)pgm_read_byte(&SD_AuSizeMB[au - 0x0A]) << 11;
+
+    // ERASE_SIZE [423:408], ERASE_TIMEOUT [407:402], ERASE_OFFSET [401:400]
+    info->erase_size    = (uint16_t)status[11] << 8 | status[12];
+    info->erase_timeout = status[13] >> 2;
+    info->erase_offset  = status[13] & 0x03;
+
+    return 0;
+}
+
+uint32_t sd_capacity(void) { return SD_Capacity; }
+
 /*______________________________________________________________________________________________
         Write a single block of data
 
@@ -360,67 +716,497 @@ ________________________________________________________________________________
 uint8_t sd_write_single_block(uint32_t addr, uint8_t *buf)
 {
     uint8_t res1;
-    uint32_t readAttempts;
+    uint8_t attempts = 0;
+
+    if (sd_stream_end())
+        return 1;
 
     if (SD_CardType == SD_V1_SDSC)
         addr *= 512;
 
+    do
+    {
+        // set token to none
+        SD_ResponseToken = 0xFF;
+
+        sd_assert_cs();
+        sd_command(CMD24, addr, CMD24_CRC);
+
+        // read response
+        res1 = sd_read_response1();
+
+        // if no error
+        if (res1 == 0)
+        {
+            // send start token
+            SPI_transferByte(0xFE);
+
+            // write buffer and CRC to card
+            sd_transmit_data(buf);
+
+            // wait for a response (timeout = 250ms)
+            // maximum timeout is defined as 250 ms for all write operations
+            res1 = sd_wait_token(SD_TIMEOUT(SD_WRITE_TIMEOUT));
+
+            // if data accepted
+            if ((res1 & 0x1F) == SD_DATA_ACCEPTED)
+            {
+                // set token to data accepted
+                SD_ResponseToken = 0x05;
+
+                // The card programs the block after it is released. The busy
+                // signal is polled by the next command or sd_write_busy().
+                SD_StreamState = SD_STREAM_BUSY;
+            }
+        }
+
+        sd_deassert_cs();
+    } while (SD_CRC_RETRY((res1 & 0x1F) == SD_DATA_CRC_ERROR, attempts));
+
+    // The retries were used up
+    if ((res1 & 0x1F) == SD_DATA_CRC_ERROR)
+        return SD_CRC_ERROR;
+    return res1;
+}
+
+uint8_t sd_read_single_block(uint32_t addr, uint8_t *buf)
+{
+    uint8_t res1, read, crc_error;
+    uint8_t attempts = 0;
+
+    if (sd_stream_end())
+        return 1;
+
+    if (SD_CardType == SD_V1_SDSC)
+        addr *= 512;
+
+    do
+    {
+        crc_error = 0;
+
+        // set token to none
+        SD_ResponseToken = 0xFF;
+
+        sd_assert_cs();
+        sd_command(CMD17, addr, CMD17_CRC);
+
+        // read R1
+        res1 = sd_read_response1();
+
+        // if response received from card
+        if (res1 != 0xFF)
+        {
+            // wait for a response token (timeout = 100ms)
+            // The host should use 100ms timeout (minimum) for single and
+            // multiple read operations
+            read = sd_wait_token(SD_TIMEOUT(SD_READ_TIMEOUT));
+
+            // if response token is 0xFE
+            if (read == 0xFE)
+            {
+                // read 512 byte block and 16-bit CRC
+                crc_error = sd_receive_data(buf, SD_BUFFER_SIZE);
+
+                // add null to the end
+                buf[SD_BUFFER_SIZE] = 0;
+            }
+
+            // set token to card response
+            SD_ResponseToken = read;
+        }
+
+        sd_deassert_cs();
+    } while (SD_CRC_RETRY(crc_error, attempts));
+
+    if (crc_error)
+        return SD_CRC_ERROR;
+    return res1;
+}
+
+uint8_t sd_read_multiple_blocks(uint32_t addr, uint8_t *buf, uint16_t count)
+{
+    uint8_t res = sd_read_stream_begin(addr);
+
+    while ((res == 0) && count--)
+    {
+        res = sd_read_stream_next(buf);
+        buf += SD_BUFFER_SIZE;
+    }
+
+    if (sd_stream_end())
+        res = 1;
+
+    return res;
+}
+
+uint8_t sd_write_multiple_blocks(uint32_t addr, const uint8_t *buf,
+                                 uint16_t count)
+{
+    uint8_t res = sd_write_stream_begin(addr, count);
+
+    while ((res == 0) && count--)
+    {
+        res = sd_write_stream_next(buf);
+        buf += SD_BUFFER_SIZE;
+    }
+
+    if (sd_stream_end())
+        res = 1;
+
+    return res;
+}
+
+uint8_t sd_write_zero_blocks(uint32_t addr, uint16_t count)
+{
+    // The pre-erase hint costs two commands, not worth it for one block
+    uint8_t res = sd_write_stream_begin(addr, (count > 1) ? count : 0);
+
+    while ((res == 0) && count--)
+        res = sd_write_stream_next(0);
+
+    if (sd_stream_end())
+        res = 1;
+
+    return res;
+}
+
+uint8_t sd_read_stream_begin(uint32_t addr)
+{
+    uint8_t res1;
+
+    if (sd_stream_end())
+        return 1;
+
+    SD_StreamAddr = addr;
+    if (SD_CardType == SD_V1_SDSC)
+        addr *= 512;
+
     // set token to none
     SD_ResponseToken = 0xFF;
 
     sd_assert_cs();
-    sd_command(CMD24, addr, CMD24_CRC);
+    sd_command(CMD18, addr, CMD18_CRC);
 
-    // read response
+    // read R1. The card stays selected until the stream is ended.
     res1 = sd_read_response1();
+    if (res1 == 0)
+        SD_StreamState = SD_STREAM_READ;
+    else
+        sd_deassert_cs();
+
+    return res1;
+}
+
+uint8_t sd_read_stream_next(uint8_t *buf)
+{
+    uint8_t read, crc_error;
+    uint8_t attempts = 0;
+
+    do
+    {
+        // set token to none
+        SD_ResponseToken = 0xFF;
+
+        if (SD_StreamState != SD_STREAM_READ)
+            return 1;
+
+        // wait for a response token (timeout = 100ms)
+        read = sd_wait_token(SD_TIMEOUT(SD_READ_TIMEOUT));
+
+        // set token to card response
+        SD_ResponseToken = read;
+
+        if (read != SD_TOKEN_START_BLOCK)
+            return 1;
+
+        // read 512 byte block and 16-bit CRC
+        crc_error = sd_receive_data(buf, SD_BUFFER_SIZE);
+
+        // A block with a CRC error is read again by a new stream
+    } while (SD_CRC_RETRY(crc_error, attempts) &&
+             (sd_read_stream_begin(SD_StreamAddr) == 0));
+
+    if (crc_error)
+        return SD_CRC_ERROR;
+
+    SD_StreamAddr++;
+    return 0;
+}
+
+uint32_t sd_read_stream_position(void)
+{
+    if (SD_StreamState != SD_STREAM_READ)
+        return SD_STREAM_CLOSED;
+
+    return SD_StreamAddr;
+}
+
+uint8_t sd_write_stream_begin(uint32_t addr, uint32_t pre_erase)
+{
+    uint8_t res1;
+
+    if (sd_stream_end())
+        return 1;
+
+    // ACMD23 - tell the card how many blocks will be written. Cards that
+    // don't support it will simply ignore the hint.
+    if (pre_erase)
+    {
+        if (pre_erase > ACMD23_MAX)
+            pre_erase = ACMD23_MAX;
+
+        sd_assert_cs();
+        sd_command(CMD55, CMD55_ARG, CMD55_CRC);
+        sd_read_response1();
+        sd_deassert_cs();
+
+        sd_assert_cs();
+        sd_command(ACMD23, pre_erase, ACMD23_CRC);
+        sd_read_response1();
+        sd_deassert_cs();
+    }
+
+    SD_StreamAddr = addr;
+    if (SD_CardType == SD_V1_SDSC)
+        addr *= 512;
+
+    // set token to none
+    SD_ResponseToken = 0xFF;
 
-    // if no error
+    sd_assert_cs();
+    sd_command(CMD25, addr, CMD25_CRC);
+
+    // read R1. The card stays selected until the stream is ended.
+    res1 = sd_read_response1();
     if (res1 == 0)
+        SD_StreamState = SD_STREAM_WRITE;
+    else
+        sd_deassert_cs();
+
+    return res1;
+}
+
+uint8_t sd_write_stream_next(const uint8_t *buf)
+{
+    uint8_t res;
+    uint8_t attempts = 0;
+
+    do
     {
+        // set token to none
+        SD_ResponseToken = 0xFF;
+
+        if (SD_StreamState != SD_STREAM_WRITE)
+            return 1;
+
+        // The previous block is programmed while the next one is prepared
+        if (sd_wait_ready())
+        {
+            SD_ResponseToken = 0x00;
+            return 1;
+        }
+
         // send start token
-        SPI_transferByte(0xFE);
+        SPI_transferByte(SD_TOKEN_START_BLOCK_MULTI);
+
+        // write buffer and CRC to card
+        sd_transmit_data(buf);
+
+        res = sd_read_data_response();
 
-        // write buffer to card
-        for (uint16_t i = 0; i < SD_BUFFER_SIZE; i++)
-            SPI_transferByte(buf[i]);
+        // The card stops at a block with a CRC error. The stream is ended and
+        // started again from that block.
+    } while (SD_CRC_RETRY(res == SD_DATA_CRC_ERROR, attempts) &&
+             (sd_write_stream_begin(SD_StreamAddr, 0) == 0));
 
-        // wait for a response (timeout = 250ms)
-        // maximum timeout is defined as 250 ms for all write operations
-        readAttempts = 0;
-        while (++readAttempts < SD_MAX_WRITE_ATTEMPTS)
+    if (res == SD_DATA_CRC_ERROR)
+        return SD_CRC_ERROR;
+    if (res)
+        return 1;
+
+    SD_StreamAddr++;
+    return 0;
+}
+
+uint8_t sd_stream_end(void)
+{
+    uint8_t res = 0;
+#if defined(SPI_ASYNC) && defined(SD_CRC)
+    uint8_t crc_error = 0;
+#endif
+
+    if (SD_StreamState == SD_STREAM_READ)
+    {
+        // CMD12 - STOP_TRANSMISSION - R1b response
+        sd_command(CMD12, CMD12_ARG, CMD12_CRC);
+        SPI_transferByte(0xff); // discard the stuff byte
+        res = sd_read_response1();
+        if (sd_wait_ready())
+            res = 1;
+    }
+    else if (SD_StreamState == SD_STREAM_WRITE)
+    {
+        // the stop token is sent after the last block is programmed
+        res = sd_wait_ready();
+        SPI_transferByte(SD_TOKEN_STOP_TRAN);
+        SPI_transferByte(0xff); // the busy signal starts after one byte
+        if (sd_wait_ready() || res)
+        {
+            SD_ResponseToken = 0x00;
+            res              = 1;
+        }
+    }
+    else if (SD_StreamState == SD_STREAM_BUSY)
+    {
+        // select the card again to see the busy signal
+        sd_assert_cs();
+        if (sd_wait_ready())
         {
-            if ((res1 = SPI_transferByte(0xff)) != 0xFF)
-                break;
+            SD_ResponseToken = 0x00;
+            res              = 1;
         }
+    }
+#ifdef SPI_ASYNC
+    else if (SD_StreamState == SD_STREAM_ASYNC_READ)
+    {
+        SPI_waitIdle();
+#ifdef SD_CRC
+        crc_error = sd_crc16(SD_AsyncBuf, SD_BUFFER_SIZE) !=
+                    ((uint16_t)SD_AsyncCrc[0] << 8 | SD_AsyncCrc[1]);
+#endif
+    }
+    else if (SD_StreamState == SD_STREAM_ASYNC_WRITE)
+    {
+        SPI_waitIdle();
+        res = sd_read_data_response();
+#ifdef SD_CRC
+        crc_error = (res == SD_DATA_CRC_ERROR);
+#endif
+        if ((res == 0) && sd_wait_ready())
+        {
+            SD_ResponseToken = 0x00;
+            res              = 1;
+        }
+    }
+#endif
+    else
+    {
+        return 0;
+    }
+
+#if defined(SPI_ASYNC) && defined(SD_CRC)
+    // A background block with a CRC error is transferred again by the
+    // blocking functions, which retry on their own
+    if (crc_error)
+    {
+        crc_error      = SD_StreamState;
+        SD_StreamState = SD_STREAM_NONE;
+        sd_deassert_cs();
+        SD_CrcRetries++;
+
+        if (crc_error == SD_STREAM_ASYNC_READ)
+            return sd_read_multiple_blocks(SD_AsyncAddr, SD_AsyncBuf, 1);
+        return sd_write_multiple_blocks(SD_AsyncAddr, SD_AsyncBuf, 1);
+    }
+#endif
+
+    SD_StreamState = SD_STREAM_NONE;
+    sd_deassert_cs();
+    return res;
+}
+
+bool sd_write_busy(void)
+{
+    bool busy;
+
+    if (SD_StreamState != SD_STREAM_BUSY)
+        return false;
+
+    sd_assert_cs();
+    busy = (SPI_transferByte(0xff) == 0x00);
+    sd_deassert_cs();
+
+    if (!busy)
+        SD_StreamState = SD_STREAM_NONE;
+
+    return busy;
+}
+
+#ifdef SPI_ASYNC
+uint8_t sd_read_block_async(uint32_t addr, uint8_t *buf,
+                            void (*callback)(void))
+{
+    uint8_t res1, read;
+
+    SPI_waitIdle();
+    if (sd_stream_end())
+        return 1;
+
+#ifdef SD_CRC
+    SD_AsyncAddr = addr;
+    SD_AsyncBuf  = buf;
+#endif
+    if (SD_CardType == SD_V1_SDSC)
+        addr *= 512;
+
+    // set token to none
+    SD_ResponseToken = 0xFF;
+
+    sd_assert_cs();
+    sd_command(CMD17, addr, CMD17_CRC);
+
+    // read R1
+    res1 = sd_read_response1();
+    if (res1 == 0)
+    {
+        // wait for a response token (timeout = 100ms)
+        read = sd_wait_token(SD_TIMEOUT(SD_READ_TIMEOUT));
 
-        // if data accepted
-        if ((res1 & 0x1F) == 0x05)
+        // set token to card response
+        SD_ResponseToken = read;
+
+        if (read == SD_TOKEN_START_BLOCK)
         {
-            // set token to data accepted
-            SD_ResponseToken = 0x05;
+            // The data and the CRC are read by the interrupt
+            SD_AsyncCallback    = callback;
+            SD_AsyncTransfer[0] =
+                (SPI_Transfer){.rx = buf, .len = SD_BUFFER_SIZE};
+            SD_AsyncTransfer[1] =
+                (SPI_Transfer){.len = 2, .callback = sd_async_done};
+#ifdef SD_CRC
+            // The CRC is checked by sd_stream_end()
+            SD_AsyncTransfer[1].rx = SD_AsyncCrc;
+#endif
+            SD_StreamState = SD_STREAM_ASYNC_READ;
 
-            // wait for write to finish (timeout = 250ms)
-            readAttempts = 0;
-            while (SPI_transferByte(0xff) == 0x00)
-            {
-                if (++readAttempts > SD_MAX_WRITE_ATTEMPTS)
-                {
-                    SD_ResponseToken = 0x00;
-                    break;
-                }
-            }
+            SPI_queueTransfer(&SD_AsyncTransfer[0]);
+            SPI_queueTransfer(&SD_AsyncTransfer[1]);
+            return 0;
         }
+
+        res1 = 1;
     }
 
     sd_deassert_cs();
     return res1;
 }
 
-uint8_t sd_read_single_block(uint32_t addr, uint8_t *buf)
+uint8_t sd_write_block_async(uint32_t addr, const uint8_t *buf,
+                             void (*callback)(void))
 {
-    uint8_t res1, read = 0;
-    uint32_t readAttempts;
+    uint8_t res1;
+#ifdef SD_CRC
+    uint16_t crc;
+#endif
+
+    SPI_waitIdle();
+    if (sd_stream_end())
+        return 1;
 
+#ifdef SD_CRC
+    SD_AsyncAddr = addr;
+    SD_AsyncBuf  = (uint8_t *)buf;
+#endif
     if (SD_CardType == SD_V1_SDSC)
         addr *= 512;
 
@@ -428,47 +1214,326 @@ uint8_t sd_read_single_block(uint32_t addr, uint8_t *buf)
     SD_ResponseToken = 0xFF;
 
     sd_assert_cs();
-    sd_command(CMD17, addr, CMD17_CRC);
+    sd_command(CMD24, addr, CMD24_CRC);
 
     // read R1
     res1 = sd_read_response1();
+    if (res1 == 0)
+    {
+        // The start token, the data and a dummy CRC are sent by the interrupt
+        SD_AsyncCallback    = callback;
+        SD_AsyncTransfer[0] = (SPI_Transfer){.tx = &SD_StartToken, .len = 1};
+        SD_AsyncTransfer[1] = (SPI_Transfer){.tx = buf, .len = SD_BUFFER_SIZE};
+        SD_AsyncTransfer[2] =
+            (SPI_Transfer){.len = 2, .callback = sd_async_done};
+#ifdef SD_CRC
+        crc                    = sd_crc16(buf, SD_BUFFER_SIZE);
+        SD_AsyncCrc[0]         = crc >> 8;
+        SD_AsyncCrc[1]         = crc;
+        SD_AsyncTransfer[2].tx = SD_AsyncCrc;
+#endif
+        SD_StreamState = SD_STREAM_ASYNC_WRITE;
+
+        SPI_queueTransfer(&SD_AsyncTransfer[0]);
+        SPI_queueTransfer(&SD_AsyncTransfer[1]);
+        SPI_queueTransfer(&SD_AsyncTransfer[2]);
+        return 0;
+    }
+
+    sd_deassert_cs();
+    return res1;
+}
+
+bool sd_async_busy(void)
+{
+    return ((SD_StreamState == SD_STREAM_ASYNC_READ) ||
+            (SD_StreamState == SD_STREAM_ASYNC_WRITE)) &&
+           SPI_isBusy();
+}
+
+static void sd_async_done(SPI_Transfer *transfer)
+{
+    if (SD_AsyncCallback)
+        SD_AsyncCallback();
+}
+#endif
+
+static uint8_t sd_read_data_response(void)
+{
+    uint8_t res;
+
+    // wait for the data response
+    res = sd_wait_token(SD_TIMEOUT(SD_WRITE_TIMEOUT)) & 0x1F;
+    if (res != SD_DATA_ACCEPTED)
+        return res;
+
+    // set token to data accepted
+    SD_ResponseToken = 0x05;
+    return 0;
+}
+
+static uint8_t sd_receive_data(uint8_t *buf, uint16_t len)
+{
+#ifdef SD_CRC
+    uint16_t crc = sd_receive_block_crc16(buf, len);
 
-    // if response received from card
-    if (res1 != 0xFF)
+    // compare with the 16-bit CRC sent by the card
+    crc ^= (uint16_t)SPI_transferByte(0xff) << 8;
+    crc ^= SPI_transferByte(0xff);
+    return crc != 0;
+#else
+    SPI_receiveBlock(buf, len);
+
+    // read and discard 16-bit CRC
+    SPI_transferByte(0xff);
+    SPI_transferByte(0xff);
+    return 0;
+#endif
+}
+
+static void sd_transmit_data(const uint8_t *buf)
+{
+    uint16_t crc = 0xFFFF; // dummy CRC
+
+    if (buf)
     {
-        // wait for a response token (timeout = 100ms)
-        // The host should use 100ms timeout (minimum) for single and multiple
-        // read operations
-        readAttempts = 0;
-        while (++readAttempts != SD_MAX_READ_ATTEMPTS)
+#ifdef SD_CRC
+        crc = sd_transmit_block_crc16(buf, SD_BUFFER_SIZE);
+#else
+        SPI_transmitBlock(buf, SD_BUFFER_SIZE);
+#endif
+    }
+    else
+    {
+        SPI_transmitFill(0, SD_BUFFER_SIZE);
+#ifdef SD_CRC
+        crc = 0; // the CRC of a block of zeros
+#endif
+    }
+
+    SPI_transferByte(crc >> 8);
+    SPI_transferByte(crc);
+}
+
+#ifdef SD_CRC
+static uint8_t sd_crc_retry(uint8_t crc_error, uint8_t *attempts)
+{
+    if (!crc_error)
+        return 0;
+
+    if (*attempts == SD_CRC_RETRIES)
+    {
+        SD_CrcFailures++;
+        return 0;
+    }
+
+    (*attempts)++;
+    SD_CrcRetries++;
+    return 1;
+}
+
+static uint8_t sd_crc7(const uint8_t *buf, uint8_t len)
+{
+    uint8_t crc = 0, byte;
+
+    while (len--)
+    {
+        byte = *buf++;
+        for (uint8_t i = 0; i < 8; i++)
         {
-            if ((read = SPI_transferByte(0xff)) != 0xFF)
-                break;
+            crc <<= 1;
+            if ((byte ^ crc) & 0x80)
+                crc ^= 0x09;
+            byte <<= 1;
         }
+    }
 
-        // if response token is 0xFE
-        if (read == 0xFE)
-        {
-            // read 512 byte block
-            for (uint16_t i = 0; i < SD_BUFFER_SIZE; i++)
-                *buf++ = SPI_transferByte(0xff);
+    return crc << 1;
+}
 
-            // add null to the end
-            *buf = 0;
+#ifdef SPI_ASYNC
+static uint16_t sd_crc16(const uint8_t *buf, uint16_t len)
+{
+    uint16_t crc = 0;
 
-            // read and discard 16-bit CRC
-            SPI_transferByte(0xff);
+    while (len--)
+        crc = SD_CRC16_UPDATE(crc, *buf++);
+    return crc;
+}
+#endif
+
+static uint16_t sd_transmit_block_crc16(const uint8_t *buf, uint16_t len)
+{
+    uint16_t crc = 0;
+    uint8_t byte;
+
+    if (len == 0)
+        return crc;
+
+    byte = *buf++;
+    SPDR = byte;
+    while (--len)
+    {
+        // update the CRC and load the next byte while the current one is
+        // shifted out
+        crc  = SD_CRC16_UPDATE(crc, byte);
+        byte = *buf++;
+        loop_until_bit_is_set(SPSR, SPIF);
+        SPDR = byte;
+    }
+    crc = SD_CRC16_UPDATE(crc, byte);
+    loop_until_bit_is_set(SPSR, SPIF);
+
+    // reading SPDR after SPSR clears SPIF
+    byte = SPDR;
+    return crc;
+}
+
+static uint16_t sd_receive_block_crc16(uint8_t *buf, uint16_t len)
+{
+    uint16_t crc = 0;
+    uint8_t byte;
+
+    if (len == 0)
+        return crc;
+
+    SPDR = 0xff;
+    while (--len)
+    {
+        loop_until_bit_is_set(SPSR, SPIF);
+        byte   = SPDR;
+        // start the next byte before storing this one and updating the CRC
+        SPDR   = 0xff;
+        *buf++ = byte;
+        crc    = SD_CRC16_UPDATE(crc, byte);
+    }
+    loop_until_bit_is_set(SPSR, SPIF);
+    byte = SPDR;
+    *buf = byte;
+    return SD_CRC16_UPDATE(crc, byte);
+}
+
+#endif
+
+static uint8_t sd_read_register(uint8_t cmd, uint8_t *buf, uint8_t len)
+{
+    uint8_t res1;
+
+    sd_assert_cs();
+    sd_command(cmd, 0, 0x00);
+    res1 = sd_read_response1();
+
+    if (res1 == 0)
+    {
+        // second byte of the R2 response of ACMD13
+        if (cmd == ACMD13)
             SPI_transferByte(0xff);
-        }
 
-        // set token to card response
-        SD_ResponseToken = read;
+        if (sd_wait_token(SD_TIMEOUT(SD_READ_TIMEOUT)) != SD_TOKEN_START_BLOCK)
+            res1 = 1;
+        else if (sd_receive_data(buf, len))
+            res1 = SD_CRC_ERROR;
     }
 
     sd_deassert_cs();
     return res1;
 }
 
+static uint32_t sd_csd_capacity(const uint8_t *csd)
+{
+    uint32_t c_size;
+    uint8_t shift;
+
+    if ((csd[0] >> 6) == 1)
+    {
+        // CSD version 2.0: C_SIZE [69:48] in units of 512KB
+        c_size = (uint32_t)(csd[7] & 0x3F) << 16 | (uint16_t)csd[8] << 8 |
+                 csd[9];
+        return (c_size + 1) << 10;
+    }
+
+    // CSD version 1.0: (C_SIZE [73:62] + 1) * 2^(C_SIZE_MULT [49:47] + 2)
+    // blocks of 2^READ_BL_LEN [83:80] bytes
+    c_size = (uint16_t)(csd[6] & 0x03) << 10 | (uint16_t)csd[7] << 2 |
+             csd[8] >> 6;
+    shift  = ((csd[9] & 0x03) << 1 | csd[10] >> 7) + 2 + (csd[5] & 0x0F) - 9;
+    return (c_size + 1) << shift;
+}
+
+static uint32_t sd_csd_clock(const uint8_t *csd)
+{
+    // TRAN_SPEED: time value in bits 6:3 and a unit of 100kbit/s times 10^n
+    // in bits 2:0
+    uint32_t clock = pgm_read_byte(&SD_TranSpeedValue[(csd[3] >> 3) & 0x0F]) *
+                     10000UL;
+
+    for (uint8_t unit = csd[3] & 0x07; (unit > 0) && (unit < 4); unit--)
+        clock *= 10;
+
+    return clock;
+}
+
+static void sd_set_clock(uint32_t max_clock)
+{
+    // fosc/2^shift from fosc/2 down to fosc/64
+    uint8_t shift = 1;
+
+    while ((shift < 6) && ((F_CPU >> shift) > max_clock))
+        shift++;
+
+    // SPR1:0 selects fosc/4, /16 or /64, halved by SPI2X for odd shifts
+    SPCR = (SPCR & ~((1 << SPR1) | (1 << SPR0))) | ((shift - 1) >> 1);
+    if (shift & 1)
+        SPSR |= (1 << SPI2X);
+    else
+        SPSR &= ~(1 << SPI2X);
+}
+
+static uint8_t sd_wait_ready(void)
+{
+    sd_timeout_start(SD_TIMEOUT(SD_WRITE_TIMEOUT));
+
+    while (SPI_transferByte(0xff) == 0x00)
+    {
+        if (sd_timeout_expired())
+            return 1;
+    }
+
+    return 0;
+}
+
+static uint8_t sd_wait_token(uint32_t timeout)
+{
+    uint8_t token;
+
+    sd_timeout_start(timeout);
+
+    while ((token = SPI_transferByte(0xff)) == 0xFF)
+    {
+        if (sd_timeout_expired())
+            break;
+    }
+
+    return token;
+}
+
+#ifdef SD_TIMER_TICKS
+static void sd_timeout_start(uint32_t timeout)
+{
+    SD_TimeoutStart = TIMER_getTicks();
+    SD_TimeoutTicks = timeout;
+}
+
+static bool sd_timeout_expired(void)
+{
+    return (uint16_t)(TIMER_getTicks() - SD_TimeoutStart) > SD_TimeoutTicks;
+}
+#else
+static void sd_timeout_start(uint32_t timeout) { SD_TimeoutPolls = timeout; }
+
+static bool sd_timeout_expired(void) { return SD_TimeoutPolls-- == 0; }
+#endif
+
 static void sd_assert_cs(void)
 {
     SPI_transferByte(0xFF);
@@ -487,10 +1552,16 @@ static void sd_deassert_cs(void)
 static SD_RETURN_CODES sd_command_ACMD41(void)
 {
     uint8_t response;
+#ifdef SD_TIMER_TICKS
+    // Initialization process can take up to 1 second. The card is polled
+    // until it is ready so no time is lost to a fixed delay.
+    sd_timeout_start(SD_TIMEOUT(SD_INIT_TIMEOUT));
+#else
     uint8_t i = 100;
 
     // Initialization process can take up to 1 second so we add a 10ms delay
     // and a maximum of 100 iterations
+#endif
 
     do
     {
@@ -511,14 +1582,18 @@ static SD_RETURN_CODES sd_command_ACMD41(void)
         response = sd_read_response1();
         sd_deassert_cs();
 
-        i--;
-        _delay_ms(10);
-
-    } while ((response != 0) && (i > 0));
+        if (response == 0)
+            break;
 
-    // Timeout
-    if (i == 0)
-        return SD_IDLE_STATE_TIMEOUT;
+#ifdef SD_TIMER_TICKS
+        if (sd_timeout_expired())
+            return SD_IDLE_STATE_TIMEOUT;
+#else
+        if (--i == 0)
+            return SD_IDLE_STATE_TIMEOUT;
+        _delay_ms(10);
+#endif
+    } while (1);
 
     return response;
 }
@@ -555,14 +1630,15 @@ static void sd_read_response3_7(uint8_t *res)
 
 static void sd_command(uint8_t cmd, uint32_t arg, uint8_t crc)
 {
-    // Transmit command
-    SPI_transferByte(cmd | 0x40);
+    uint8_t frame[5] = {cmd | 0x40, arg >> 24, arg >> 16, arg >> 8, arg};
+
+#ifdef SD_CRC
+    // The card checks the CRC of every command
+    crc = sd_crc7(frame, 5);
+#endif
 
-    // Transmit argument
-    SPI_transferByte((uint8_t)(arg >> 24));
-    SPI_transferByte((uint8_t)(arg >> 16));
-    SPI_transferByte((uint8_t)(arg >> 8));
-    SPI_transferByte((uint8_t)(arg));
+    // Transmit command and argument
+    SPI_transmitBlock(frame, 5);
 
     // Transmit CRC
     SPI_transferByte(crc | 0x01);
@@ -86,11 +86,27 @@ https://www.programming-electronics-diy.xyz/2022/07/sd-memory-card-library-for-a
 // bytes.
 #define SD_BUFFER_SIZE 512 // CAUTION: only 512 bytes/block is implemented
 
+// Returned by sd_read_stream_position() when no read stream is open
+#define SD_STREAM_CLOSED 0xFFFFFFFF
+
+// Returned by the block transfer functions when a block still had a CRC error
+// after SD_CRC_RETRIES retries. Only when SD_CRC is defined in sd_conf.h.
+#define SD_CRC_ERROR 0x80
+
+// Card Type
+#define SD_V1_SDSC      1
+#define SD_V2_SDSC      2
+#define SD_V2_SDHC_SDXC 3
+
 /*************************************************************
         GLOBALS
 **************************************************************/
 extern uint8_t SD_Buffer[SD_BUFFER_SIZE + 1]; // reserve 1 byte for the null
 extern uint8_t SD_ResponseToken;
+// With SD_CRC defined in sd_conf.h, the number of blocks transferred again
+// after a CRC error and the number of blocks that failed after all retries
+extern uint16_t SD_CrcRetries;
+extern uint16_t SD_CrcFailures;
 // Sectors below this value will not be written by the write functions.
 // Protected sectors could include Boot Sectors, FATs, Root Directory.
 // uint16_t SD_MaxProtectedSector;
@@ -105,6 +121,7 @@ typedef enum
     SD_NONCOMPATIBLE_VOLTAGE_RANGE,
     SD_POWER_UP_BIT_NOT_SET,
     SD_NOT_SD_CARD,
+    SD_CRC_ON_FAILED, // CMD59 was rejected, only with SD_CRC
     // SD_OP_COND_TIMEOUT,
     // SD_SET_BLOCKLEN_TIMEOUT,
     // SD_WRITE_BLOCK_TIMEOUT,
@@ -116,16 +133,68 @@ typedef enum
     // SD_SET_RELATIVE_ADDR_TIMEOUT
 } SD_RETURN_CODES;
 
+/* Card registers and geometry returned by sd_get_info() (SD_INFO) */
+typedef struct
+{
+    uint32_t capacity;     // number of 512 byte blocks
+    uint32_t max_clock;    // maximum transfer rate in Hz (TRAN_SPEED)
+    uint32_t au_size;      // allocation unit in blocks, 0 if not defined
+    uint16_t erase_size;   // number of AUs erased at once, 0 if not supported
+    uint8_t erase_timeout; // seconds to erase erase_size AUs
+    uint8_t erase_offset;  // seconds added to the erase timeout
+    uint8_t erase_sector;  // smallest erasable unit in blocks (SECTOR_SIZE)
+    uint8_t speed_class;   // speed class 0, 2, 4, 6 or 10 in MB/s
+    uint8_t card_type;     // SD_V1_SDSC, SD_V2_SDSC or SD_V2_SDHC_SDXC
+    uint8_t csd[16];       // CSD register, most significant byte first
+    uint8_t cid[16];       // CID register, most significant byte first
+} SD_INFO;
+
 /*************************************************************
         FUNCTION PROTOTYPES
 **************************************************************/
+/*
+        Timeouts
+        The waits for the card are limited to 100ms for a read, 250ms for a
+write and 1s for the initialization. With SD_TIMER_TICKS defined in sd_conf.h
+they are measured with TIMER_getTicks() of timer.h, and TIMER_tick_init() must
+be called before sd_init(). Otherwise the time is estimated from the number of
+bytes polled.
+
+        CRC check (SD_CRC in sd_conf.h)
+        The card is told to check the CRC of commands and written blocks with
+CMD59 and the CRC of read blocks is checked by the driver. A block with a CRC
+error is transferred again up to SD_CRC_RETRIES times (3 by default), counted
+by SD_CrcRetries, before the function gives up with SD_CRC_ERROR, counted by
+SD_CrcFailures. The CRC16 is calculated while the bytes are shifted.
+*/
 
 /*______________________________________________________________________________________________
         Initialize the SD card into SPI mode
+        The capacity and the maximum transfer rate are read from the CSD and
+the SPI clock is set to the fastest the card supports, at most fosc/2.
         returns 0 on success or error code
 ________________________________________________________________________________________________*/
 SD_RETURN_CODES sd_init(void);
 
+/*______________________________________________________________________________________________
+        Read the CSD, CID and SD Status (ACMD13) registers of the card. The
+allocation unit (AU) is the unit the card erases and writes best, so
+clusters aligned to it and pre-erase sizes of whole AUs give the fastest
+writes.
+
+        info	structure filled with the card geometry and the raw registers
+
+        return	0 on success, the R1 response of a failed command, 1 on a
+timeout or SD_CRC_ERROR
+_______________________________________________________________________________________________*/
+uint8_t sd_get_info(SD_INFO *info);
+
+/*______________________________________________________________________________________________
+        Return the number of 512 byte blocks of the card read by sd_init() or
+0 if unknown
+_______________________________________________________________________________________________*/
+uint32_t sd_capacity(void);
+
 /*______________________________________________________________________________________________
         Write a single block of data
 
@@ -139,9 +208,26 @@ size a card can support is (2^32)*512 = 2048 megabytes or 2 terabytes.
         token	0x00 - busy timeout
                         0x05 - data accepted
                         0xFF - response timeout
+
+        return	the R1 response of a rejected command, the data response token or
+SD_CRC_ERROR if the block still had a CRC error after the retries
+
+        The function returns when the data is accepted, while the card is
+still programming the block. The next function of this driver waits for the
+end of the programming. If it takes too long that function returns 1 without
+doing its transfer and the token is left at 0x00 (busy timeout). Call
+sd_stream_end() to wait for the block and get this result now.
+sd_write_busy() tells if the card is still programming.
 _______________________________________________________________________________________________*/
 uint8_t sd_write_single_block(uint32_t addr, uint8_t *buf);
 
+/*______________________________________________________________________________________________
+        Poll the card once after sd_write_single_block()
+
+        return	true while the card is programming the written block
+_______________________________________________________________________________________________*/
+bool sd_write_busy(void);
+
 /*______________________________________________________________________________________________
         Read a single block of data
 
@@ -155,7 +241,108 @@ size a card can support is (2^32)*512 = 2048 megabytes or 2 terabytes.
         token	0xFE - Successful read
                         0x0X - Data error (Note that some cards don't return an
 error token instead timeout will occur) 0xFF - Timeout
+
+        return	R1 response or SD_CRC_ERROR
 _______________________________________________________________________________________________*/
 uint8_t sd_read_single_block(uint32_t addr, uint8_t *buf);
 
+/*______________________________________________________________________________________________
+        Read consecutive blocks using a single READ_MULTIPLE_BLOCK (CMD18)
+command. Avoids the command overhead paid by each single block read.
+
+        addr	32-bit address of the first block
+        buf		a buffer of at least count * 512 bytes. Unlike the single
+block read no null is added at the end.
+        count	number of blocks to read
+
+        return	0 on success. SD_ResponseToken holds the last data token.
+_______________________________________________________________________________________________*/
+uint8_t sd_read_multiple_blocks(uint32_t addr, uint8_t *buf, uint16_t count);
+
+/*______________________________________________________________________________________________
+        Write consecutive blocks using a single WRITE_MULTIPLE_BLOCK (CMD25)
+command preceded by a pre-erase hint (ACMD23) of count blocks.
+
+        addr	32-bit address of the first block
+        buf		count * 512 bytes of data to write
+        count	number of blocks to write
+
+        return	0 on success. SD_ResponseToken is 0x05 if all the data was
+accepted.
+_______________________________________________________________________________________________*/
+uint8_t sd_write_multiple_blocks(uint32_t addr, const uint8_t *buf,
+                                 uint16_t count);
+
+/*______________________________________________________________________________________________
+        Fill consecutive blocks with 0 using a single WRITE_MULTIPLE_BLOCK
+(CMD25) command. The zeros are sent directly so no buffer is needed.
+
+        addr	32-bit address of the first block
+        count	number of blocks to clear
+
+        return	0 on success. SD_ResponseToken is 0x05 if all the data was
+accepted.
+_______________________________________________________________________________________________*/
+uint8_t sd_write_zero_blocks(uint32_t addr, uint16_t count);
+
+/*______________________________________________________________________________________________
+        Streaming multiple block transfers. A stream is started by a begin
+function, each call of the next function transfers one block at the following
+address and sd_stream_end() stops the transfer.
+        The card stays selected while the stream is open so the number of
+blocks doesn't have to be known in advance. Any other function of this driver
+will end an open stream first and returns 1 if that fails. End the stream
+before using other devices on the SPI bus.
+
+        addr		32-bit address of the first block
+        pre_erase	number of blocks expected to be written, sent with
+ACMD23 as a hint. Use 0 if unknown.
+        buf			512 bytes of data. sd_write_stream_next() writes a block of
+zeros if buf is 0.
+
+        return		0 on success. SD_ResponseToken holds the last token.
+_______________________________________________________________________________________________*/
+uint8_t sd_read_stream_begin(uint32_t addr);
+uint8_t sd_read_stream_next(uint8_t *buf);
+uint8_t sd_write_stream_begin(uint32_t addr, uint32_t pre_erase);
+uint8_t sd_write_stream_next(const uint8_t *buf);
+uint8_t sd_stream_end(void);
+
+/*______________________________________________________________________________________________
+        Single block transfers done in the background by the interrupt driven
+SPI engine. Available when SPI_ASYNC is defined in spi_conf.h.
+        The command and the wait for the start token of a read are done
+before returning, then the 512 data bytes are moved by the SPI interrupt while
+the program continues. callback is called from the interrupt when the data
+was transferred and can be NULL. sd_async_busy() can be polled instead.
+        The driver runs the SPI at fosc/2 after initialization, where the
+interrupt costs more cycles than the byte it moves. A background block is then
+slower than a blocking one and leaves no CPU time to the program. Background
+transfers only pay off with a card clocked at fosc/16 or slower.
+        The card stays selected until sd_stream_end() or any other function of
+this driver, which waits for the transfer to end. For a write it also waits
+for the data response and the programming of the block. No null is added
+after a block read this way. buf must not be changed until the transfer ends.
+        With SD_CRC the CRC of a read block is checked by sd_stream_end(), not
+before the callback, and the block is read again after a CRC error. The data
+of a read is valid only after sd_stream_end() returned 0.
+
+        addr		32-bit address of the block
+        buf			512 bytes of data
+
+        return		0 if the transfer was started. The result of the transfer is
+returned by sd_stream_end().
+_______________________________________________________________________________________________*/
+uint8_t sd_read_block_async(uint32_t addr, uint8_t *buf,
+                            void (*callback)(void));
+uint8_t sd_write_block_async(uint32_t addr, const uint8_t *buf,
+                             void (*callback)(void));
+bool sd_async_busy(void);
+
+/*______________________________________________________________________________________________
+        Return the address of the block that the next sd_read_stream_next()
+will read or SD_STREAM_CLOSED if no read stream is open
+_______________________________________________________________________________________________*/
+uint32_t sd_read_stream_position(void);
+
 #endif /* SD_H_ */
\ No newline at end of file
@@ -1,5 +1,20 @@
 #include "spi.h"
 
+#ifdef SPI_ASYNC
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+
+static SPI_Transfer *queue[SPI_ASYNC_QUEUE_SIZE];
+static uint8_t queue_head;    // next free slot
+static uint8_t queue_tail;    // transfer in progress
+static uint8_t queue_count;   // transfers left including the one in progress
+static uint16_t active_pos;   // byte of the transfer in progress
+static volatile bool running; // engine has transfers left
+
+static void spi_startTransfer(void);
+static void spi_finishTransfer(SPI_Transfer *transfer);
+#endif
+
 void SPI_init(const SPI_Init_Typedef *init)
 {
     // ATMEGA8 series specific pins for the hardware spi peripheral
@@ -30,3 +45,178 @@ uint16_t SPI_transferWord(uint16_t word)
     rxData |= (uint16_t)SPI_transferByte((uint8_t)(word & 0x00ff));
     return rxData;
 }
+
+void SPI_transmitBlock(const uint8_t *buf, uint16_t len)
+{
+    uint8_t next;
+
+    if (len == 0)
+        return;
+
+    SPDR = *buf++;
+    while (--len)
+    {
+        // load the next byte while the current one is shifted out
+        next = *buf++;
+        loop_until_bit_is_set(SPSR, SPIF);
+        SPDR = next;
+    }
+    loop_until_bit_is_set(SPSR, SPIF);
+
+    // reading SPDR after SPSR clears SPIF
+    next = SPDR;
+}
+
+void SPI_transmitFill(uint8_t byte, uint16_t len)
+{
+    if (len == 0)
+        return;
+
+    SPDR = byte;
+    while (--len)
+    {
+        // the byte doesn't change, so SPDR is written as soon as SPIF is set
+        loop_until_bit_is_set(SPSR, SPIF);
+        SPDR = byte;
+    }
+    loop_until_bit_is_set(SPSR, SPIF);
+
+    // reading SPDR after SPSR clears SPIF
+    byte = SPDR;
+}
+
+void SPI_receiveBlock(uint8_t *buf, uint16_t len)
+{
+    uint8_t byte;
+
+    if (len == 0)
+        return;
+
+    SPDR = 0xff;
+    while (--len)
+    {
+        loop_until_bit_is_set(SPSR, SPIF);
+        byte   = SPDR;
+        // start the next byte before storing this one
+        SPDR   = 0xff;
+        *buf++ = byte;
+    }
+    loop_until_bit_is_set(SPSR, SPIF);
+    *buf = SPDR;
+}
+
+void SPI_exchangeBlock(const uint8_t *tx, uint8_t *rx, uint16_t len)
+{
+    uint8_t byte, next;
+
+    if (len == 0)
+        return;
+
+    SPDR = *tx++;
+    while (--len)
+    {
+        next = *tx++;
+        loop_until_bit_is_set(SPSR, SPIF);
+        byte  = SPDR;
+        SPDR  = next;
+        *rx++ = byte;
+    }
+    loop_until_bit_is_set(SPSR, SPIF);
+    *rx = SPDR;
+}
+
+#ifdef SPI_ASYNC
+
+bool SPI_queueTransfer(SPI_Transfer *transfer)
+{
+    bool queued    = false;
+    transfer->done = false;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        if (queue_count < SPI_ASYNC_QUEUE_SIZE)
+        {
+            queue[queue_head] = transfer;
+            if (++queue_head == SPI_ASYNC_QUEUE_SIZE)
+                queue_head = 0;
+            queue_count++;
+            queued = true;
+
+            // When called from a callback the interrupt starts it next
+            if (!running)
+            {
+                running = true;
+                spi_startTransfer();
+            }
+        }
+    }
+    return queued;
+}
+
+bool SPI_isBusy(void) { return running; }
+
+void SPI_waitIdle(void)
+{
+    while (running)
+        ;
+}
+
+/**
+ * @brief send the first byte of the next transfer or stop the engine
+ *
+ * Called with interrupts disabled
+ */
+static void spi_startTransfer(void)
+{
+    SPI_Transfer *transfer;
+
+    while (queue_count)
+    {
+        transfer = queue[queue_tail];
+        if (transfer->len)
+        {
+            active_pos = 0;
+            SPCR |= SPI_SPCR_INTERUPT_EN;
+            SPDR = transfer->tx ? transfer->tx[0] : 0xff;
+            return;
+        }
+
+        // nothing to send
+        spi_finishTransfer(transfer);
+    }
+
+    // disable the interrupt so SPI_transferByte() can poll SPIF
+    SPCR &= ~SPI_SPCR_INTERUPT_EN;
+    running = false;
+}
+
+static void spi_finishTransfer(SPI_Transfer *transfer)
+{
+    if (++queue_tail == SPI_ASYNC_QUEUE_SIZE)
+        queue_tail = 0;
+    queue_count--;
+
+    transfer->done = true;
+    if (transfer->callback)
+        transfer->callback(transfer);
+}
+
+ISR(SPI_STC_vect)
+{
+    SPI_Transfer *transfer = queue[queue_tail];
+    uint8_t byte           = SPDR;
+
+    if (transfer->rx)
+        transfer->rx[active_pos] = byte;
+
+    if (++active_pos < transfer->len)
+    {
+        SPDR = transfer->tx ? transfer->tx[active_pos] : 0xff;
+        return;
+    }
+
+    spi_finishTransfer(transfer);
+    spi_startTransfer();
+}
+
+#endif // SPI_ASYNC
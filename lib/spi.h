@@ -4,6 +4,8 @@
 #include "avrlibdefs.h"
 #include "gpio.h"
 
+#include "spi_conf.h"
+
 #ifdef SPCR
 
 #define SPI_SPCR_INTERUPT_EN    _BV(SPIE)
@@ -43,6 +45,12 @@ void SPI_init(const SPI_Init_Typedef *init);
 /**
  * @brief send/receive a byte with the spi peripheral
  *
+ * The interrupt takes roughly 70 CPU cycles per byte with its entry and exit.
+ * At fosc/2 a byte is sent in 16 cycles, so the CPU spends the whole transfer
+ * in the interrupt and a block takes longer than with SPI_receiveBlock().
+ * The program only gets CPU time during a transfer at slower SPI clocks, from
+ * about fosc/16.
+ *
  * CS/SS must be controlled byte user application
  *
  * @param byte byte to send
@@ -60,6 +68,106 @@ uint8_t SPI_transferByte(uint8_t byte);
  */
 uint16_t SPI_transferWord(uint16_t word);
 
+/**
+ * @brief send a block of bytes and discard the received bytes
+ *
+ * The next byte is loaded while the current one is shifted out and is
+ * written to SPDR as soon as SPIF is set, so the bytes follow back-to-back.
+ * Meant for the fastest clock (fosc/2) where a byte takes 16 cycles.
+ *
+ * CS/SS must be controlled byte user application
+ *
+ * @param buf bytes to send
+ * @param len number of bytes
+ */
+void SPI_transmitBlock(const uint8_t *buf, uint16_t len);
+
+/**
+ * @brief send len copies of a byte and discard the received bytes
+ *
+ * Same back-to-back transfer as SPI_transmitBlock(), without loading the
+ * bytes from memory, to send a block of zeros for example.
+ *
+ * CS/SS must be controlled byte user application
+ *
+ * @param byte byte to send
+ * @param len number of bytes
+ */
+void SPI_transmitFill(uint8_t byte, uint16_t len);
+
+/**
+ * @brief receive a block of bytes while sending 0xff
+ *
+ * The next transfer is started before the received byte is stored
+ *
+ * CS/SS must be controlled byte user application
+ *
+ * @param buf buffer for the received bytes
+ * @param len number of bytes
+ */
+void SPI_receiveBlock(uint8_t *buf, uint16_t len);
+
+/**
+ * @brief send a block of bytes and store the received bytes
+ *
+ * CS/SS must be controlled byte user application
+ *
+ * @param tx bytes to send
+ * @param rx buffer for the received bytes, can be the same as tx
+ * @param len number of bytes
+ */
+void SPI_exchangeBlock(const uint8_t *tx, uint8_t *rx, uint16_t len);
+
+#ifdef SPI_ASYNC
+
+#ifndef SPI_ASYNC_QUEUE_SIZE
+#define SPI_ASYNC_QUEUE_SIZE 4
+#endif
+
+/**
+ * @brief descriptor of a transfer done by the interrupt driven engine
+ *
+ * The descriptor must stay valid until the transfer is done
+ */
+typedef struct SPI_Transfer
+{
+    const uint8_t *tx; // bytes to send or NULL to send 0xff
+    uint8_t *rx;       // buffer for the received bytes or NULL to discard them
+    uint16_t len;      // number of bytes to transfer
+    // called from the interrupt when the transfer is done, can be NULL
+    void (*callback)(struct SPI_Transfer *transfer);
+    volatile bool done; // set when the transfer is done
+} SPI_Transfer;
+
+/**
+ * @brief queue a transfer for the interrupt driven engine
+ *
+ * The transfers are done in the order they were queued, without gaps, by
+ * the SPI serial transfer complete interrupt. Global interrupts must be
+ * enabled. SPI_transferByte() and SPI_transferWord() must not be used while
+ * the engine is busy.
+ *
+ * CS/SS must be controlled byte user application
+ *
+ * @param transfer transfer descriptor
+ * @return true if the transfer was queued, false if the queue is full
+ */
+bool SPI_queueTransfer(SPI_Transfer *transfer);
+
+/**
+ * @brief check if the interrupt driven engine has transfers left
+ *
+ * @return true while queued transfers are not done
+ */
+bool SPI_isBusy(void);
+
+/**
+ * @brief wait until all the queued transfers are done
+ */
+void SPI_waitIdle(void);
+
+#endif // SPI_ASYNC
+
 #endif // SPCR
 
 #endif // __SPI__
\ No newline at end of file
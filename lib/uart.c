@@ -10,12 +10,31 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#ifdef UART_N
 #include <util/setbaud.h>
+#endif
 
 #include "buffer.h"
 
 #include "stream.h"
 
+// the vectors are numbered on devices with more than one USART
+#ifdef USART0_RX_vect
+#define UART0_RX_VECT   USART0_RX_vect
+#define UART0_UDRE_VECT USART0_UDRE_vect
+#else
+#define UART0_RX_VECT   USART_RX_vect
+#define UART0_UDRE_VECT USART_UDRE_vect
+#endif
+#define UART1_RX_VECT   USART1_RX_vect
+#define UART1_UDRE_VECT USART1_UDRE_vect
+
+#if defined(UART_N) &&                                  \
+    ((UART_N == 0 && defined(UART_INSTANCE_0)) ||       \
+     (UART_N == 1 && defined(UART_INSTANCE_1)))
+#error "the USART selected by UART_N can't also be a UART instance"
+#endif
+
 #ifdef UART_N
 
 #if UART_N == 0
@@ -24,13 +43,15 @@
 #define UCSRnA UCSR0A
 #define U2Xn   U2X0
 #define UDREn  UDRE0
+#define TXCn   TXC0
 #define RXCn   RXC0
 #define FEn    FE0
+#define MPCMn  MPCM0
 
 #define UCSRnB UCSR0B
 #define TXENn  TXEN0
 #define RXENn  RXEN0
-#define TXCIEn TXCIE0
+#define UDRIEn UDRIE0
 #define RXCIEn RXCIE0
 
 #define UCSRnC UCSR0C
@@ -39,19 +60,24 @@
 
 #define UDRn   UDR0
 
+#define UARTn_RX_VECT   UART0_RX_VECT
+#define UARTn_UDRE_VECT UART0_UDRE_VECT
+
 #elif UART_N == 1
 #define UBRRnH UBRR1H
 #define UBRRnL UBRR1L
 #define UCSRnA UCSR1A
 #define U2Xn   U2X1
 #define UDREn  UDRE1
+#define TXCn   TXC1
 #define RXCn   RXC1
 #define FEn    FE1
+#define MPCMn  MPCM1
 
 #define UCSRnB UCSR1B
 #define TXENn  TXEN1
 #define RXENn  RXEN1
-#define TXCIEn TXCIE1
+#define UDRIEn UDRIE1
 #define RXCIEn RXCIE1
 
 #define UCSRnC UCSR1C
@@ -60,6 +86,9 @@
 
 #define UDRn   UDR1
 
+#define UARTn_RX_VECT   UART1_RX_VECT
+#define UARTn_UDRE_VECT UART1_UDRE_VECT
+
 #endif
 
 #ifdef UART_RX_INTERUPT
@@ -70,9 +99,11 @@ static buffer_t rxbuff = BUFFER_CREATE(UART_RX_BUFFER_SIZE, _rxbuff);
 #ifdef UART_TX_INTERUPT
 static uint8_t _txbuff[UART_TX_BUFFER_SIZE];
 static buffer_t txbuff = BUFFER_CREATE(UART_TX_BUFFER_SIZE, _txbuff);
-volatile static bool tx_busy;
 #endif
 
+// a byte was written to UDRn since the last UART_flushTx
+static volatile bool tx_busy;
+
 #if defined(UART_INIT_STDOUT) && !defined(UART_INIT_STDIN)
 static FILE uart_stream =
     FDEV_SETUP_STREAM(UART_putChar, NULL, _FDEV_SETUP_WRITE);
@@ -86,6 +117,21 @@ static FILE uart_stream =
 
 static stream_t uart_io = STREAM_CREATE(UART_TransmitByte, UART_ReceiveByte);
 
+/**
+ * @brief Write a byte to the data register and clear the transmit complete
+ * flag, which is then only set again once this byte has been shifted out.
+ * The other flags of UCSRnA must be written as 0, the mode bits U2Xn and
+ * MPCMn are kept.
+ *
+ * @param c byte of data to send
+ */
+static inline void _UART_sendByte(uint8_t c)
+{
+    UDRn    = c;
+    UCSRnA  = (UCSRnA & ((1 << U2Xn) | (1 << MPCMn))) | (1 << TXCn);
+    tx_busy = true;
+}
+
 /**
  * @brief Initialize the UART using baud defined and enabling the tx and rx
  * interupts as defined.
@@ -109,9 +155,7 @@ void UART_init(void)
 #ifdef UART_RX_INTERUPT
     UCSRnB |= (1 << RXCIEn);
 #endif
-#ifdef UART_TX_INTERUPT
-    UCSRnB |= (1 << TXCIEn);
-#endif
+    // the tx interupt (UDRIEn) is only enabled while txbuff holds data
 
     UCSRnC = (1 << UCSZn1) | (1 << UCSZn0); /* 8 data bits, 1 stop bit */
 
@@ -133,30 +177,31 @@ bool UART_TransmitByte(uint8_t c, bool blocking)
 {
 #ifdef UART_TX_INTERUPT
 
-    if (!tx_busy)
+    if (BUFFER_empty(&txbuff) && bit_is_set(UCSRnA, UDREn))
     {
-        // send the first byte to start the ISR
-        tx_busy = true;
-        loop_until_bit_is_set(UCSRnA, UDREn);
-        UDRn = c; /* send data */
+        // nothing queued and the data register is free, skip the buffer
+        _UART_sendByte(c);
         return true;
     }
-    else
+
+    // the UDRE ISR will send the byte once the data register is free
+    // in case the buffer is full we need to wait
+    while (BUFFER_full(&txbuff) && blocking)
     {
-        // ISR will handle sending subsequent bytes
-        // in case the buffer is full we need to wait
-        while (BUFFER_full(&txbuff) && blocking)
-        {
-            ;
-        }
-        return BUFFER_enqueue(&txbuff, c);
+        ;
     }
+    if (!BUFFER_enqueue(&txbuff, c))
+    {
+        return false;
+    }
+    UCSRnB |= (1 << UDRIEn);
+    return true;
 #else // not interupt driven
     if (blocking)
     {
         /* Wait for empty transmit buffer */
         loop_until_bit_is_set(UCSRnA, UDREn);
-        UDRn = c; /* send data */
+        _UART_sendByte(c); /* send data */
         return true;
     }
     else if (bit_is_clear(UCSRnA, UDREn))
@@ -166,7 +211,7 @@ bool UART_TransmitByte(uint8_t c, bool blocking)
     else
     {
         // buffer empty
-        UDRn = c;
+        _UART_sendByte(c);
         return true;
     }
 #endif
@@ -221,6 +266,46 @@ bool UART_ReceiveByte(uint8_t *c, bool blocking)
 #endif
 }
 
+void UART_write(const uint8_t *buf, uint16_t len)
+{
+#ifdef UART_TX_INTERUPT
+    uint8_t n;
+
+    while (len)
+    {
+        // queue as much as fits, then let the ISR drain it
+        n = BUFFER_write(&txbuff, buf, len > 0xff ? 0xff : len);
+        if (n)
+        {
+            UCSRnB |= (1 << UDRIEn);
+            buf += n;
+            len -= n;
+        }
+    }
+#else
+    while (len--)
+    {
+        UART_TransmitByte(*buf++, true);
+    }
+#endif
+}
+
+void UART_flushTx(void)
+{
+#ifdef UART_TX_INTERUPT
+    while (!BUFFER_empty(&txbuff))
+    {
+        ;
+    }
+#endif
+    if (tx_busy)
+    {
+        // the last byte is in the data or shift register
+        loop_until_bit_is_set(UCSRnA, TXCn);
+        tx_busy = false;
+    }
+}
+
 uint8_t UART_available()
 {
 #ifdef UART_RX_INTERUPT
@@ -289,11 +374,13 @@ void UART_flush(void)
 
 #ifdef UART_RX_INTERUPT
 
-ISR(USART_RX_vect)
+ISR(UARTn_RX_VECT)
 {
-    volatile uint8_t response;
-    response = UDR0;
-    if (bit_is_clear(UCSRnA, FEn)) // if no framing error occurred
+    // the status must be read before UDRn, reading UDRn moves the receive
+    // FIFO and FEn then belongs to the next byte
+    uint8_t status = UCSRnA;
+    uint8_t response = UDRn;
+    if (!(status & (1 << FEn))) // if no framing error occurred
     {
         BUFFER_enqueue(&rxbuff, response);
     }
@@ -302,19 +389,196 @@ ISR(USART_RX_vect)
 
 #ifdef UART_TX_INTERUPT
 
-ISR(USART_TX_vect)
+ISR(UARTn_UDRE_VECT)
 {
     if (BUFFER_empty(&txbuff))
     {
         // buffer is empty, nothing to send
-        tx_busy = false;
+        UCSRnB &= ~(1 << UDRIEn);
+        return;
     }
-    else
+
+    // refill the data register while the previous byte is shifted out
+    _UART_sendByte(BUFFER_dequeue(&txbuff));
+    if (BUFFER_empty(&txbuff))
+    {
+        UCSRnB &= ~(1 << UDRIEn);
+    }
+}
+#endif
+
+#endif
+
+#if defined(UART_INSTANCE_0) || defined(UART_INSTANCE_1)
+
+// instances by USART number for the ISRs
+static UART_TypeDef *uart_instances[2];
+
+void UART_devInit(UART_TypeDef *u, uint32_t baud)
+{
+    uart_instances[u->port == UART_PORT0 ? 0 : 1] = u;
+
+    UART_devSetBaud(u, baud);
+
+    // the tx interupt (UDRIE0) is only enabled while txbuff holds data
+    u->port->ucsrb = (1 << TXEN0) | (1 << RXEN0) | (1 << RXCIE0);
+    u->port->ucsrc = (1 << UCSZ01) | (1 << UCSZ00); /* 8 data bits, 1 stop bit */
+}
+
+void UART_devSetBaud(UART_TypeDef *u, uint32_t baud)
+{
+    uint8_t ucsra = (1 << U2X0);
+    uint32_t div;
+
+    if (baud == 0)
+    {
+        baud = 1;
+    }
+    // UBRR = F_CPU / (8 * baud) - 1 rounded to the closest divider
+    div = (F_CPU / 8 + baud / 2) / baud;
+    if (div > 4096)
+    {
+        // UBRR has 12 bits, slow rates need the normal speed mode
+        ucsra = 0;
+        div   = (F_CPU / 16 + baud / 2) / baud;
+        if (div > 4096)
+        {
+            div = 4096;
+        }
+    }
+    else if (div == 0)
+    {
+        div = 1;
+    }
+
+    u->port->ubrrh = (div - 1) >> 8;
+    u->port->ubrrl = div - 1;
+    u->port->ucsra = (u->port->ucsra & (1 << MPCM0)) | ucsra;
+}
+
+/**
+ * @brief Write a byte to the data register of an instance and clear the
+ * transmit complete flag, see _UART_sendByte. The bits of UCSRnA are at the
+ * same positions for every USART.
+ *
+ * @param u UART instance
+ * @param c byte of data to send
+ */
+static inline void _UART_devSendByte(UART_TypeDef *u, uint8_t c)
+{
+    u->port->udr   = c;
+    u->port->ucsra =
+        (u->port->ucsra & ((1 << U2X0) | (1 << MPCM0))) | (1 << TXC0);
+    u->tx_busy     = true;
+}
+
+bool UART_devTransmitByte(UART_TypeDef *u, uint8_t c, bool blocking)
+{
+    if (BUFFER_empty(&u->txbuff) && bit_is_set(u->port->ucsra, UDRE0))
+    {
+        // nothing queued and the data register is free, skip the buffer
+        _UART_devSendByte(u, c);
+        return true;
+    }
+
+    while (BUFFER_full(&u->txbuff) && blocking)
+    {
+        ;
+    }
+    if (!BUFFER_enqueue(&u->txbuff, c))
+    {
+        return false;
+    }
+    u->port->ucsrb |= (1 << UDRIE0);
+    return true;
+}
+
+bool UART_devReceiveByte(UART_TypeDef *u, uint8_t *c, bool blocking)
+{
+    while (BUFFER_empty(&u->rxbuff))
+    {
+        if (!blocking)
+        {
+            return false;
+        }
+    }
+    *c = BUFFER_dequeue(&u->rxbuff);
+    return true;
+}
+
+uint8_t UART_devAvailable(UART_TypeDef *u)
+{
+    return BUFFER_available(&u->rxbuff);
+}
+
+void UART_devWrite(UART_TypeDef *u, const uint8_t *buf, uint16_t len)
+{
+    uint8_t n;
+
+    while (len)
+    {
+        // queue as much as fits, then let the ISR drain it
+        n = BUFFER_write(&u->txbuff, buf, len > 0xff ? 0xff : len);
+        if (n)
+        {
+            u->port->ucsrb |= (1 << UDRIE0);
+            buf += n;
+            len -= n;
+        }
+    }
+}
+
+void UART_devFlushTx(UART_TypeDef *u)
+{
+    while (!BUFFER_empty(&u->txbuff))
+    {
+        ;
+    }
+    if (u->tx_busy)
     {
-        // send the next byte
-        UDRn = BUFFER_dequeue(&txbuff);
+        // the last byte is in the data or shift register
+        loop_until_bit_is_set(u->port->ucsra, TXC0);
+        u->tx_busy = false;
     }
 }
+
+/**
+ * @brief Bodies of the ISRs, inlined in the ISR of each instance
+ *
+ * @param u UART instance
+ */
+static inline void _UART_devRx(UART_TypeDef *u)
+{
+    // read the status before the data as in ISR(UARTn_RX_VECT)
+    uint8_t status = u->port->ucsra;
+    uint8_t response = u->port->udr;
+    if (!(status & (1 << FE0))) // if no framing error occurred
+    {
+        BUFFER_enqueue(&u->rxbuff, response);
+    }
+}
+
+static inline void _UART_devUdre(UART_TypeDef *u)
+{
+    if (!BUFFER_empty(&u->txbuff))
+    {
+        // refill the data register while the previous byte is shifted out
+        _UART_devSendByte(u, BUFFER_dequeue(&u->txbuff));
+    }
+    if (BUFFER_empty(&u->txbuff))
+    {
+        u->port->ucsrb &= ~(1 << UDRIE0);
+    }
+}
+
+#ifdef UART_INSTANCE_0
+ISR(UART0_RX_VECT) { _UART_devRx(uart_instances[0]); }
+ISR(UART0_UDRE_VECT) { _UART_devUdre(uart_instances[0]); }
+#endif
+
+#ifdef UART_INSTANCE_1
+ISR(UART1_RX_VECT) { _UART_devRx(uart_instances[1]); }
+ISR(UART1_UDRE_VECT) { _UART_devUdre(uart_instances[1]); }
 #endif
 
 #endif
@@ -11,6 +11,9 @@
 #ifndef UART_H
 #define UART_H
 
+#include <avr/io.h>
+
+#include "buffer.h"
 #include "global.h"
 #include <stdbool.h>
 #include <stdint.h>
@@ -51,6 +54,22 @@ bool UART_TransmitByte(uint8_t c, bool blocking);
  */
 bool UART_ReceiveByte(uint8_t *c, bool blocking);
 
+/**
+ * @brief Send len bytes using the UART, blocking until all are queued
+ * When interupt driven transmittions are used the bytes are copied into the
+ * tx buffer in blocks and sent by the ISR.
+ *
+ * @param buf bytes to send
+ * @param len number of bytes to send
+ */
+void UART_write(const uint8_t *buf, uint16_t len);
+
+/**
+ * @brief Wait until all queued bytes have been shifted out of the UART
+ *
+ */
+void UART_flushTx(void);
+
 /**
  * @brief Return the number of bytes waiting in rx buffer
  *
@@ -128,4 +147,122 @@ void UART_print_u16(uint16_t v, uint8_t fp, bool rj, bool neg_sign);
  */
 void UART_print_i16(uint16_t v, uint8_t fp, bool rj);
 
+/**
+ * @brief UART_PORT_t defines the physical layout of the AVR hardware USART
+ * registers, the same for every USART of a device
+ *
+ */
+typedef struct
+{
+    uint8_t ucsra;
+    uint8_t ucsrb;
+    uint8_t ucsrc;
+    uint8_t ucsrd; // reserved on most devices
+    uint8_t ubrrl;
+    uint8_t ubrrh;
+    uint8_t udr;
+} UART_PORT_t;
+
+#ifdef UCSR0A
+#define UART_PORT0 (volatile UART_PORT_t *)&UCSR0A
+#endif
+
+#ifdef UCSR1A
+#define UART_PORT1 (volatile UART_PORT_t *)&UCSR1A
+#endif
+
+/**
+ * @brief UART_TypeDef holds one instance of the interupt driven UART: the
+ * registers of its USART and its rx and tx buffers
+ * Enable the instance API for a USART with UART_INSTANCE_0 or UART_INSTANCE_1
+ * in uart_conf.h. It can be used next to the UART_ functions of the USART
+ * selected by UART_N.
+ *
+ */
+typedef struct
+{
+    volatile UART_PORT_t *port;
+    buffer_t rxbuff;
+    buffer_t txbuff;
+    volatile bool tx_busy;
+} UART_TypeDef;
+
+/**
+ * @brief macro to simplify defining a UART instance
+ * The buffers are arrays of up to 255 bytes.
+ *
+ */
+#define UART_CREATE(PORT, RX_BUFF, TX_BUFF)                                   \
+    {                                                                         \
+        .port = PORT, .rxbuff = BUFFER_CREATE(sizeof(RX_BUFF), RX_BUFF),      \
+        .txbuff = BUFFER_CREATE(sizeof(TX_BUFF), TX_BUFF), .tx_busy = false   \
+    }
+
+/**
+ * @brief Initialize a UART instance
+ * Sets the baud rate, enables the transmitter and receiver and the rx
+ * interupt. Interupts must be enabled globally for the instance to run.
+ *
+ * @param u UART instance
+ * @param baud baud rate
+ */
+void UART_devInit(UART_TypeDef *u, uint32_t baud);
+
+/**
+ * @brief Change the baud rate of a UART instance
+ * The double speed mode is used for the closest divider to baud, the normal
+ * mode below F_CPU / 32768 (488 baud at 16 MHz). Rates outside F_CPU / 65536
+ * to F_CPU / 8 are clamped to the slowest or fastest rate.
+ *
+ * @param u UART instance
+ * @param baud baud rate
+ */
+void UART_devSetBaud(UART_TypeDef *u, uint32_t baud);
+
+/**
+ * @brief Transmit a byte using a UART instance, see UART_TransmitByte
+ *
+ * @param u UART instance
+ * @param c byte to transmit
+ * @param blocking wait for room in the tx buffer
+ * @return true transmition of byte was successful
+ * @return false the tx buffer was full and blocking was not set
+ */
+bool UART_devTransmitByte(UART_TypeDef *u, uint8_t c, bool blocking);
+
+/**
+ * @brief Receive a byte using a UART instance, see UART_ReceiveByte
+ *
+ * @param u UART instance
+ * @param c pointer to var where byte is to be recieved into
+ * @param blocking wait for a byte
+ * @return true receive of byte was successful
+ * @return false no byte was available and blocking was not set
+ */
+bool UART_devReceiveByte(UART_TypeDef *u, uint8_t *c, bool blocking);
+
+/**
+ * @brief Return the number of bytes waiting in the rx buffer of an instance
+ *
+ * @param u UART instance
+ * @return uint8_t number of bytes waiting in rx buffer
+ */
+uint8_t UART_devAvailable(UART_TypeDef *u);
+
+/**
+ * @brief Send len bytes using a UART instance, blocking until all are queued
+ *
+ * @param u UART instance
+ * @param buf bytes to send
+ * @param len number of bytes to send
+ */
+void UART_devWrite(UART_TypeDef *u, const uint8_t *buf, uint16_t len);
+
+/**
+ * @brief Wait until all queued bytes of an instance have been shifted out
+ *
+ * @param u UART instance
+ */
+void UART_devFlushTx(UART_TypeDef *u);
+
 #endif // UART_H